@@ -0,0 +1,494 @@
+// bcache.c - Block buffer cache
+//
+// Buffers are found by block number through a hash table. Unpinned buffers
+// are kept on an LRU list, least recently used first; a new block takes a
+// buffer that was never used, or else the least recently used unpinned one,
+// which is written back first if it is dirty. Looking up and linking buffers
+// never sleeps, so the lists need no lock; only device transfers sleep.
+//
+// Readahead is done by a kernel thread. bcache_prefetch pins a buffer for each
+// block and queues it; the thread reads the queued buffers in order and
+// unpins them. The thread runs whenever the threads that asked for readahead
+// sleep or return to user mode, so its reads overlap their work.
+//
+
+#ifndef TRACE
+#ifdef BCACHE_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef BCACHE_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "bcache.h"
+#include "memory.h"
+#include "console.h"
+#include "error.h"
+#include "string.h"
+
+#include <stdint.h>
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+#define BCACHE_BUCKETS 64
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct bcache_buf * bcache_lookup(uint64_t blkno);
+static struct bcache_buf * bcache_victim(void);
+static int bcache_read(struct bcache_buf * buf);
+static int bcache_writeback(struct bcache_buf * buf);
+static int bcache_sync_buf(struct bcache_buf * buf);
+static long bcache_transfer(uint64_t blkno, unsigned long cnt, void * buf, int write);
+static void bcache_readahead(void * arg);
+
+static void hash_insert(struct bcache_buf * buf);
+static void hash_remove(struct bcache_buf * buf);
+static void lru_insert(struct bcache_buf * buf);
+static void lru_remove(struct bcache_buf * buf);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct io_intf * bcache_io;
+
+// A seek and the transfer that follows it must not be separated.
+
+static struct lock bcache_io_lock;
+
+static struct bcache_buf bufs[BCACHE_NBUF];
+static unsigned int buf_cnt; // buffers used at least once
+static struct bcache_buf * buckets[BCACHE_BUCKETS];
+static struct bcache_buf * lru_head; // least recently used
+static struct bcache_buf * lru_tail; // most recently used
+
+static struct bcache_buf * ra_queue[BCACHE_RA_MAX]; // buffers to read, in order
+static unsigned int ra_head; // index of the first queued buffer
+static unsigned int ra_cnt; // buffers queued
+static struct condition ra_ready; // signalled when buffers are queued
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void bcache_init(struct io_intf * io) {
+    unsigned int i;
+    int tid;
+
+    trace("%s(%p)", __func__, io);
+
+    // allocating a page may sleep (to swap pages out), so the pages are all
+    // allocated here, where no other thread can use the cache yet
+    for (i = 0; i < BCACHE_NBUF; i++) {
+        bufs[i].data = memory_alloc_page_nozero();
+        lock_init(&bufs[i].lock, "bcache_buf");
+    }
+
+    lock_init(&bcache_io_lock, "bcache_io_lock");
+    condition_init(&ra_ready, "bcache_ra_ready");
+    bcache_io = io;
+
+    // the thread belongs to no process and runs in whatever memory space is
+    // active, all of which map the cache's buffers
+    tid = thread_spawn("readahead", bcache_readahead, NULL);
+    thread_set_process(tid, NULL);
+}
+
+/**
+ * gets the pinned buffer of a block
+ *
+ * @param blkno     block number
+ *
+ * @return          returns the buffer, holding the block, or NULL if the block
+ *                  cannot be read or no buffer is free
+ */
+
+struct bcache_buf * bcache_get(uint64_t blkno) {
+    struct bcache_buf * buf;
+
+    trace("%s(%lu)", __func__, (unsigned long)blkno);
+
+    for (;;) {
+        buf = bcache_lookup(blkno);
+
+        if (buf != NULL) {
+            if (buf->refcnt++ == 0)
+                lru_remove(buf);
+            break;
+        }
+
+        buf = bcache_victim();
+
+        if (buf == NULL)
+            return NULL;
+
+        // a dirty victim is written back first; another thread may look it
+        // up meanwhile, so the search starts over
+        if (buf->dirty) {
+            lru_remove(buf);
+            buf->refcnt = 1;
+            bcache_writeback(buf);
+            bcache_put(buf);
+
+            if (buf->dirty)
+                return NULL;
+            continue;
+        }
+
+        buf->blkno = blkno;
+        buf->valid = 0;
+        buf->refcnt = 1;
+        hash_insert(buf);
+        break;
+    }
+
+    // the first user reads the block; others wait for it on the buffer lock
+    if (!buf->valid) {
+        lock_acquire(&buf->lock);
+
+        if (!buf->valid && bcache_read(buf) == 0)
+            buf->valid = 1;
+
+        lock_release(&buf->lock);
+    }
+
+    if (!buf->valid) {
+        bcache_put(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+void bcache_put(struct bcache_buf * buf) {
+    if (buf->refcnt == 0)
+        panic("bcache_put: buffer not pinned");
+
+    if (--buf->refcnt == 0)
+        lru_insert(buf);
+}
+
+void bcache_mark_dirty(struct bcache_buf * buf) {
+    buf->dirty = 1;
+}
+
+/**
+ * reads consecutive blocks, coalescing the blocks that are not cached into
+ * runs read with one device request each
+ *
+ * @param blkno     first block
+ * @param cnt       number of blocks
+ * @param buf       receives the blocks
+ *
+ * @return          returns 0 on success or -EIO
+ */
+
+int bcache_read_blocks(uint64_t blkno, unsigned long cnt, void * buf) {
+    struct bcache_buf * cached;
+    unsigned long i, run;
+
+    trace("%s(%lu,%lu)", __func__, (unsigned long)blkno, cnt);
+
+    for (i = 0; i < cnt; i += run) {
+        // a cached block may still be on its way in (see bcache_prefetch);
+        // bcache_get waits for it, or reads it if nobody has started yet
+        if (bcache_lookup(blkno + i) != NULL) {
+            cached = bcache_get(blkno + i);
+            if (cached == NULL)
+                return -EIO;
+
+            memcpy(buf + i * BCACHE_BLKSZ, cached->data, BCACHE_BLKSZ);
+            bcache_put(cached);
+            run = 1;
+            continue;
+        }
+
+        for (run = 1; i + run < cnt; run++) {
+            if (bcache_lookup(blkno + i + run) != NULL)
+                break;
+        }
+
+        if (bcache_transfer(blkno + i, run, buf + i * BCACHE_BLKSZ, 0) != 0)
+            return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * writes consecutive blocks, coalescing the blocks that are not cached into
+ * runs written with one device request each
+ *
+ * @param blkno     first block
+ * @param cnt       number of blocks
+ * @param buf       blocks to write
+ *
+ * @return          returns 0 on success or -EIO
+ */
+
+int bcache_write_blocks(uint64_t blkno, unsigned long cnt, const void * buf) {
+    struct bcache_buf * cached;
+    unsigned long i, j, run;
+
+    trace("%s(%lu,%lu)", __func__, (unsigned long)blkno, cnt);
+
+    for (i = 0; i < cnt; i += run) {
+        // a cached block is changed in its buffer, which is written back later
+        if (bcache_lookup(blkno + i) != NULL) {
+            cached = bcache_get(blkno + i);
+            if (cached == NULL)
+                return -EIO;
+
+            memcpy(cached->data, buf + i * BCACHE_BLKSZ, BCACHE_BLKSZ);
+            bcache_mark_dirty(cached);
+            bcache_put(cached);
+            run = 1;
+            continue;
+        }
+
+        for (run = 1; i + run < cnt; run++) {
+            if (bcache_lookup(blkno + i + run) != NULL)
+                break;
+        }
+
+        if (bcache_transfer(blkno + i, run, (void *)buf + i * BCACHE_BLKSZ, 1) != 0)
+            return -EIO;
+
+        // a block read into the cache while the write was waiting for the
+        // device gets the new data too
+        for (j = i; j < i + run; j++) {
+            cached = bcache_lookup(blkno + j);
+            if (cached != NULL && cached->valid)
+                memcpy(cached->data, buf + j * BCACHE_BLKSZ, BCACHE_BLKSZ);
+        }
+    }
+
+    return 0;
+}
+
+void bcache_prefetch(uint64_t blkno, unsigned long cnt) {
+    struct bcache_buf * buf;
+    unsigned long i;
+
+    trace("%s(%lu,%lu)", __func__, (unsigned long)blkno, cnt);
+
+    for (i = 0; i < cnt && ra_cnt < BCACHE_RA_MAX; i++) {
+        if (bcache_lookup(blkno + i) != NULL)
+            continue;
+
+        // writing back a dirty buffer would sleep
+        buf = bcache_victim();
+
+        if (buf == NULL || buf->dirty)
+            break;
+
+        buf->blkno = blkno + i;
+        buf->valid = 0;
+        buf->refcnt = 1;
+        hash_insert(buf);
+
+        ra_queue[(ra_head + ra_cnt) % BCACHE_RA_MAX] = buf;
+        ra_cnt += 1;
+    }
+
+    if (ra_cnt != 0)
+        condition_broadcast(&ra_ready);
+}
+
+/**
+ * writes back the dirty buffers of consecutive blocks
+ *
+ * @param blkno     first block
+ * @param cnt       number of blocks
+ *
+ * @return          returns 0 on success or -EIO if a block could not be written
+ */
+
+int bcache_flush(uint64_t blkno, unsigned long cnt) {
+    struct bcache_buf * buf;
+    int result = 0;
+    unsigned long i;
+
+    trace("%s(%lu,%lu)", __func__, (unsigned long)blkno, cnt);
+
+    for (i = 0; i < cnt; i++) {
+        buf = bcache_lookup(blkno + i);
+
+        if (buf != NULL && bcache_sync_buf(buf) != 0)
+            result = -EIO;
+    }
+
+    return result;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+struct bcache_buf * bcache_lookup(uint64_t blkno) {
+    struct bcache_buf * buf;
+
+    for (buf = buckets[blkno % BCACHE_BUCKETS]; buf != NULL; buf = buf->hash_next) {
+        if (buf->blkno == blkno)
+            return buf;
+    }
+
+    return NULL;
+}
+
+// Returns a buffer for a new block: a buffer never used before, or the least
+// recently used unpinned buffer, which is unlinked unless it is dirty.
+// Returns NULL if every buffer is pinned.
+
+struct bcache_buf * bcache_victim(void) {
+    struct bcache_buf * buf;
+
+    if (buf_cnt < BCACHE_NBUF)
+        return &bufs[buf_cnt++];
+
+    buf = lru_head;
+
+    if (buf != NULL && !buf->dirty) {
+        lru_remove(buf);
+        hash_remove(buf);
+    }
+
+    return buf;
+}
+
+int bcache_read(struct bcache_buf * buf) {
+    return bcache_transfer(buf->blkno, 1, buf->data, 0);
+}
+
+// Writes back the pinned buffer /buf/ if it is dirty. The buffer is marked
+// clean before the transfer, so that a change made while it is in progress
+// marks it dirty again; a failed write does the same.
+
+int bcache_writeback(struct bcache_buf * buf) {
+    lock_acquire(&buf->lock);
+
+    if (!buf->dirty) {
+        lock_release(&buf->lock);
+        return 0;
+    }
+
+    buf->dirty = 0;
+
+    if (bcache_transfer(buf->blkno, 1, buf->data, 1) != 0)
+        buf->dirty = 1;
+
+    lock_release(&buf->lock);
+
+    return buf->dirty ? -EIO : 0;
+}
+
+// Writes back /buf/ if it is dirty, pinning it while the write is in
+// progress. Returns 0 or -EIO.
+
+int bcache_sync_buf(struct bcache_buf * buf) {
+    int result;
+
+    if (!buf->dirty)
+        return 0;
+
+    if (buf->refcnt++ == 0)
+        lru_remove(buf);
+
+    result = bcache_writeback(buf);
+    bcache_put(buf);
+
+    return result;
+}
+
+// Reads (or writes, if /write/ is set) /cnt/ blocks starting at /blkno/ into
+// (or from) /buf/. Returns 0 or -EIO.
+
+long bcache_transfer(uint64_t blkno, unsigned long cnt, void * buf, int write) {
+    const long len = cnt * BCACHE_BLKSZ;
+    long result;
+
+    lock_acquire(&bcache_io_lock);
+
+    if (ioseek(bcache_io, blkno * BCACHE_BLKSZ) != 0)
+        result = -EIO;
+    else if (write)
+        result = iowrite(bcache_io, buf, len);
+    else
+        result = ioread_full(bcache_io, buf, len);
+
+    lock_release(&bcache_io_lock);
+
+    return (result == len) ? 0 : -EIO;
+}
+
+// Readahead thread: reads the queued buffers, unless a bcache_get got to one
+// first, and unpins them. A buffer that cannot be read stays invalid and is
+// read again by the next bcache_get.
+
+void bcache_readahead(void * arg __attribute__ ((unused))) {
+    struct bcache_buf * buf;
+
+    for (;;) {
+        while (ra_cnt == 0)
+            condition_wait(&ra_ready);
+
+        buf = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % BCACHE_RA_MAX;
+        ra_cnt -= 1;
+
+        lock_acquire(&buf->lock);
+
+        if (!buf->valid && bcache_read(buf) == 0)
+            buf->valid = 1;
+
+        lock_release(&buf->lock);
+        bcache_put(buf);
+    }
+}
+
+void hash_insert(struct bcache_buf * buf) {
+    struct bcache_buf ** const head = &buckets[buf->blkno % BCACHE_BUCKETS];
+
+    buf->hash_next = *head;
+    *head = buf;
+}
+
+void hash_remove(struct bcache_buf * buf) {
+    struct bcache_buf ** link = &buckets[buf->blkno % BCACHE_BUCKETS];
+
+    while (*link != buf)
+        link = &(*link)->hash_next;
+
+    *link = buf->hash_next;
+}
+
+void lru_insert(struct bcache_buf * buf) {
+    buf->lru_prev = lru_tail;
+    buf->lru_next = NULL;
+
+    if (lru_tail != NULL)
+        lru_tail->lru_next = buf;
+    else
+        lru_head = buf;
+
+    lru_tail = buf;
+}
+
+void lru_remove(struct bcache_buf * buf) {
+    if (buf->lru_prev != NULL)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        lru_head = buf->lru_next;
+
+    if (buf->lru_next != NULL)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        lru_tail = buf->lru_prev;
+
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+}
@@ -0,0 +1,108 @@
+// bcache.h - Block buffer cache
+//
+// Caches blocks of a block device in page-sized buffers. A buffer is pinned
+// while it is in use (between bcache_get and bcache_put) and is never evicted
+// then. Changes are written back when a dirty buffer is evicted or when
+// bcache_flush is called.
+//
+
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include "io.h"
+#include "lock.h"
+
+#include <stdint.h>
+
+// COMPILE-TIME CONFIGURATION
+//
+
+// Size of a block, and of a buffer
+
+#ifndef BCACHE_BLKSZ
+#define BCACHE_BLKSZ 4096
+#endif
+
+// Number of buffers (all allocated by bcache_init)
+
+#ifndef BCACHE_NBUF
+#define BCACHE_NBUF 64
+#endif
+
+// Largest number of buffers pinned by readahead at a time
+
+#ifndef BCACHE_RA_MAX
+#define BCACHE_RA_MAX (BCACHE_NBUF / 4)
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A cached block. Only /blkno/ and /data/ are for users of the cache; the
+// other fields belong to bcache.c.
+
+struct bcache_buf {
+    uint64_t blkno; // block number on the device
+    uint8_t * data; // BCACHE_BLKSZ bytes
+    uint32_t refcnt; // pins
+    uint8_t valid; // data holds the block
+    uint8_t dirty; // data differs from the device
+    struct lock lock; // held while the buffer is read or written back
+    struct bcache_buf * hash_next;
+    struct bcache_buf * lru_prev; // LRU list of unpinned buffers
+    struct bcache_buf * lru_next;
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void bcache_init(struct io_intf * io)
+// Caches blocks of the block device /io/ and starts the readahead thread. Must
+// be called once, before any other function of the cache.
+
+extern void bcache_init(struct io_intf * io);
+
+// struct bcache_buf * bcache_get(uint64_t blkno)
+// Returns the pinned buffer of block /blkno/, reading the block if it is not
+// cached. Returns NULL if the block cannot be read or every buffer is pinned.
+
+extern struct bcache_buf * bcache_get(uint64_t blkno);
+
+// void bcache_put(struct bcache_buf * buf)
+// Unpins a buffer returned by bcache_get.
+
+extern void bcache_put(struct bcache_buf * buf);
+
+// void bcache_mark_dirty(struct bcache_buf * buf)
+// Records that the data of the pinned buffer /buf/ was changed, so that it is
+// written back before the buffer is reused.
+
+extern void bcache_mark_dirty(struct bcache_buf * buf);
+
+// int bcache_read_blocks(uint64_t blkno, unsigned long cnt, void * buf)
+// int bcache_write_blocks(uint64_t blkno, unsigned long cnt, const void * buf)
+// Transfer the /cnt/ consecutive blocks starting at /blkno/ between the device
+// and /buf/, which must be direct-mapped memory. Blocks that are cached are
+// copied from or to their buffers; each run of blocks that are not cached is
+// transferred at once, straight from or to /buf/, and is not added to the
+// cache. Return 0 or -EIO.
+
+extern int bcache_read_blocks(uint64_t blkno, unsigned long cnt, void * buf);
+extern int bcache_write_blocks(uint64_t blkno, unsigned long cnt, const void * buf);
+
+// void bcache_prefetch(uint64_t blkno, unsigned long cnt)
+// Starts reading the /cnt/ blocks starting at /blkno/ into the cache, without
+// waiting for them. Blocks that are cached are skipped. Buffers are set aside
+// for the blocks right away, so a bcache_get of one of them before the
+// readahead thread reaches it reads it itself instead of reading it twice.
+// Fewer blocks are read if the cache has no clean buffer to spare.
+
+extern void bcache_prefetch(uint64_t blkno, unsigned long cnt);
+
+// int bcache_flush(uint64_t blkno, unsigned long cnt)
+// Writes back the dirty buffers among the /cnt/ blocks starting at /blkno/.
+// Blocks that are not cached are skipped. Returns 0 or -EIO.
+
+extern int bcache_flush(uint64_t blkno, unsigned long cnt);
+
+#endif // _BCACHE_H_
@@ -29,6 +29,8 @@ static inline size_t round_up_size(size_t n, size_t blksz) {
     return (n + blksz-1) / blksz * blksz;
 }
 
+static int elf_load_eager(struct io_intf *io, const Elf64_Phdr * phdr, uint8_t rwxug_flags);
+
 /** 
  * elf_load - Load an ELF executable from an I/O interface.
  * 
@@ -37,10 +39,14 @@ static inline size_t round_up_size(size_t n, size_t blksz) {
  *            the ELF file if loading is successful.
  * 
  * This function reads the ELF header, validates its magic number, type, and endianness,
- * and then loads each program segment marked with `PT_LOAD` into memory at its specified
- * virtual address (`p_vaddr`). It also zeroes out any remaining space if the memory size
- * (`p_memsz`) is larger than the file size (`p_filesz`). If all validation and loading
- * steps are successful, `entryptr` is set to the ELF file's entry point.
+ * and then sets up each program segment marked with `PT_LOAD` at its specified virtual
+ * address (`p_vaddr`). Segments are demand-paged: each becomes a region of the process
+ * backed by /io/, and a page is read from the file only when it is first touched. The
+ * space between the file size (`p_filesz`) and the memory size (`p_memsz`) is zero-filled.
+ * A segment whose file offset is not congruent to its address modulo the page size (or
+ * that does not fit in the region table) is loaded eagerly instead. The regions hold
+ * their own references to /io/. If all validation and loading steps are successful,
+ * `entryptr` is set to the ELF file's entry point.
  * 
  * Returns:
  *      0 on success
@@ -58,6 +64,8 @@ static inline size_t round_up_size(size_t n, size_t blksz) {
  */
 int elf_load(struct io_intf *io, void (**entryptr)(void)){
     Elf64_Ehdr elf_header;
+    uint64_t file_len;
+    int result;
 
     // 1. Read and validate ELF Header
     if(ioread_full(io, &elf_header, sizeof(Elf64_Ehdr)) != sizeof(Elf64_Ehdr)){
@@ -77,6 +85,10 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)){
         return -9; // NOT Little-Endian
     }
 
+    if (ioctl(io, IOCTL_GETLEN, &file_len) != 0){
+        return -1; // Size of the file is needed to check segments
+    }
+
     // 3. Parse and load each program header
     for (uint16_t i = 0; i < elf_header.e_phnum; i++) {
         Elf64_Phdr phdr;
@@ -97,13 +109,15 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)){
         
         if (phdr.p_type == PT_LOAD) {
             // Check if segment is within the allowed memory range
-            if (phdr.p_vaddr < USER_START_VMA || (phdr.p_vaddr + phdr.p_memsz) > USER_END_VMA) {
+            if (phdr.p_vaddr < USER_START_VMA || (phdr.p_vaddr + phdr.p_memsz) > USER_END_VMA ||
+                phdr.p_filesz > phdr.p_memsz) {
                 return -6; // Segment is out of bounds
             }
 
-            // Align virtual address and memory size
-            uintptr_t aligned_vaddr = round_down_addr(phdr.p_vaddr, PAGE_SIZE);
-            size_t aligned_memsz = round_up_size(phdr.p_memsz, PAGE_SIZE);
+            // The file data must be in the file, or a later page fault would fail
+            if (phdr.p_offset > file_len || phdr.p_filesz > file_len - phdr.p_offset) {
+                return -8; // Failed to load segment
+            }
 
             // Convert program header flags (p_flags) to PTE Flags
             uint8_t rwxug_flags = 0;
@@ -112,28 +126,33 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)){
             if (phdr.p_flags & PF_X) rwxug_flags |= PTE_X;
             rwxug_flags |= PTE_U; // User-accessible by default
 
-            // Map memory for the segment
-            void *mapped_range = memory_alloc_and_map_range(aligned_vaddr, aligned_memsz, rwxug_flags | PTE_W);
-            if(!mapped_range) {
-                return -10;
-            }
-            
-            // Load the segment into memory at p_vaddr
-            if (ioseek(io, phdr.p_offset) != 0) {
-                return -7; // Failed to seek to segment offset
-            }
-            
-            if (ioread_full(io, (void *)phdr.p_paddr, phdr.p_filesz) != phdr.p_filesz) {
-                return -8; // Failed to load segment
-            }
-
-            // Zero out remaining memory if p_memsz > p_filesz
-            if (phdr.p_memsz > phdr.p_filesz) {
-                memset((void *)(phdr.p_vaddr + phdr.p_filesz), 0, phdr.p_memsz - phdr.p_filesz);
-            }
-
-            // Set range flags for the segment 
-            memory_set_range_flags((const void *)aligned_vaddr, aligned_memsz, rwxug_flags);
+            struct vm_region rgn;
+
+            rgn.start = round_down_addr(phdr.p_vaddr, PAGE_SIZE);
+            rgn.end = round_up_size(phdr.p_vaddr + phdr.p_memsz, PAGE_SIZE);
+            rgn.io = io;
+            rgn.offset = phdr.p_offset;
+            rgn.data_start = phdr.p_vaddr;
+            rgn.data_end = phdr.p_vaddr + phdr.p_filesz;
+            rgn.flags = rwxug_flags;
+            rgn.shared = 0;
+
+            // Pages can only be read straight from the file if the segment's
+            // offset within a page matches that of its file data
+            if ((phdr.p_offset - phdr.p_vaddr) % PAGE_SIZE == 0 &&
+                memory_add_region(&rgn) == 0)
+                continue;
+
+            result = elf_load_eager(io, &phdr, rwxug_flags);
+            if (result != 0)
+                return result;
+
+            // The segment is now fully mapped, but it still gets an anonymous
+            // region so that mmap does not hand out its addresses (if the
+            // table has room)
+            rgn.io = NULL;
+            rgn.data_end = rgn.data_start;
+            memory_add_region(&rgn);
         }
     }
 
@@ -147,3 +166,50 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)){
     return 0; // Success
 }
 
+
+// Reads a whole segment into freshly mapped memory at p_vaddr. The kernel
+// has no direct access to user memory, so the data goes through a kernel page
+// and copy_to_user. The rest of the segment is already zero, since
+// memory_alloc_and_map_range maps zeroed pages. Used for segments that cannot
+// be demand-paged.
+
+int elf_load_eager(struct io_intf *io, const Elf64_Phdr * phdr, uint8_t rwxug_flags) {
+    // Align virtual address and memory size
+    uintptr_t aligned_vaddr = round_down_addr(phdr->p_vaddr, PAGE_SIZE);
+    size_t aligned_memsz = round_up_size(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE) - aligned_vaddr;
+
+    // Map memory for the segment
+    void *mapped_range = memory_alloc_and_map_range(aligned_vaddr, aligned_memsz, rwxug_flags | PTE_W);
+    if(!mapped_range) {
+        return -10;
+    }
+
+    // Load the segment into memory at p_vaddr
+    if (ioseek(io, phdr->p_offset) != 0) {
+        return -7; // Failed to seek to segment offset
+    }
+
+    char * const kbuf = memory_alloc_page_nozero();
+    uint64_t done = 0;
+    size_t n;
+
+    while (done < phdr->p_filesz) {
+        n = (phdr->p_filesz - done < PAGE_SIZE) ? phdr->p_filesz - done : PAGE_SIZE;
+
+        if (ioread_full(io, kbuf, n) != n ||
+            copy_to_user((void *)(phdr->p_vaddr + done), kbuf, n) != 0)
+        {
+            memory_free_page(kbuf);
+            return -8; // Failed to load segment
+        }
+
+        done += n;
+    }
+
+    memory_free_page(kbuf);
+
+    // Set range flags for the segment
+    memory_set_range_flags((const void *)aligned_vaddr, aligned_memsz, rwxug_flags);
+
+    return 0;
+}
@@ -5,6 +5,8 @@
 #include "csr.h"
 #include "halt.h"
 #include "memory.h"
+#include "process.h"
+#include "config.h"
 
 #include <stddef.h>
 
@@ -16,17 +18,39 @@
 extern void smode_excp_handler(unsigned int code, struct trap_frame * tfr);
 extern void umode_excp_handler(unsigned int code, struct trap_frame * tfr);
 
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Entry of the exception fixup table: if the instruction at /insn/ faults on
+// a user address and the fault cannot be resolved, execution continues at
+// /fixup/ instead.
+
+struct excp_fixup {
+    uintptr_t insn;
+    uintptr_t fixup;
+};
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
 static void __attribute__ ((noreturn)) default_excp_handler (
     unsigned int code, const struct trap_frame * tfr);
 
+static uintptr_t find_fixup(uintptr_t pc);
+
 // IMPORTED FUNCTION DECLARATIONS
 //
 
 extern void syscall_handler(struct trap_frame * tfr); // syscall.c
 
+// IMPORTED VARIABLE DECLARATIONS
+//
+
+// Fixup table of the user memory access routines (trapasm.s)
+
+extern const struct excp_fixup _user_fixup_table[];
+extern const struct excp_fixup _user_fixup_table_end[];
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -49,7 +73,38 @@ static const char * const excp_names[] = {
 // EXPORTED FUNCTION DEFINITIONS
 //
 
+/**
+ * smode_excp_handler - handles exceptions while running in supervisor mode.
+ * 
+ * A page fault on a user address is raised when the kernel copies from or to
+ * a user buffer (see copy_from_user) that is not populated yet or is shared
+ * copy-on-write. It is resolved the same way as a fault from user mode. If
+ * that fails and the faulting instruction has an entry in the fixup table,
+ * execution resumes at the fixup, which makes the copy fail. Every other
+ * exception is fatal.
+ * 
+ * @param code  The exception code indicating the type of exception.
+ * @param tfr   Pointer to the trap frame structure.
+ */
 void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
+    const uintptr_t stval = csrr_stval();
+    uintptr_t fixup;
+
+    if ((code == RISCV_SCAUSE_LOAD_PAGE_FAULT ||
+        code == RISCV_SCAUSE_STORE_PAGE_FAULT) &&
+        USER_START_VMA <= stval && stval < USER_END_VMA)
+    {
+        if (memory_handle_page_fault((void *)stval, code) == 0)
+            return;
+        
+        fixup = find_fixup(tfr->sepc);
+
+        if (fixup != 0) {
+            tfr->sepc = fixup;
+            return;
+        }
+    }
+
 	default_excp_handler(code, tfr);
 }
 /**
@@ -76,8 +131,8 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     case RISCV_SCAUSE_INSTR_PAGE_FAULT: // instruction page fault
     case RISCV_SCAUSE_LOAD_PAGE_FAULT: // load page fault
     case RISCV_SCAUSE_STORE_PAGE_FAULT: // store/amo page fault
-        console_printf("page fault in supervisor mode\n");
-        memory_handle_page_fault((void *)csrr_stval());
+        if (memory_handle_page_fault((void *)csrr_stval(), code) != 0)
+            process_exit();
         break;
     case RISCV_SCAUSE_ECALL_FROM_UMODE:
         syscall_handler(tfr); // Pass trap frame to syscall handler
@@ -103,3 +158,17 @@ void default_excp_handler (
 	
     panic(NULL);
 }
+
+// Returns the fixup address for a faulting instruction at /pc/, or 0 if the
+// instruction has no fixup.
+
+uintptr_t find_fixup(uintptr_t pc) {
+    const struct excp_fixup * fx;
+
+    for (fx = _user_fixup_table; fx < _user_fixup_table_end; fx++) {
+        if (fx->insn == pc)
+            return fx->fixup;
+    }
+
+    return 0;
+}
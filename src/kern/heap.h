@@ -6,15 +6,52 @@
 
 #include <stddef.h>
 
-//           Initializes the heap memory manager (for small objects).
+struct kmem_cache; // opaque
+
+//           Allocation statistics of an object cache (see heap_get_stats).
+
+struct heap_stats {
+    const char * name;
+    size_t objsize; // object size in bytes
+    unsigned long inuse; // objects allocated and not freed
+    unsigned long allocs; // allocations since boot
+    unsigned long frees; // frees since boot
+    unsigned long pages; // pages held by the cache
+};
+
+//           Initializes the heap memory manager (for small objects). The memory
+//           comes from the page allocator, which must be set up before the first
+//           allocation.
 
 extern void heap_init(void * start, void * end);
 extern char heap_initialized;
 
+//           kmalloc serves requests of up to 2 kB from size-class caches and larger
+//           requests with a block of pages from the page allocator; it panics if
+//           memory runs out. kfree returns memory from kmalloc, kcalloc or krealloc
+//           (NULL is ignored) and panics on a pointer that did not come from them.
+
 extern void * kmalloc(size_t size);
 extern void * kcalloc(size_t n, size_t size);
 extern void * krealloc(void * ptr, size_t size);
 extern void kfree(void * ptr);
 
+//           Object caches for frequently allocated types. kmem_cache_create creates a
+//           cache of /size/-byte objects (at most 2 kB); caches are never destroyed.
+//           Objects from kmem_cache_alloc are not zeroed and are returned with
+//           kmem_cache_free (or kfree).
+
+extern struct kmem_cache * kmem_cache_create(const char * name, size_t size);
+extern void * kmem_cache_alloc(struct kmem_cache * cache);
+extern void kmem_cache_free(struct kmem_cache * cache, void * obj);
+
+//           int heap_get_stats(int i, struct heap_stats * st)
+//           Stores the statistics of the /i/-th object cache in *st, starting at 0,
+//           and returns 0, or returns -1 if there is no such cache. The size classes
+//           come first; the last entry, "kmalloc-pages", counts the requests served
+//           by the page allocator in pages (inuse and pages are then equal).
+
+extern int heap_get_stats(int i, struct heap_stats * st);
+
 //           _HEAP_H_
 #endif
@@ -10,11 +10,26 @@
 #include "error.h"
 #include "memory.h"
 #include "lock.h"
+#include "text.h"
+#include "bcache.h"
 
 // constant definitions
 #define FS_BLKSZ      4096
 #define FS_NAMELEN    32
 #define FS_MAXOPEN    32
+#define FS_MAXBLOCKS  1023        // data blocks of a file (see inode_t)
+#define FS_MAXDENTRY  63          // directory entries (see boot_block_t)
+#define FS_DIRHASH    64          // buckets of the directory name index
+#define FS_NEGCACHE   16          // names remembered as not found
+#define FS_RA_MIN     2           // readahead window of a new sequential stream (blocks)
+#define FS_RA_MAX     16          // largest readahead window (blocks)
+#define FS_ICACHE     FS_MAXOPEN  // inodes in use (every open file can have its own)
+
+#define FS_INODE_BLKNO(i)  (1 + (uint64_t)(i))
+#define FS_DATA_BLKNO(d)   (1 + (uint64_t)boot_block->num_inodes + (d))
+
+#define FS_F_OPEN     1           // file struct flags
+#define FS_F_WRITTEN  2
 
 
 // internal type definitions
@@ -34,13 +49,13 @@ typedef struct boot_block_t{
     uint32_t num_inodes;
     uint32_t num_data;
     uint8_t reserved[52];
-    dentry_t dir_entries[63];
+    dentry_t dir_entries[FS_MAXDENTRY];
 }__attribute((packed)) boot_block_t;
 
 
 typedef struct inode_t{
     uint32_t byte_len;
-    uint32_t data_block_num[1023];
+    uint32_t data_block_num[FS_MAXBLOCKS];
 }__attribute((packed)) inode_t;
 
 
@@ -49,6 +64,29 @@ typedef struct data_block_t{
 }__attribute((packed)) data_block_t;
 
 
+// inode in use. refcnt counts the open files using it; the inode's block
+// stays pinned in the buffer cache while the entry is in use, and an unused
+// inode may still be found there.
+
+
+typedef struct icache_entry_t{
+    uint32_t inode_number;
+    uint32_t refcnt;
+    struct bcache_buf * buf;    // buffer holding the inode
+    inode_t * inode;            // buf's data
+    struct rwlock lock;         // shared by readers of the file, exclusive for writers
+} icache_entry_t;
+
+
+// name that was looked up and not found
+
+
+typedef struct neg_dentry_t{
+    uint32_t hash;              // fs_name_hash of the name
+    char name[FS_NAMELEN];      // not null terminated if FS_NAMELEN long
+} neg_dentry_t;
+
+
 // file struct. see 7.2 in cp1 docs
 
 
@@ -58,6 +96,11 @@ struct file_struct {
     uint64_t file_size;
     uint64_t inode_number;
     uint64_t flags;  
+    icache_entry_t * ip;    // cached inode of the file
+    uint64_t ra_pos;        // end of the last read; a read from here is sequential
+    uint32_t ra_window;     // blocks to read ahead, 0 if access is random
+    uint32_t ra_next;       // first block not read ahead yet
+    struct lock lock;       // serializes operations on this open file
 };
 
 
@@ -72,6 +115,16 @@ int fs_getlen(struct file_struct* fd, void* arg);
 int fs_getpos(struct file_struct* fd, void* arg);
 int fs_setpos(struct file_struct* fd, void* arg);
 int fs_getblksz(struct file_struct* fd, void* arg);
+int fs_getino(struct file_struct* fd, void* arg);
+int fs_flush(struct file_struct* fd);
+icache_entry_t * iget(uint32_t inode_number);
+void iput(icache_entry_t * ip);
+uint32_t fs_block_run(const inode_t * inode, uint32_t block_index, uint32_t max);
+void fs_readahead(struct file_struct* fd, uint64_t start, uint64_t end);
+void fs_lock_file(struct file_struct* fd, int write);
+void fs_unlock_file(struct file_struct* fd, int write);
+uint32_t fs_name_hash(const char* name);
+dentry_t * fs_lookup(const char* name);
 
 
 // struct that contains the pointers to our fs functions
@@ -86,11 +139,21 @@ static const struct io_ops fs_io_ops = {
 // global variables
 struct io_intf * vioblk_io;
 char fs_initialized;
-struct boot_block_t boot_block;
+boot_block_t * boot_block;         // pinned in the buffer cache
 struct file_struct file_structs[FS_MAXOPEN];
-inode_t inode;
-data_block_t data_block;
-static struct lock fs_lock;
+icache_entry_t icache[FS_ICACHE];
+static struct lock fs_lock;         // directory, open-file table and inode table
+
+// directory name index, built by fs_mount. Entries are chained by index; -1
+// ends a chain. The directory never changes while mounted, so neither the
+// index nor the names found missing need invalidation.
+int8_t dir_hash[FS_DIRHASH];
+int8_t dir_next[FS_MAXDENTRY];
+neg_dentry_t neg_dentries[FS_NEGCACHE];   // direct-mapped by hash; empty if name[0] is 0
+
+// free slots of the open-file table, as a stack
+uint8_t free_slots[FS_MAXOPEN];
+int free_slot_cnt;
 
 /**
  * fs_mount - Initializes the filesystem for use.
@@ -115,29 +178,52 @@ int fs_mount(struct io_intf* blkio) {
     }
 
 
-    // set position to the beginning of io device
-    uint64_t offset = 0;
-    if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &offset) != 0) {
-        console_printf("issue setting block device offset to 0\n");
-        return -1;
-    }
+    // all block accesses go through the buffer cache
+    bcache_init(blkio);
 
 
-    // attempt to read bootblock
-    if (ioread(blkio, (void *)&boot_block, FS_BLKSZ) < 0) {
+    // attempt to read bootblock, which stays in the cache
+    struct bcache_buf * boot_buf = bcache_get(0);
+    if (!boot_buf) {
         console_printf("error: failed to read bootblock\n");
         return -1;
     }
 
+    boot_block = (boot_block_t *)boot_buf->data;
+
+
+    console_printf("boot block read successfully, inodes: %u, data blocks: %u\n", boot_block->num_inodes, boot_block->num_data);
+
+
+    // index the directory by name
+    uint32_t num_dentry = boot_block->num_dentry;
+    if (num_dentry > FS_MAXDENTRY) {
+        num_dentry = FS_MAXDENTRY;
+    }
+
+    memset(dir_hash, -1, sizeof(dir_hash));
+    memset(neg_dentries, 0, sizeof(neg_dentries));
 
-    console_printf("boot block read successfully, inodes: %u, data blocks: %u\n", boot_block.num_inodes, boot_block.num_data);
+    for (int i = num_dentry - 1; i >= 0; i--) {
+        // earlier entries go first in their chain, so the first of two
+        // equal names wins, as with a linear scan
+        uint32_t h = fs_name_hash(boot_block->dir_entries[i].file_name) % FS_DIRHASH;
+        dir_next[i] = dir_hash[h];
+        dir_hash[h] = i;
+    }
 
 
     // mark fs as initialized
     fs_initialized = 1;
    
-    // init file structs array
+    // init file structs array, with every slot free
     memset(file_structs, 0, sizeof(file_structs));
+
+    for (int i = 0; i < FS_MAXOPEN; i++) {
+        free_slots[i] = FS_MAXOPEN - 1 - i;
+    }
+
+    free_slot_cnt = FS_MAXOPEN;
     return 0;
 }
 
@@ -168,21 +254,8 @@ int fs_open(const char* name, struct io_intf** ioptr) {
     }
 
 
-    // new file
-    struct file_struct * file = NULL;
-
-
-    for (int i = 0; i < FS_MAXOPEN; i++) {
-        if (file_structs[i].flags == 0) {
-            file = &file_structs[i];
-            console_printf("found available slot at index %d\n", i);
-            break;
-        }
-    }
-
-
-    // check if we found a valid file slot
-    if (file == NULL) {
+    // check if there is a free file slot
+    if (free_slot_cnt == 0) {
         console_printf("no available file slots\n");
         lock_release(&fs_lock);
         return -1;
@@ -190,22 +263,7 @@ int fs_open(const char* name, struct io_intf** ioptr) {
 
 
     // search for file in directory entries
-    struct dentry_t * dentry = NULL;
-   
-    for (int i = 0; i < boot_block.num_dentry; i++) {
-        // ensure file name is null terminated
-        char fname[FS_NAMELEN + 1];
-        strncpy(fname, boot_block.dir_entries[i].file_name, FS_NAMELEN);
-        fname[FS_NAMELEN] = '\0';
-
-
-        // compare the provided name with the directory entry
-        if (strncmp(name, fname, FS_NAMELEN) == 0) {
-            dentry = &boot_block.dir_entries[i];
-            break;
-        }
-    }
-
+    struct dentry_t * dentry = fs_lookup(name);
 
     if (!dentry) {
         console_printf("file not found in directory entries\n");
@@ -214,23 +272,22 @@ int fs_open(const char* name, struct io_intf** ioptr) {
     }
 
 
+    // new file, in the most recently freed slot
+    struct file_struct * file = &file_structs[free_slots[free_slot_cnt - 1]];
+
+
     // set file position
     file->file_position = 0;
+    file->ra_pos = 0;
+    file->ra_window = 0;
+    file->ra_next = 0;
+    lock_init(&file->lock, "kfs_file");
     file->inode_number = dentry->inode;
 
 
-    // set position to inode start
-    uint64_t inode_pos = FS_BLKSZ + file->inode_number * FS_BLKSZ;
-    if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_pos) != 0) {
-        console_printf("can't set file position\n");
-        lock_release(&fs_lock); 
-        return -1;
-    }
-
-
-    // read inode data
-    uint64_t bytes_read = vioblk_io->ops->read(vioblk_io, &inode, sizeof(struct inode_t));
-    if (bytes_read != sizeof(struct inode_t)) {
+    // get the inode from the inode cache, reading it if it is not cached
+    file->ip = iget(file->inode_number);
+    if (!file->ip) {
         console_printf("can't read inode\n");
         lock_release(&fs_lock);
         return -1;
@@ -238,8 +295,9 @@ int fs_open(const char* name, struct io_intf** ioptr) {
 
 
     // initialize file structure with inode data
-    file->file_size = inode.byte_len;
-    file->flags = 1;                        // mark file as in use
+    file->file_size = file->ip->inode->byte_len;
+    file->flags = FS_F_OPEN;                // mark file as in use
+    free_slot_cnt -= 1;
     file->io.ops = &fs_io_ops;
     *ioptr = &file->io;
 
@@ -266,14 +324,36 @@ int fs_open(const char* name, struct io_intf** ioptr) {
  * @return              None. Marks the associated file struct as unused.
  */
 void fs_close(struct io_intf* io) {
-    for (int i = 0; i < FS_MAXOPEN; i++) {
-        if (&file_structs[i].io == io) {
-            file_structs[i].flags = 0;
-            break;
-        }
+    // retrieve file struct from io_intf
+    struct file_struct* file = (struct file_struct*)((char*)io - offsetof(struct file_struct, io));
+
+
+    // write back the blocks of the file; this sleeps, so it is done before
+    // taking fs_lock. Other dirty blocks stay cached until they are evicted.
+    if (file->flags & FS_F_WRITTEN) {
+        fs_flush(file);
+    }
+
+
+    lock_acquire(&fs_lock);
+
+    // check that the file is open
+    if (file < file_structs || file >= file_structs + FS_MAXOPEN || file->flags == 0) {
+        lock_release(&fs_lock);
+        return;
     }
 
 
+    // drop the file's reference to its cached inode
+    iput(file->ip);
+    file->ip = NULL;
+    file->flags = 0;
+
+
+    // give the slot back
+    free_slots[free_slot_cnt++] = file - file_structs;
+
+    lock_release(&fs_lock);
     return;
 }
 
@@ -294,12 +374,8 @@ void fs_close(struct io_intf* io) {
  *                      does not extend the file size or create new files.
  */
 long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
-    // Acquire lock
-    lock_acquire(&fs_lock);
-
     // make sure the parameters are valid
     if (!io || !buf) {
-        lock_release(&fs_lock); // Release lock before returning
         return -1;
     }
 
@@ -310,21 +386,23 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
 
     // ensure the file struct is valid and in use
     if (file->flags == 0) {
-        lock_release(&fs_lock); // Release lock before returning
         return -2;
     }
 
 
     // make sure the file system is initialized
     if (!fs_initialized) {
-        lock_release(&fs_lock); // Release lock before returning
         return -3;
     }
 
 
+    // lock the open file, and its inode exclusively
+    fs_lock_file(file, 1);
+
+
     // check if we are at the end of a file
     if (file->file_position >= file->file_size) {
-        lock_release(&fs_lock); // Release lock before returning
+        fs_unlock_file(file, 1);
         return 0;
     }
 
@@ -335,33 +413,15 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     }
 
 
-    // read the inode associated with the file
+    // the inode associated with the file is in the inode cache
     uint32_t inode_number = file->inode_number;
-
-
-    // calculate the inode's offset in the filesystem
-    uint64_t inode_offset = FS_BLKSZ + (inode_number * FS_BLKSZ);
-
-
-    // read the inode
-    if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_offset) != 0) {
-    lock_release(&fs_lock); // Release lock before returning
-        return -1; // Error setting position
-    }
-
-
-    long bytes_read = vioblk_io->ops->read(vioblk_io, &inode, sizeof(inode_t));
-    if (bytes_read != sizeof(inode_t)) {
-    lock_release(&fs_lock);
-        return -5;
-    }
+    const inode_t * inode = file->ip->inode;
 
 
     // initialize variables for reading the data
     unsigned long total_bytes_written = 0;
     unsigned long bytes_to_write = n;
     uint64_t file_pos = file->file_position;
-    long bytes_written;
 
 
     while (bytes_to_write > 0) {
@@ -371,25 +431,37 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
 
 
         // check if block index exceeds the max number of blocks allowed
-        if (block_index >= sizeof(struct inode_t)) {
+        if (block_index >= FS_MAXBLOCKS) {
             break;
         }
 
 
         // get the data block number
-        uint32_t data_block_num = inode.data_block_num[block_index];
+        uint32_t data_block_num = inode->data_block_num[block_index];
+
 
+        // whole blocks that are consecutive on disk are written at once,
+        // straight from buf
+        if (block_offset == 0 && bytes_to_write >= FS_BLKSZ) {
+            uint32_t run = fs_block_run(inode, block_index, bytes_to_write / FS_BLKSZ);
 
-        // calculate the offset of the data block in the filesystem
-        uint64_t data_block_offset = FS_BLKSZ                             // boot block size
-                                   + (boot_block.num_inodes * FS_BLKSZ)   // total inode size
-                                   + (data_block_num * FS_BLKSZ)          // data block offset
-                                   + block_offset;                        // mem offset
+            if (bcache_write_blocks(FS_DATA_BLKNO(data_block_num), run, (char*)buf + total_bytes_written) != 0) {
+                fs_unlock_file(file, 1);
+                return -6;
+            }
 
+            total_bytes_written += run * FS_BLKSZ;
+            bytes_to_write -= run * FS_BLKSZ;
+            file_pos += run * FS_BLKSZ;
+            file->flags |= FS_F_WRITTEN;
+            continue;
+        }
 
-        // write to the data block
-        if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &data_block_offset) != 0) {
-            lock_release(&fs_lock);
+
+        // get the data block from the buffer cache
+        struct bcache_buf * data_buf = bcache_get(FS_DATA_BLKNO(data_block_num));
+        if (!data_buf) {
+            fs_unlock_file(file, 1);
             return -6;
         }
 
@@ -399,15 +471,11 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
         unsigned long bytes_this_write = (bytes_to_write < bytes_available) ? bytes_to_write : bytes_available;
 
 
-        // copy the data to the buffer
-        memcpy(data_block.data, (char*)buf + total_bytes_written, bytes_this_write);
-
-
-        bytes_written = vioblk_io->ops->write(vioblk_io, &data_block, bytes_this_write);
-        if (bytes_written != bytes_this_write) {
-            lock_release(&fs_lock);
-            return -7;
-        }
+        // copy the data to the buffer; it is written back later
+        memcpy(data_buf->data + block_offset, (char*)buf + total_bytes_written, bytes_this_write);
+        bcache_mark_dirty(data_buf);
+        bcache_put(data_buf);
+        file->flags |= FS_F_WRITTEN;
 
 
         // update counters
@@ -420,7 +488,11 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     // update file position
     file->file_position = file_pos;
 
-    lock_release(&fs_lock);
+    // cached pages of the file no longer match it
+    if (total_bytes_written > 0)
+        text_invalidate(inode_number);
+
+    fs_unlock_file(file, 1);
 
     // return the number of bytes read
     return total_bytes_written;
@@ -444,12 +516,8 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
  */
 long fs_read(struct io_intf* io, void* buf, unsigned long n)
 {
-    // Acquire lock
-    lock_acquire(&fs_lock);
-
     // make sure the parameters are valid
     if (!io || !buf) {
-        lock_release(&fs_lock);
         return -1;
     }
 
@@ -460,21 +528,23 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
 
     // ensure the file struct is valid and in use
     if (file->flags == 0) {
-        lock_release(&fs_lock); // Release lock before returning
         return -1;
     }
 
 
     // make sure the file system is initialized
     if (!fs_initialized) {
-        lock_release(&fs_lock); // Release lock before returning
         return -1;
     }
 
 
+    // lock the open file, and its inode shared with other readers
+    fs_lock_file(file, 0);
+
+
     // check if we are at the end of a file
     if (file->file_position >= file->file_size) {
-        lock_release(&fs_lock); // Release lock before returning
+        fs_unlock_file(file, 0);
         return 0;
     }
 
@@ -485,26 +555,12 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
     }
 
 
-    // read the inode associated with the file
-    uint32_t inode_number = file->inode_number;
-
-
-    // calculate the inode's offset in the filesystem
-    uint64_t inode_offset = FS_BLKSZ + (inode_number * FS_BLKSZ);
-
-
-    // read the inode
-    if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_offset) != 0) {
-        lock_release(&fs_lock);
-        return -1; // Error setting position
-    }
+    // the inode associated with the file is in the inode cache
+    const inode_t * inode = file->ip->inode;
 
 
-    long bytes_read = vioblk_io->ops->read(vioblk_io, &inode, sizeof(inode_t));
-    if (bytes_read != sizeof(inode_t)) {
-        lock_release(&fs_lock);
-        return -1;
-    }
+    // start reading the blocks after this read if the file is read sequentially
+    fs_readahead(file, file->file_position, file->file_position + n);
 
 
     // initialize variables for reading the data
@@ -520,24 +576,36 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
 
 
         // check if block index exceeds the max number of blocks allowed
-        if (block_index >= sizeof(struct inode_t)) {
+        if (block_index >= FS_MAXBLOCKS) {
             break;
         }
 
 
         // get the data block number
-        uint32_t data_block_num = inode.data_block_num[block_index];
+        uint32_t data_block_num = inode->data_block_num[block_index];
 
 
-        // calculate the offset of the data block in the filesystem
-        uint64_t data_block_offset = FS_BLKSZ                             // boot block size
-                                   + (boot_block.num_inodes * FS_BLKSZ)   // total inode size
-                                   + (data_block_num * FS_BLKSZ);         // data block offset
+        // whole blocks that are consecutive on disk are read at once,
+        // straight into buf
+        if (block_offset == 0 && bytes_to_read >= FS_BLKSZ) {
+            uint32_t run = fs_block_run(inode, block_index, bytes_to_read / FS_BLKSZ);
 
+            if (bcache_read_blocks(FS_DATA_BLKNO(data_block_num), run, buf + total_bytes_read) != 0) {
+                fs_unlock_file(file, 0);
+                return -1;
+            }
 
-        // read the data block
-        if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &data_block_offset) != 0) {
-            lock_release(&fs_lock);
+            total_bytes_read += run * FS_BLKSZ;
+            bytes_to_read -= run * FS_BLKSZ;
+            file_pos += run * FS_BLKSZ;
+            continue;
+        }
+
+
+        // read the data block through the buffer cache
+        struct bcache_buf * data_buf = bcache_get(FS_DATA_BLKNO(data_block_num));
+        if (!data_buf) {
+            fs_unlock_file(file, 0);
             return -1;
         }
 
@@ -547,15 +615,9 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
         unsigned long bytes_this_read = (bytes_to_read < bytes_available) ? bytes_to_read : bytes_available;
 
 
-        bytes_read = vioblk_io->ops->read(vioblk_io, &data_block, sizeof(data_block_t));
-        if (bytes_read != sizeof(data_block_t)) {
-            lock_release(&fs_lock);
-            return -1;
-        }
-
-
         // copy the data to the buffer
-        memcpy(buf + total_bytes_read, data_block.data + block_offset, bytes_this_read);
+        memcpy(buf + total_bytes_read, data_buf->data + block_offset, bytes_this_read);
+        bcache_put(data_buf);
 
 
         // update counters
@@ -568,7 +630,7 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
     // update file position
     file->file_position = file_pos;
 
-    lock_release(&fs_lock); // Release lock before returning
+    fs_unlock_file(file, 0);
 
     // return the number of bytes read
     return total_bytes_read;
@@ -590,18 +652,19 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
  *                      or a negative error code for unsupported commands.
  */
 int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
-    lock_acquire(&fs_lock);
-
     // retrieve file struct from io_intf
     struct file_struct* file = (struct file_struct*)((char*)io - offsetof(struct file_struct, io));
 
 
     // check if the file is valid and open
     if (!file || !file->flags) {
-        lock_release(&fs_lock);
         return -1;
     }
 
+
+    // the commands only touch the open file's own state
+    lock_acquire(&file->lock);
+
     int result;
     // route the command to the appropriate helper function
     switch(cmd) {
@@ -619,11 +682,20 @@ int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
         case IOCTL_GETBLKSZ:
             result = fs_getblksz(file, arg);
             break;
+
+        case IOCTL_GETINO:
+            result = fs_getino(file, arg);
+            break;
+
+        case IOCTL_FLUSH:
+            result = fs_flush(file);
+            break;
         default:
-            return -ENOTSUP;
+            result = -ENOTSUP;
+            break;
     }
     
-    lock_release(&fs_lock);
+    lock_release(&file->lock);
     return result;
 }
 
@@ -737,3 +809,370 @@ int fs_getblksz(struct file_struct* fd, void* arg) {
     return 0;
 }
 
+
+
+
+
+
+/**
+ * fs_getino - Retrieves the inode number of a file.
+ *
+ * @param fd            Pointer to the file's file_struct.
+ * @param arg           Pointer to store the inode number.
+ *
+ * @return              Returns 0 on success, or a negative error code on failure.
+ */
+int fs_getino(struct file_struct* fd, void* arg) {
+    // check if fd and arg are valid pointers
+    if (!fd || !arg) {
+        return -1;
+    }
+
+
+    // store the inode number in memory location pointed by arg
+    *(uint64_t*)arg = fd->inode_number;
+    return 0;
+}
+
+
+
+
+
+
+/**
+ * fs_flush - Writes back the file's changed blocks from the buffer cache.
+ *
+ * @param fd            Pointer to the file's file_struct.
+ *
+ * @return              Returns 0 on success, or -EIO if a block could not be
+ *                      written.
+ */
+int fs_flush(struct file_struct* fd) {
+    const inode_t * inode = fd->ip->inode;
+    uint32_t file_blocks = (fd->file_size + FS_BLKSZ - 1) / FS_BLKSZ;
+    uint32_t block_index, run;
+    int result = 0;
+
+
+    if (file_blocks > FS_MAXBLOCKS) {
+        file_blocks = FS_MAXBLOCKS;
+    }
+
+
+    // each run of blocks that are consecutive on disk is one range of the cache
+    for (block_index = 0; block_index < file_blocks; block_index += run) {
+        run = fs_block_run(inode, block_index, file_blocks - block_index);
+
+        if (bcache_flush(FS_DATA_BLKNO(inode->data_block_num[block_index]), run) != 0) {
+            result = -EIO;
+        }
+    }
+
+
+    if (result == 0) {
+        fd->flags &= ~FS_F_WRITTEN;
+    }
+
+    return result;
+}
+
+
+
+
+
+
+/**
+ * iget - Gets an inode, pinning its block in the buffer cache. Must be called
+ *        with fs_lock held.
+ *
+ * @param inode_number  Number of the inode.
+ *
+ * @return              Returns the inode's entry with a new reference, or NULL
+ *                      if the inode number is invalid, every entry is in use,
+ *                      or the inode cannot be read.
+ */
+icache_entry_t * iget(uint32_t inode_number) {
+    icache_entry_t * ip = NULL;
+
+
+    // check that the inode exists
+    if (inode_number >= boot_block->num_inodes) {
+        return NULL;
+    }
+
+
+    // look for the inode among the inodes in use, and remember a free entry
+    for (int i = 0; i < FS_ICACHE; i++) {
+        if (icache[i].refcnt > 0 && icache[i].inode_number == inode_number) {
+            icache[i].refcnt += 1;
+            return &icache[i];
+        }
+
+        if (icache[i].refcnt == 0 && !ip) {
+            ip = &icache[i];
+        }
+    }
+
+
+    // check if there is a free entry
+    if (!ip) {
+        return NULL;
+    }
+
+
+    // get the inode's block, from the buffer cache if it is still there
+    ip->buf = bcache_get(FS_INODE_BLKNO(inode_number));
+    if (!ip->buf) {
+        return NULL;
+    }
+
+    ip->inode_number = inode_number;
+    ip->inode = (inode_t *)ip->buf->data;
+    ip->refcnt = 1;
+    rwlock_init(&ip->lock, "kfs_inode");
+    return ip;
+}
+
+
+
+
+
+
+/**
+ * iput - Drops a reference to an inode. The last reference unpins the inode's
+ *        block. Must be called with fs_lock held.
+ *
+ * @param ip            Entry of the inode.
+ *
+ * @return              None.
+ */
+void iput(icache_entry_t * ip) {
+    if (!ip || ip->refcnt == 0) {
+        return;
+    }
+
+
+    if (--ip->refcnt == 0) {
+        bcache_put(ip->buf);
+        ip->buf = NULL;
+        ip->inode = NULL;
+    }
+}
+
+
+
+
+
+
+/**
+ * fs_block_run - Counts the data blocks of a file, starting at a block, that
+ *                are consecutive on disk.
+ *
+ * @param inode         Inode of the file.
+ * @param block_index   Index of the first block in the file.
+ * @param max           Largest count wanted (at least 1).
+ *
+ * @return              Returns the number of blocks in the run, at least 1.
+ */
+uint32_t fs_block_run(const inode_t * inode, uint32_t block_index, uint32_t max) {
+    uint32_t run = 1;
+
+
+    // mkfs lays files out contiguously, so runs are usually the whole file
+    while (run < max && block_index + run < FS_MAXBLOCKS &&
+           inode->data_block_num[block_index + run] == inode->data_block_num[block_index] + run) {
+        run++;
+    }
+
+
+    return run;
+}
+
+
+
+
+
+
+/**
+ * fs_readahead - Tracks the access pattern of a file and starts reading the
+ *                blocks after a sequential read into the buffer cache. The
+ *                window grows with each sequential read, up to FS_RA_MAX
+ *                blocks, and collapses on a read from anywhere else.
+ *
+ * @param fd            Pointer to the file's file_struct.
+ * @param start         File position of the read.
+ * @param end           File position after the read.
+ *
+ * @return              None.
+ */
+void fs_readahead(struct file_struct* fd, uint64_t start, uint64_t end) {
+    const inode_t * inode = fd->ip->inode;
+
+
+    // a read that continues the previous one is sequential
+    if (start == fd->ra_pos) {
+        fd->ra_window = fd->ra_window ? fd->ra_window * 2 : FS_RA_MIN;
+        if (fd->ra_window > FS_RA_MAX) {
+            fd->ra_window = FS_RA_MAX;
+        }
+    } else {
+        fd->ra_window = 0;
+        fd->ra_next = 0;
+    }
+
+    fd->ra_pos = end;
+
+    if (fd->ra_window == 0) {
+        return;
+    }
+
+
+    // blocks from the end of this read to the end of the window, skipping
+    // those already read ahead
+    uint32_t first = (end + FS_BLKSZ - 1) / FS_BLKSZ;
+    uint32_t last = first + fd->ra_window;
+    uint32_t file_blocks = (fd->file_size + FS_BLKSZ - 1) / FS_BLKSZ;
+
+    if (first < fd->ra_next) {
+        first = fd->ra_next;
+    }
+
+    if (last > file_blocks) {
+        last = file_blocks;
+    }
+
+    if (last > FS_MAXBLOCKS) {
+        last = FS_MAXBLOCKS;
+    }
+
+
+    // one request per run of blocks that are consecutive on disk
+    while (first < last) {
+        uint32_t run = fs_block_run(inode, first, last - first);
+        bcache_prefetch(FS_DATA_BLKNO(inode->data_block_num[first]), run);
+        first += run;
+    }
+
+    if (fd->ra_next < last) {
+        fd->ra_next = last;
+    }
+}
+
+
+
+
+
+
+/**
+ * fs_lock_file - Locks an open file for a read or write, and its inode shared
+ *                for a read or exclusively for a write. Readers of the same
+ *                file through different opens, and users of different files,
+ *                do not wait for each other.
+ *
+ * @param fd            Pointer to the file's file_struct.
+ * @param write         Nonzero to lock the inode exclusively.
+ *
+ * @return              None.
+ */
+void fs_lock_file(struct file_struct* fd, int write) {
+    lock_acquire(&fd->lock);
+
+    if (write) {
+        rwlock_acquire_exclusive(&fd->ip->lock);
+    } else {
+        rwlock_acquire_shared(&fd->ip->lock);
+    }
+}
+
+
+
+
+
+
+/**
+ * fs_unlock_file - Releases the locks taken by fs_lock_file.
+ *
+ * @param fd            Pointer to the file's file_struct.
+ * @param write         Nonzero if the inode is locked exclusively.
+ *
+ * @return              None.
+ */
+void fs_unlock_file(struct file_struct* fd, int write) {
+    if (write) {
+        rwlock_release_exclusive(&fd->ip->lock);
+    } else {
+        rwlock_release_shared(&fd->ip->lock);
+    }
+
+    lock_release(&fd->lock);
+}
+
+
+
+
+
+
+/**
+ * fs_name_hash - Hashes a file name, of which at most FS_NAMELEN characters
+ *                count (like the names in directory entries).
+ *
+ * @param name          Name to hash.
+ *
+ * @return              Returns the hash of the name.
+ */
+uint32_t fs_name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+
+
+    // FNV-1a
+    for (int i = 0; i < FS_NAMELEN && name[i] != '\0'; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+
+
+    return h;
+}
+
+
+
+
+
+
+/**
+ * fs_lookup - Finds a file's directory entry through the name index. Names
+ *             that are not found are remembered, so that repeated lookups of
+ *             a missing name do not walk the index. Must be called with
+ *             fs_lock held.
+ *
+ * @param name          Name of the file.
+ *
+ * @return              Returns the directory entry, or NULL if there is none.
+ */
+dentry_t * fs_lookup(const char* name) {
+    uint32_t h = fs_name_hash(name);
+    neg_dentry_t * neg = &neg_dentries[h % FS_NEGCACHE];
+
+
+    // check if the name is known to be missing
+    if (neg->name[0] != '\0' && neg->hash == h &&
+        strncmp(name, neg->name, FS_NAMELEN) == 0) {
+        return NULL;
+    }
+
+
+    // walk the name's chain
+    for (int i = dir_hash[h % FS_DIRHASH]; i >= 0; i = dir_next[i]) {
+        if (strncmp(name, boot_block->dir_entries[i].file_name, FS_NAMELEN) == 0) {
+            return &boot_block->dir_entries[i];
+        }
+    }
+
+
+    // remember the missing name, replacing the one in its slot
+    if (name[0] != '\0') {
+        neg->hash = h;
+        strncpy(neg->name, name, FS_NAMELEN);
+    }
+
+    return NULL;
+}
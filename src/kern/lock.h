@@ -22,10 +22,27 @@ struct lock {
     int tid; // thread holding lock or -1
 };
 
+// A reader/writer sleep lock: any number of threads may hold it shared, or
+// one thread exclusively. A thread waiting for exclusive access keeps new
+// readers out, so writers are not starved.
+
+struct rwlock {
+    struct condition cond;
+    int readers; // threads holding the lock shared
+    int writer; // thread holding the lock exclusively or -1
+    int writers_waiting;
+};
+
 static inline void lock_init(struct lock * lk, const char * name);
 static inline void lock_acquire(struct lock * lk);
 static inline void lock_release(struct lock * lk);
 
+static inline void rwlock_init(struct rwlock * rw, const char * name);
+static inline void rwlock_acquire_shared(struct rwlock * rw);
+static inline void rwlock_release_shared(struct rwlock * rw);
+static inline void rwlock_acquire_exclusive(struct rwlock * rw);
+static inline void rwlock_release_exclusive(struct rwlock * rw);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
@@ -77,4 +94,73 @@ static inline void lock_release(struct lock * lk) {
         lk->cond.name, lk);
 }
 
+static inline void rwlock_init(struct rwlock * rw, const char * name) {
+    trace("%s(<%s:%p>", __func__, name, rw);
+    condition_init(&rw->cond, name);
+    rw->readers = 0;
+    rw->writer = -1;
+    rw->writers_waiting = 0;
+}
+
+static inline void rwlock_acquire_shared(struct rwlock * rw) {
+    trace("%s(<%s:%p>)", __func__, rw->cond.name, rw);
+
+    while(1){
+        int intr_state = intr_disable();
+
+        if(rw->writer == -1 && rw->writers_waiting == 0) {
+            rw->readers += 1;
+            intr_restore(intr_state);
+            return;
+        }
+
+        // Wait for the writer to finish
+        condition_wait(&rw->cond);
+        intr_restore(intr_state);
+    }
+}
+
+static inline void rwlock_release_shared(struct rwlock * rw) {
+    trace("%s(<%s:%p>", __func__, rw->cond.name, rw);
+
+    assert (rw->readers > 0);
+
+    // The last reader lets a waiting writer in
+    if (--rw->readers == 0)
+        condition_broadcast(&rw->cond);
+}
+
+static inline void rwlock_acquire_exclusive(struct rwlock * rw) {
+    trace("%s(<%s:%p>)", __func__, rw->cond.name, rw);
+
+    rw->writers_waiting += 1;
+
+    while(1){
+        int intr_state = intr_disable();
+
+        if(rw->writer == -1 && rw->readers == 0) {
+            rw->writers_waiting -= 1;
+            rw->writer = running_thread();
+            intr_restore(intr_state);
+            debug("Thread <%s:%d> acquired rwlock <%s:%p>", 
+                thread_name(running_thread()), running_thread(),
+                rw->cond.name, rw);
+            return;
+        }
+
+        // Wait for readers and the writer to finish
+        condition_wait(&rw->cond);
+        intr_restore(intr_state);
+    }
+}
+
+static inline void rwlock_release_exclusive(struct rwlock * rw) {
+    trace("%s(<%s:%p>", __func__, rw->cond.name, rw);
+
+    assert (rw->writer == running_thread());
+
+    rw->writer = -1;
+    condition_broadcast(&rw->cond);
+}
+
 #endif // _LOCK_H_
\ No newline at end of file
@@ -26,11 +26,14 @@
 #include "string.h"
 #include "process.h"
 #include "config.h"
+#include "memstat.h"
+#include "swap.h"
 
 
 void main(void) {
     struct io_intf * initio;
     struct io_intf * blkio;
+    struct io_intf * swapio;
     void * mmio_base;
     int result;
     int i;
@@ -59,6 +62,8 @@ void main(void) {
         virtio_attach(mmio_base, VIRT0_IRQNO+i);
     }
 
+    memstat_attach();
+
     intr_enable();
 
     result = device_open(&blkio, "blk", 0);
@@ -73,6 +78,11 @@ void main(void) {
     if (result != 0)
         panic("fs_mount failed");
 
+    // A second block device, if there is one, is swap space
+
+    if (device_open(&swapio, "blk", 1) == 0 && swap_attach(swapio) != 0)
+        ioclose(swapio);
+
     result = fs_open(INIT_PROC, &initio);
 
     if (result < 0)
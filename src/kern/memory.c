@@ -24,6 +24,11 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "io.h"
+#include "lock.h"
+#include "shm.h"
+#include "swap.h"
+#include "text.h"
 
 #include <stdint.h>
 
@@ -32,6 +37,7 @@
 
 char memory_initialized = 0;
 uintptr_t main_mtag;
+struct page * memory_pages;
 
 // IMPORTED VARIABLE DECLARATIONS
 //
@@ -47,14 +53,51 @@ extern char _kimg_data_start[];
 extern char _kimg_data_end[];
 extern char _kimg_end[];
 
+// IMPORTED FUNCTION DECLARATIONS
+//
+
+// User memory access routines with fault fixups, provided by trapasm.s
+
+extern size_t _user_memcpy(void * dst, const void * src, size_t n);
+extern long _user_strncpy(char * dst, const char * src, size_t n);
+
 // INTERNAL TYPE DEFINITIONS
 //
 
+// A free block of the buddy allocator. The first page of the block holds the
+// links of its order's free list.
+
 union linked_page {
-    union linked_page * next;
+    struct {
+        union linked_page * next;
+        union linked_page * prev;
+    };
     char padding[PAGE_SIZE];
 };
 
+// Entry of the page walk cache (see walk_cache). An entry with a NULL root
+// is unused.
+
+struct walk_cache_entry {
+    const struct pte * root; // root table of the space
+    uintptr_t mega; // vma >> 21: the VPN2 and VPN1 of the 2 MB range
+    struct pte * pt0; // level 0 table mapping the range
+};
+
+// Iterator over the present leaf PTEs of a page table in the address range
+// [vma,end). Absent level 2 and level 1 entries are skipped as a whole, so the
+// cost of a walk is proportional to the number of page tables in the range,
+// not to the size of the range. With /swap/ set, the swap entries of
+// swapped-out pages are returned too.
+
+struct pt_iter {
+    struct pte * root;
+    uintptr_t vma; // next address to examine
+    uintptr_t end;
+    unsigned int order; // block order of the last leaf returned
+    int swap; // also return swap entries (see PTE_RSW_SWAP)
+};
+
 // INTERNAL MACRO DEFINITIONS
 //
 
@@ -62,6 +105,69 @@ union linked_page {
 #define VPN1(vma) (((vma) >> (9+12)) & 0x1FF)
 #define VPN0(vma) (((vma) >> 12) & 0x1FF)
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+// Maximum number of ASIDs used, including ASID 0 of the main memory space.
+
+#ifndef MEMORY_ASID_MAX
+#define MEMORY_ASID_MAX 64
+#endif
+
+// Number of entries in the page walk cache. Must be a power of two.
+
+#ifndef MEMORY_WALK_CACHE_SIZE
+#define MEMORY_WALK_CACHE_SIZE 16
+#endif
+
+// Maximum number of pages kept in the pre-zeroed pool.
+
+#ifndef MEMORY_ZEROED_MAX
+#define MEMORY_ZEROED_MAX 32
+#endif
+
+// Largest number of pages mapped by one fault on an anonymous region (see
+// fault_around). The window doubles on every sequential fault, up to this
+// size, and halves on every other fault.
+
+#ifndef MEMORY_FAULT_AROUND_MAX
+#define MEMORY_FAULT_AROUND_MAX 16
+#endif
+
+// Largest number of pages of a file-backed region read by one fault (see
+// region_populate_cluster).
+
+#ifndef MEMORY_FILE_CLUSTER
+#define MEMORY_FILE_CLUSTER 16
+#endif
+
+// RSW bit marking a user page that is shared copy-on-write. Such pages are
+// mapped without PTE_W; a store fault on one is resolved by cow_break().
+
+#define PTE_RSW_COW 0x1
+
+// RSW bit marking a page of a shared memory object. Such pages are shared by
+// design, so they are never made copy-on-write, split off or promoted.
+
+#define PTE_RSW_SHARED 0x2
+
+// RSW value of an absent level 0 PTE (V clear) whose page was swapped out. The
+// PPN field of such a PTE holds the swap entry of the page (see swap.h),
+// and the rwxug flags are those the page is mapped with when it comes back.
+
+#define PTE_RSW_SWAP 0x3
+
+// Number of pages the reclaim scan frees when an allocation finds no free
+// page (see memory_reclaim).
+
+#ifndef MEMORY_RECLAIM_BATCH
+#define MEMORY_RECLAIM_BATCH 8
+#endif
+
+#define PAGE_CNT (RAM_SIZE / PAGE_SIZE) // number of physical pages in RAM
+
+#define MEGA_ORDER 9 // block order of a megapage (MEGA_SIZE / PAGE_SIZE == 1 << 9)
+
+#define LRU_NONE UINT32_MAX // end of the LRU list (see struct page)
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -75,6 +181,9 @@ static inline int aligned_size(size_t size, size_t blksz);
 
 static inline uintptr_t active_space_mtag(void);
 static inline struct pte * mtag_to_root(uintptr_t mtag);
+static inline uint_fast16_t mtag_to_asid(uintptr_t mtag);
+static inline uintptr_t mtag_with_asid(uintptr_t mtag, uint_fast16_t asid);
+static inline uint_fast16_t active_space_asid(void);
 struct pte * active_space_root(void);
 
 static inline void * pagenum_to_pageptr(uintptr_t n);
@@ -92,13 +201,149 @@ static inline struct pte leaf_pte (
 static inline struct pte ptab_pte (
     const struct pte * ptab, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
+static inline struct pte swap_pte(unsigned long entry, uint_fast8_t rwxug_flags);
+static inline int pte_swapped(const struct pte * pte);
+static inline int access_ok(const struct pte * pte, unsigned int cause);
 
 static inline void sfence_vma(void);
+static inline void sfence_vma_addr(uintptr_t vma);
+static inline void sfence_vma_asid(uintptr_t asid);
+
+static uintptr_t asid_assign(uintptr_t mtag);
+static void asid_release(uintptr_t mtag);
+
+static void pt_iter_init (
+    struct pt_iter * it, struct pte * root, uintptr_t start, uintptr_t end);
+static struct pte * pt_iter_next(struct pt_iter * it, uintptr_t * vmaptr);
+static void memory_unmap_range(struct pte * root, uintptr_t start, uintptr_t end);
+static void free_user_ptabs(struct pte * root);
+static long space_free_user(struct pte * root);
+
+static struct pte * walk_pt_level (
+    struct pte * root, uintptr_t vma, int level, int create);
+static struct pte * walk_leaf(struct pte * root, uintptr_t vma);
+static int pt_split(struct pte * pte1);
+static void pt_split_range(struct pte * root, uintptr_t start, uintptr_t end);
+static void pt_try_promote(struct pte * root, uintptr_t vma);
+
+static struct pte * walk_cache_lookup(const struct pte * root, uintptr_t vma);
+static void walk_cache_insert (
+    const struct pte * root, uintptr_t vma, struct pte * pt0);
+static void walk_cache_invalidate(const struct pte * root, uintptr_t vma);
+static void walk_cache_flush(const struct pte * root);
+
+static inline uint16_t * page_refcnt_ptr(const void * pp);
+static void page_mapped(void * pp);
+static void page_unmapped(void * pp);
+static void lru_insert(struct page * pg);
+static void lru_remove(struct page * pg);
+static void rss_add(long pages);
+
+static void buddy_push(union linked_page * blk, unsigned int order);
+static void buddy_remove(union linked_page * blk, unsigned int order);
+static union linked_page * buddy_of(const void * blk, unsigned int order);
+static void * buddy_alloc(unsigned int order);
+static void buddy_free(void * pp, unsigned int order);
+
+static void zeroed_drain(void);
+static void * zeroed_take(void);
+static void * page_alloc_reclaim(int zero);
+static inline int pte_swappable(const struct pte * pte, unsigned int order);
+static int swap_out_next(struct process * proc);
+static int swap_in(uintptr_t vma);
+static int cow_break(struct pte * pte, uintptr_t vma);
+static int region_populate(uintptr_t vma);
+static inline int user_range_ok(uintptr_t vma, size_t n);
+static int region_populate_mega (
+    const struct process * proc, const struct vm_region * rgn, uintptr_t vma);
+static int region_populate_text(const struct vm_region * rgn, uintptr_t vma);
+static int region_populate_cluster(const struct vm_region * rgn, uintptr_t vma);
+static unsigned int fault_around (
+    struct process * proc, const struct vm_region * rgn,
+    uintptr_t vma, struct pte * pte);
+static int region_read (
+    const struct vm_region * rgn, void * buf, uintptr_t lo, uintptr_t hi);
+static struct vm_region * region_alloc(struct process * proc);
+static int region_split(struct process * proc, uintptr_t vma);
+static int region_covered (
+    const struct process * proc, uintptr_t start, uintptr_t end);
+static const struct vm_region * region_overlap (
+    const struct process * proc, uintptr_t start, uintptr_t end);
+static uintptr_t region_find_free (
+    const struct process * proc, uintptr_t hint, size_t size);
+static long region_map (
+    uintptr_t hint, size_t size, uint_fast8_t rwxug_flags, struct io_intf * shmio);
+static inline int user_flags_ok(uint_fast8_t rwxug_flags);
 
 // INTERNAL GLOBAL VARIABLES
 //
 
-static union linked_page * free_list;
+// Buddy allocator free lists, one per block order. A block of order n is
+// 2^n physically contiguous pages, aligned (relative to RAM_START) to its size.
+
+static union linked_page * free_lists[MEMORY_MAX_ORDER+1];
+
+// Lowest address managed by the buddy allocator. Pages below it belong to the
+// kernel image, the initial heap and the page frame array, and are never
+// coalesced with.
+
+static void * pool_start;
+
+// Pool of free pages that are already zeroed, filled by the idle thread (see
+// memory_prezero_page). The pages are allocated as far as the buddy allocator
+// is concerned.
+
+static union linked_page * zeroed_list;
+static size_t zeroed_cnt;
+
+// LRU list of the pages mapped in user space, oldest first, linked through
+// struct page by page number. A page joins the tail when it gets its first
+// user mapping and leaves the list when it loses its last.
+
+static uint32_t lru_head = LRU_NONE;
+static uint32_t lru_tail = LRU_NONE;
+
+// Memory statistics (see memory_get_stats). pages_free counts the pages on the
+// buddy free lists only; the pre-zeroed pool is added when a snapshot is taken.
+
+static struct memory_stats stats;
+
+// ASID allocator. ASID 0 belongs to the main memory space; every other space
+// is given an ASID from 1 to asid_cnt-1 when it is switched to, and keeps it
+// until the ASIDs run out. Then a new generation starts: the whole TLB is
+// flushed, every space loses its ASID and gets a new one on its next switch.
+// asid_root[n] is the root page table that owns ASID n in this generation.
+
+static const struct pte * asid_root[MEMORY_ASID_MAX];
+static uint_fast16_t asid_cnt; // ASIDs usable (implemented by the hart)
+static uint_fast16_t asid_next; // next never-used ASID of this generation
+static unsigned long asid_generation;
+
+// Page walk cache: recently used level 0 page tables, so that walk_pt does not
+// have to descend from the root for every page. Entries are tagged with the
+// root table, so each memory space has its own entries and a space switch
+// needs no flush. The cache is direct-mapped by 2 MB range. Entries are
+// dropped when the level 0 table they point to is freed (promotion, page
+// table teardown); unmapping pages keeps the tables and the entries valid.
+
+static struct walk_cache_entry walk_cache[MEMORY_WALK_CACHE_SIZE];
+static unsigned long walk_cache_hits;
+static unsigned long walk_cache_misses;
+
+// Pages of file-backed regions are read through the region's io_intf, which
+// is shared by all regions of an executable image and by forked children. The
+// pager lock keeps a seek and the read that follows it together.
+
+static struct lock pager_lock;
+
+// Swapping a page out and reading it back are serialized by the swap lock, so
+// that a fault on a page that is still being written waits for the write to
+// finish. The reclaim scan is a clock over the user pages of all processes;
+// its hand is the next page of process clock_pid to look at.
+
+static struct lock swap_lock;
+static int clock_pid;
+static uintptr_t clock_vma = USER_START_VMA;
 
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
@@ -128,11 +373,12 @@ void memory_init(void) {
     const void * const rodata_start = _kimg_rodata_start;
     const void * const rodata_end = _kimg_rodata_end;
     const void * const data_start = _kimg_data_start;
-    union linked_page * page;
+    unsigned int order;
     void * heap_start;
     void * heap_end;
     size_t page_cnt;
     uintptr_t pma;
+    size_t frames_size;
     const void * pp;
 
     trace("%s()", __func__);
@@ -203,9 +449,22 @@ void memory_init(void) {
     csrw_satp(main_mtag);
     sfence_vma();
 
+    // Find out how many ASIDs the hart implements: the ASID bits that stick
+    // when writing all ones to the ASID field of satp.
+
+    csrw_satp(mtag_with_asid(main_mtag, UINT16_MAX));
+    asid_cnt = MIN(mtag_to_asid(csrr_satp()) + 1UL, MEMORY_ASID_MAX);
+    csrw_satp(main_mtag);
+    sfence_vma();
+
+    asid_next = 1;
+
+    kprintf("          ASID: %u usable\n", (unsigned int)asid_cnt);
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
-    // HEAP_INIT_MIN bytes.
+    // HEAP_INIT_MIN bytes. (The slab allocator does not use it; it takes
+    // its slabs from the page allocator.)
 
     heap_start = _kimg_end;
     heap_end = round_up_ptr(heap_start, PAGE_SIZE);
@@ -224,32 +483,49 @@ void memory_init(void) {
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
 
-    free_list = heap_end; // heap_end is page aligned
-    page_cnt = (RAM_END - heap_end) / PAGE_SIZE;
+    // Allocate the page frame array right after the heap. Everything below
+    // the end of the array is reserved; the rest of RAM is the page pool.
 
-    kprintf("Page allocator: [%p,%p): %lu pages free\n",
-        free_list, RAM_END, page_cnt);
+    frames_size = round_up_size(PAGE_CNT * sizeof(struct page), PAGE_SIZE);
 
-    // Put free pages on the free page list
-    // TODO: FIXME implement this (must work with your implementation of
-    // memory_alloc_page and memory_free_page).
+    if (RAM_END - heap_end < frames_size)
+        panic("Not enough memory");
     
-    // put free pages on the free pages list by going through the entire space avaliable,
-    // assigning linked pages and updating the head of the list - free_list
-    // this needs the heap_end and RAN_END to be page alligned which heap_end for sure is 
-    // uintptr_t aligned_ram_end = round_down_addr((uintptr_t)RAM_END, PAGE_SIZE);
-    for(pp = heap_end; pp<RAM_END; pp+=PAGE_SIZE){
-        page = (union linked_page *)pp;
-        page->next = free_list;
-        free_list = page;
-    }
+    memory_pages = heap_end; // heap_end is page aligned
+    memset(memory_pages, 0, frames_size);
+
+    pool_start = heap_end + frames_size;
+
+    for (pp = RAM_START; pp < pool_start; pp += PAGE_SIZE)
+        memory_page(pp)->flags = PAGE_RESERVED;
+
+    kprintf("    Page frames: [%p,%p): %zu bytes per page\n",
+        memory_pages, pool_start, sizeof(struct page));
+
+    page_cnt = (RAM_END - pool_start) / PAGE_SIZE;
+    stats.pages_total = page_cnt;
+
+    kprintf("Page allocator: [%p,%p): %lu pages free\n",
+        pool_start, RAM_END, page_cnt);
+
+    // Put free memory on the buddy free lists, carving it into the largest
+    // blocks that are aligned to their size and fit before RAM_END.
 
+    for (pp = pool_start; pp < RAM_END; pp += PAGE_SIZE << order) {
+        order = MEMORY_MAX_ORDER;
+        while (0 < order && (!aligned_addr(pp - RAM_START, PAGE_SIZE << order) ||
+            RAM_END - pp < (PAGE_SIZE << order)))
+            order -= 1;
+        
+        buddy_push((union linked_page *)pp, order);
+    }
 
-    // Allow supervisor to access user memory. We could be more precise by only
-    // enabling it when we are accessing user memory, and disable it at other
-    // times to catch bugs.
+    // The supervisor does not get access to user memory (sstatus.SUM) here:
+    // copy_from_user and friends enable it only while they copy, so a stray
+    // kernel access to a user page faults.
 
-    csrs_sstatus(RISCV_SSTATUS_SUM);
+    lock_init(&pager_lock, "pager_lock");
+    lock_init(&swap_lock, "swap_lock");
 
     memory_initialized = 1;
 }
@@ -257,58 +533,318 @@ void memory_init(void) {
 
 
 /**
- * Allocates a zeroed memory page from the free list.
+ * Allocates a zeroed block of 2^order physically contiguous pages.
+ * 
+ * The block is taken from the buddy allocator. If no block of the requested
+ * order is free, the pre-zeroed page pool is given back to the buddy allocator
+ * (where the pages may coalesce) and the allocation is retried.
+ * 
+ * @param order Block order, 0 to MEMORY_MAX_ORDER.
+ * @return Pointer to the first page of the block, or NULL if no block of
+ *         the requested order is free.
+ */
+void * memory_alloc_pages(unsigned int order) {
+    void * blk;
+
+    blk = buddy_alloc(order);
+
+    if (blk == NULL && zeroed_cnt != 0) {
+        zeroed_drain();
+        blk = buddy_alloc(order);
+    }
+
+    if (blk == NULL)
+        return NULL;
+
+    // Zero out the block
+    memset(blk, 0, PAGE_SIZE << order);
+
+    *page_refcnt_ptr(blk) = 1;
+
+    return blk;
+}
+
+
+
+/**
+ * Allocates a block of 2^order physically contiguous pages whose contents are
+ * undefined.
+ * 
+ * For callers that overwrite the block, such as I/O buffers. Unlike
+ * memory_alloc_pages, the pre-zeroed pool is left alone; callers fall back to a
+ * smaller block instead.
+ * 
+ * @param order Block order, 0 to MEMORY_MAX_ORDER.
+ * @return Pointer to the first page of the block, or NULL if no block of
+ *         the requested order is free.
+ */
+void * memory_alloc_pages_nozero(unsigned int order) {
+    void * blk;
+
+    blk = buddy_alloc(order);
+
+    if (blk == NULL)
+        return NULL;
+
+    *page_refcnt_ptr(blk) = 1;
+
+    return blk;
+}
+
+
+
+/**
+ * Allocates a zeroed memory page.
+ * 
+ * A page from the pre-zeroed pool is used when one is available, so that the
+ * page does not have to be cleared on the allocation path. If no page is free,
+ * user pages are swapped out to make room.
  * 
- * @return Pointer to the allocated memory page, or NULL on failure.
+ * @return Pointer to the allocated memory page. Panics if memory is exhausted
+ *         and no page can be swapped out.
  */
 void *memory_alloc_page(void) {
-    union linked_page *page;
+    void * page;
 
-    // Ensure the free list exists
-    if (free_list == NULL) {
+    page = page_alloc_reclaim(1);
+
+    if (page == NULL)
         panic("no free pages in free_list: memory_alloc_page");
-        return NULL;
+
+    // Return the address of direct-mapped page
+    return page;
+}
+
+
+
+/**
+ * Allocates a zeroed memory page, failing instead of panicking.
+ * 
+ * For paths that can report running out of memory, such as page faults.
+ * 
+ * @return Pointer to the allocated memory page, or NULL if memory is exhausted
+ *         and no page can be swapped out.
+ */
+void * memory_try_alloc_page(void) {
+    return page_alloc_reclaim(1);
+}
+
+
+
+/**
+ * Allocates a memory page whose contents are undefined.
+ * 
+ * For callers that overwrite the whole page anyway. Pages are taken from the
+ * buddy allocator first so that the pre-zeroed pool is kept for callers that
+ * need zeroed pages.
+ * 
+ * @return Pointer to the allocated memory page. Panics if memory is exhausted.
+ */
+void * memory_alloc_page_nozero(void) {
+    void * page;
+
+    page = buddy_alloc(0);
+
+    if (page == NULL)
+        return memory_alloc_page();
+
+    *page_refcnt_ptr(page) = 1;
+    return page;
+}
+
+
+
+/**
+ * Frees pages by swapping out user pages.
+ * 
+ * The reclaim scan is a clock: its hand moves through the user pages of each
+ * process in turn (see swap_out_next), giving pages that were accessed since
+ * the hand last passed a second chance. Every process is visited at most twice,
+ * so that a page gets its second look. The scan stops early when swap is full.
+ * Pages are compressed into the compressed pool when they compress well, so
+ * that reclaiming works without a swap device too.
+ * A thread that allocates memory while writing out a page (for the swap
+ * device) does not start another scan.
+ * 
+ * @param cnt   number of pages to free
+ * @return      number of pages freed
+ */
+unsigned long memory_reclaim(unsigned long cnt) {
+    unsigned long freed = 0;
+    struct process * proc;
+    int visits = 0;
+    int result;
+
+    if (swap_lock.tid == running_thread())
+        return 0;
+    
+    lock_acquire(&swap_lock);
+
+    while (freed < cnt && visits <= 2 * NPROC) {
+        proc = proctab[clock_pid];
+        result = 0;
+
+        // a process that exited or is being forked has no user pages of its
+        // own; only the main process (pid 0) runs in the main memory space
+        if (proc != NULL && proc->mtag != 0 &&
+            (mtag_to_root(proc->mtag) != main_pt2 || proc->id == 0))
+            result = swap_out_next(proc);
+        
+        if (result < 0)
+            break;
+
+        if (result > 0) {
+            freed += 1;
+            continue;
+        }
+
+        clock_pid = (clock_pid + 1) % NPROC;
+        clock_vma = USER_START_VMA;
+        visits += 1;
     }
 
-    // Remove the first page from the free list
-    page = free_list;
-    free_list = free_list->next;
+    lock_release(&swap_lock);
+    return freed;
+}
+
 
-    // Zero out the page
-    memset((void *)page, 0, PAGE_SIZE);
 
-    // Return the address of direct-mapped page
-    return (void *)page;
+/**
+ * Zeroes one free page and moves it to the pre-zeroed pool.
+ * 
+ * Called by the idle thread, one page at a time so that a thread that becomes
+ * runnable does not wait long for the CPU.
+ * 
+ * @return 1 if a page was zeroed, 0 if the pool is full or no page is free.
+ */
+int memory_prezero_page(void) {
+    union linked_page * page;
+
+    if (MEMORY_ZEROED_MAX <= zeroed_cnt)
+        return 0;
+    
+    page = buddy_alloc(0);
+
+    if (page == NULL)
+        return 0;
+    
+    memset(page, 0, PAGE_SIZE);
+
+    page->next = zeroed_list;
+    zeroed_list = page;
+    zeroed_cnt += 1;
+    memory_page(page)->flags |= PAGE_ZEROED;
+
+    return 1;
 }
 
 
 
 /**
- * Frees a memory page and returns it to the free list.
+ * Drops a reference to a block of pages and returns it to the buddy allocator
+ * once the last reference is gone, coalescing it with its free buddies. The
+ * block is not cleared; pages are zeroed when allocated (or ahead of time by
+ * the idle thread).
  * 
- * @param pp Input pointer to the memory page to be freed. Must be page-aligned and non-NULL.
- *           We clear the page and then add it to the back of the free_list.
- *           
+ * @param pp    Pointer to the first page of the block. Must be non-NULL and aligned
+ *              to the block size. If the block is still shared (copy-on-write), only
+ *              its reference count is decremented.
+ * @param order Order of the block, as passed to memory_alloc_pages.
  */
 
-void memory_free_page(void * pp){
-    union linked_page *page;
+void memory_free_pages(void * pp, unsigned int order) {
+    uint16_t * refcnt;
 
-    // Ensure the input page is valid and page-aligned
-    if ((uintptr_t)pp % PAGE_SIZE != 0 || pp == NULL) {
+    // Ensure the block is valid and aligned to its size
+    if (pp == NULL || MEMORY_MAX_ORDER < order ||
+        pp < pool_start || RAM_END <= pp ||
+        !aligned_addr(pp - RAM_START, PAGE_SIZE << order))
+    {
         panic("Invalid page address provided in memory_free_page");
         return;
     }
 
-    // Zero out the page to prevent stale data
-    memset(pp, 0, PAGE_SIZE);
+    // Shared pages stay allocated until the last mapping goes away
+    refcnt = page_refcnt_ptr(pp);
+    if (1 < *refcnt) {
+        *refcnt -= 1;
+        return;
+    }
+
+    *refcnt = 0;
+
+    if (memory_page(pp)->flags & PAGE_FREE)
+        panic("double free in memory_free_page");
+    
+    if (memory_page(pp)->mapcnt != 0)
+        panic("memory_free_page: page is still mapped");
+
+    buddy_free(pp, order);
+}
+
+
+
+/**
+ * Drops a reference to a memory page. Order 0 wrapper around memory_free_pages.
+ * 
+ * @param pp Input pointer to the memory page to be freed. Must be page-aligned and non-NULL.
+ */
+
+void memory_free_page(void * pp){
+    memory_free_pages(pp, 0);
+}
+
+
+
+/**
+ * Adds a reference to an allocated page (or block of pages).
+ * 
+ * @param pp Pointer to the page, or to the first page of a block.
+ */
+
+void memory_page_ref(void * pp) {
+    uint16_t * const refcnt = page_refcnt_ptr(pp);
+
+    if (*refcnt == UINT16_MAX)
+        panic("page reference count overflow");
+    
+    *refcnt += 1;
+}
+
+
+
+/**
+ * Returns the least recently mapped (or touched) page on the LRU list of user
+ * pages, or NULL if the list is empty.
+ */
+
+struct page * memory_lru_oldest(void) {
+    return (lru_head != LRU_NONE) ? &memory_pages[lru_head] : NULL;
+}
+
+
+
+/**
+ * Returns the page after /pg/ on the LRU list, or NULL if /pg/ is the newest.
+ */
+
+struct page * memory_lru_next(const struct page * pg) {
+    return (pg->lru_next != LRU_NONE) ? &memory_pages[pg->lru_next] : NULL;
+}
 
-    // Cast the page pointer to the linked_page structure
-    page = (union linked_page *)pp;
 
-    // Add the page back to the free list
-    page->next = free_list;
-    free_list = page;
+
+/**
+ * Moves a page on the LRU list to the newest end of the list.
+ * 
+ * @param pg Page descriptor. Pages not on the list are left alone.
+ */
+
+void memory_lru_touch(struct page * pg) {
+    if (pg->flags & PAGE_LRU) {
+        lru_remove(pg);
+        lru_insert(pg);
+    }
 }
 
 
@@ -321,6 +857,7 @@ void memory_free_page(void * pp){
  * 
  * Ensures the virtual address is page-aligned and the corresponding page table entry (PTE) exists and is valid.
  * Updates the PTE with the specified flags and flushes the TLB to reflect the changes.
+ * If the page is part of a megapage, the megapage is split first.
  */
 
 void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
@@ -332,6 +869,9 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
         return;
     }
 
+    // a megapage containing vp is split so that only this page changes
+    pt_split_range(active_space_root(), (uintptr_t)vp, (uintptr_t)vp + PAGE_SIZE);
+
     // Walk the page table to get the PTE for the virtual address
     pte = walk_pt(active_space_root(), (uintptr_t)vp, 0); // argument create is 0: we do not want to
                                                      // create missing tables
@@ -346,7 +886,7 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
     pte->flags |= rwxug_flags;
 
     // Flush the TLB to ensure the changes are visible
-    sfence_vma();
+    sfence_vma_addr((uintptr_t)vp);
 }
 
 
@@ -354,8 +894,12 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
 /**
  * memory_space_reclaim - reclaims memory for the current process's memory space.
  * 
- * This function switches to the main memory space, flushes the TLB, and frees
- * user-space pages and non-global page table entries from the current memory space.
+ * This function switches to the main memory space, frees user-space pages and
+ * non-global page table entries from the current memory space, releases the space's
+ * ASID and flushes the TLB entries tagged with it.
+ * Only the page tables actually present in the user region are visited. The level 1
+ * and level 0 page tables created for the user region and the root table itself are
+ * returned to the page allocator as well, so a process lifetime leaks no pages.
  * 
  * @param: This function does not take in any parameters
  * 
@@ -372,36 +916,21 @@ void memory_space_reclaim(void) {
     // switch to the main mem space
     csrw_satp(main_mtag);
 
-    // flush the tlb
-    sfence_vma();
-
-    // reclaim the old memory space's page tables and pages
-    for (uintptr_t vaddr = USER_START_VMA; vaddr < USER_END_VMA; vaddr += PAGE_SIZE) {
-        // walk the pt
-        struct pte* pte = walk_pt(old_root_pa, vaddr, 0);
-        
-        // check if pte is valid
-        if (!pte) continue;
-
-        // check if valid flag is set
-        if (!(pte->flags & PTE_V)) continue; 
-
-        // skip global mappings
-        if (pte->flags & PTE_G) continue;
+    // the old space's ASID can be given to another space
+    asid_release(old_satp);
 
-        // free the physical page if its a leaf pte
-        if (pte->flags & (PTE_R | PTE_W | PTE_X)) {
-            // free the phyical page
-            uintptr_t pa = (uintptr_t)(pte->ppn) << 12;
-            memory_free_page((void *)pa);
+    // reclaim the old memory space's pages, swap slots and page tables. The
+    // root is freed too, except for the statically allocated main root, which
+    // only loses its user entries.
+    rss_add(-space_free_user(old_root_pa));
 
-            // invalidate the pte
-            memset(pte, 0, sizeof(struct pte));
-        }
+    if (old_root_pa != main_pt2) {
+        memory_free_page(old_root_pa);
+        stats.pages_ptab -= 1;
     }
-
-    // can't free the old root pt itself
-    // since it might contain global or shared mappings
+    
+    // flush the tlb of the old space's translations
+    sfence_vma_asid(mtag_to_asid(old_satp));
 }
 
 
@@ -410,7 +939,9 @@ void memory_space_reclaim(void) {
  * allocates and maps a range of virtual addresses with provided flags
  * 
  * this function allocates physical pages and maps them to the specified virtual memory range.
- * it uses memory_alloc_and_map_page function to allocate and map individual pages
+ * every 2 MB aligned part of the range that has no page table yet is mapped with a single
+ * megapage if a megapage block is available. the page table is walked once per level 0
+ * table rather than once per page, and the TLB is flushed once for the whole range.
  * 
  * @param vma           starting vma to map
  * @param size          size of the memory range to allocate and map
@@ -421,36 +952,57 @@ void memory_space_reclaim(void) {
  */
 
 void * memory_alloc_and_map_range (uintptr_t vma, size_t size, uint_fast8_t rwxug_flags) {
-    uintptr_t start_vma = vma;
-    uintptr_t end_vma = start_vma + size;
-    size_t page_size = PAGE_SIZE;
+    struct pte * const root = active_space_root();
+    struct pte * pte = NULL;
+    struct pte * pte1;
+    uintptr_t cur_vma;
+    void * blk;
 
     // allign start and end addresses
-    round_down_addr(start_vma, page_size);
-    round_up_addr(end_vma, page_size);
-
-    size_t num_pages = (end_vma - start_vma) / page_size;
+    uintptr_t start_vma = round_down_addr(vma, PAGE_SIZE);
+    uintptr_t end_vma = round_up_addr(vma + size, PAGE_SIZE);
 
-    for (size_t pages_mapped = 0; pages_mapped < num_pages; pages_mapped++) {
-        uintptr_t current_vma = start_vma + pages_mapped * page_size;
-
-        void* result = memory_alloc_and_map_page(current_vma, rwxug_flags);
-
-        if (!result) {
-            // allocation or mapping failed 
-            // unroll each allocated page
-            for (int i = 0; i < pages_mapped; i++) {
-                uintptr_t rollback_vma = start_vma + i * page_size;
+    if (!wellformed_vma(start_vma) || !wellformed_vma(end_vma - 1)) {
+        return NULL;
+    }
 
-                // unmap the page and free the physical memory
-                memory_free_page((void *)rollback_vma);
+    for (cur_vma = start_vma; cur_vma < end_vma; cur_vma += PAGE_SIZE) {
+        // map a whole aligned 2 MB part with one megapage if we can
+        if (aligned_addr(cur_vma, MEGA_SIZE) && MEGA_SIZE <= end_vma - cur_vma) {
+            pte1 = walk_pt_level(root, cur_vma, 1, 1);
+
+            if (pte1 != NULL && !(pte1->flags & PTE_V) &&
+                (blk = memory_alloc_pages(MEGA_ORDER)) != NULL)
+            {
+                *pte1 = leaf_pte(blk, rwxug_flags);
+                page_mapped(blk);
+                rss_add(PTE_CNT);
+                cur_vma += MEGA_SIZE - PAGE_SIZE;
+                continue;
             }
+        }
+
+        // only walk from the root when entering a new level 0 table
+        if (pte == NULL || VPN0(cur_vma) == 0)
+            pte = walk_pt(root, cur_vma, 1);
+        else
+            pte += 1;
 
+        if (pte == NULL) {
+            // mapping failed: unroll each page mapped so far
             kprintf("something went wrong when allocating a page, rolling back each allocated page\n");
+            memory_unmap_range(root, start_vma, cur_vma);
             return NULL;
         }
+
+        *pte = leaf_pte(memory_alloc_page(), rwxug_flags);
+        page_mapped(pagenum_to_pageptr(pte->ppn));
+        rss_add(1);
     }
 
+    // Flush TLB to ensure new mappings are recognized
+    sfence_vma_asid(active_space_asid());
+
     return (void *)start_vma;
 }
 
@@ -459,9 +1011,9 @@ void * memory_alloc_and_map_range (uintptr_t vma, size_t size, uint_fast8_t rwxu
 /**
  * modifies flags of all ptes within the specified virtual memory range
  * 
- * this function iterates through each page with the starting address and the size of pages
- * to be allocated, then calls memory_set_page_flags function to modify the flags of a given 
- * page
+ * this function iterates over the pages that are mapped in the range, skipping
+ * absent page tables, and sets their flags. A megapage that lies only partly in
+ * the range is split first. The TLB is flushed once at the end.
  * 
  * @param vp            starting virtual address of the range
  * @param size          size of the range in bytes
@@ -469,23 +1021,27 @@ void * memory_alloc_and_map_range (uintptr_t vma, size_t size, uint_fast8_t rwxu
  */
 
 void memory_set_range_flags (const void * vp, size_t size, uint_fast8_t rwxug_flags) {
-    uintptr_t start_addr = (uintptr_t) vp;
-    uintptr_t end_addr = start_addr + size;
-    size_t page_size = PAGE_SIZE;
+    struct pt_iter it;
+    struct pte * pte;
+    uintptr_t vma;
 
     // make sure the start and end addresses are page aligned
-    round_down_addr(start_addr, page_size);
-    round_up_addr(end_addr, page_size);
+    uintptr_t start_addr = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    uintptr_t end_addr = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
 
-    // calculate the num of pages
-    size_t num_pages = (end_addr - start_addr) / page_size;
+    pt_split_range(active_space_root(), start_addr, end_addr);
 
-    // iterate over each page in the range
-    for (size_t current_page = 0; current_page < num_pages; current_page++) {
-        // grab the current address and set the flag
-        uintptr_t current_addr = start_addr + current_page * page_size;
-        memory_set_page_flags((void *)current_addr, rwxug_flags);       
+    // iterate over each mapped or swapped-out page in the range
+    pt_iter_init(&it, active_space_root(), start_addr, end_addr);
+    it.swap = 1;
+
+    while ((pte = pt_iter_next(&it, &vma)) != NULL) {
+        pte->flags &= ~PTE_FLAGS_MASK;
+        pte->flags |= rwxug_flags;
     }
+
+    // Flush the TLB to ensure the changes are visible
+    sfence_vma_asid(active_space_asid());
 }
 
 
@@ -493,42 +1049,38 @@ void memory_set_range_flags (const void * vp, size_t size, uint_fast8_t rwxug_fl
 /**
  * unmaps and frees all user space pages
  * 
- * this function retrieves the root page table and traverses the page table hierarchy
- * to unmap and free all pages that have the user flag set
+ * this function retrieves the root page table and visits the present user
+ * mappings to unmap and free all pages that have the user flag set
  */
 
 void memory_unmap_and_free_user(void) {
-    // retrieve the current satp value (ie the old mem space)
-    uintptr_t old_satp = active_space_mtag();
-
-    // extract the root page table pointer
-    struct pte* root_pt = mtag_to_root(old_satp);
-
-    // iterate over the user virtual address range and unmap user pages
-    for (uintptr_t vma = USER_START_VMA; vma < USER_END_VMA; vma += PAGE_SIZE) {
-        // walk to the pte
-        struct pte* pte = walk_pt(root_pt, vma, 0);
-
-        // check if pte is valid
-        if (!pte || (!(pte->flags & PTE_V))) continue; 
+    struct pt_iter it;
+    struct pte * pte;
+    uintptr_t vma;
+
+    // iterate over the mapped user pages and unmap them
+    pt_iter_init(&it, active_space_root(), USER_START_VMA, USER_END_VMA);
+    it.swap = 1;
+
+    while ((pte = pt_iter_next(&it, &vma)) != NULL) {
+        if (pte_swapped(pte)) {
+            swap_free(pte->ppn);
+            *pte = null_pte();
+            continue;
+        }
 
         // check if user flag is set
         if (!(pte->flags & PTE_U)) continue;
 
-        // if leaf, unmap and free the pp
-        if (pte->flags & (PTE_R | PTE_W | PTE_X)) {
-            // clear the mem flags
-            pte->flags = 0;
-
-            // leaf page, unmap and free
-            uintptr_t pa = (uintptr_t)(pte->ppn) << 12;
-
-            memory_free_page((void *)pa);
-        }
+        // leaf page or megapage, unmap and free
+        page_unmapped(pagenum_to_pageptr(pte->ppn));
+        memory_free_pages(pagenum_to_pageptr(pte->ppn), it.order);
+        rss_add(-(1L << it.order));
+        *pte = null_pte();
     }
 
     // flush the tlb
-    sfence_vma();
+    sfence_vma_asid(active_space_asid());
 }
 
 
@@ -574,9 +1126,11 @@ void *memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
 
     // Set up the leaf PTE to point to the allocated physical page
     *pte = leaf_pte(physical_page, rwxug_flags);
+    page_mapped(physical_page);
+    rss_add(1);
 
     // Flush TLB to ensure new mapping is recognized
-    sfence_vma();
+    sfence_vma_addr(vma);
     
     // Return mapped virtual address
     return (void *) vma;
@@ -587,156 +1141,457 @@ void *memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
 /**
  * handles page fault for the given virtual address
  * 
- * @param vptr  pointer to the faulting virtual address. must be aligned with page size and 
- *              within the user region
+ * A store fault on a present copy-on-write page is resolved by giving the
+ * faulting space a private copy of just that page. A fault on an absent page
+ * inside one of the process's regions populates the page from the region (for
+ * an executable, by reading that page and the ones after it from the file, see
+ * region_populate_cluster); for an anonymous region, a window of neighbouring
+ * pages is mapped as well (see fault_around), so that sequential growth takes
+ * fewer faults. A swapped-out page is read back
+ * from swap. A fault on an absent
+ * page outside every region, or any other fault on a present page, is an access
+ * violation, which the caller handles (see excp.c). Once every page of an
+ * aligned 2 MB range is mapped, the range is promoted to a megapage.
+ * 
+ * @param vptr  pointer to the faulting virtual address. must be within the user region
+ * @param cause scause exception code of the fault (instruction, load or store page fault)
+ * 
+ * @return      returns 0 if the faulting access can be retried, -EACCESS on an access
+ *              violation, -EIO if the page could not be loaded, or -ENOMEM if memory
+ *              and swap are exhausted
  */
 
-void memory_handle_page_fault(const void * vptr){
+int memory_handle_page_fault(const void * vptr, unsigned int cause){
     uintptr_t va = (uintptr_t) vptr;
-    struct pte * root_pt, * pa_pte, * new_pp;
-    
-    console_printf("handling page fault at virtual address: 0x%lx\n", va);
+    struct pte * root_pt, * pa_pte;
+    int result;
 
     // check if the virtual address is within the user mem space
     if (va < USER_START_VMA || va >= USER_END_VMA) {
-        console_printf("memory_handle_page_fault: 0x%lx is outside user space\n", va);
-        panic("page fault in invalid address space");
+        stats.faults_denied += 1;
+        return -EACCESS;
     }
 
     // ensure va is page aligned
     va = round_down_addr(va, PAGE_SIZE);
     
-    if (!aligned_addr(va, PAGE_SIZE)) {
-        console_printf("memory_handle_page_fault: 0x%lx is not page-aligned\n", va);
+    if (!aligned_addr(va, PAGE_SIZE))
         panic("page fault at non-aligned address");
-    }
 
-    // get the root page table for the active memory space and get to the pte for the va
+    // get the root page table for the active memory space and get to the leaf
+    // pte (page or megapage) for the va, if there is one
     root_pt = active_space_root();
-    pa_pte = walk_pt(root_pt, va, 1);
+    pa_pte = walk_leaf(root_pt, va);
+
+    // page is present: only a write to a copy-on-write page is recoverable
+    if (pa_pte != NULL) {
+        if (cause == RISCV_SCAUSE_STORE_PAGE_FAULT && (pa_pte->rsw & PTE_RSW_COW)) {
+            if (cow_break(pa_pte, va) != 0) {
+                stats.faults_failed += 1;
+                return -ENOMEM;
+            }
 
-    if (pa_pte == NULL) {
-        console_printf("memory_handle_page_fault: pte not found for address 0x%lx\n", va);
-        panic("Page fault: PTE not found");
-    }
+            pt_try_promote(root_pt, va);
+            stats.faults_cow += 1;
+            return 0;
+        }
 
-    // allocate new pp
-    new_pp = (struct pte *) memory_alloc_and_map_page(va, PTE_R | PTE_W | PTE_U);
+        // the reclaim scan cleared the accessed bit, on a hart that faults
+        // instead of setting it
+        if (!(pa_pte->flags & PTE_A) && access_ok(pa_pte, cause)) {
+            pa_pte->flags |= PTE_A;
+            sfence_vma_addr(va);
+            return 0;
+        }
 
-    if (new_pp == NULL) {
-        console_printf("memory_handle_page_fault: failed to allocate physical page for address 0x%lx\n", va);
-        panic("Page fault: Memory allocation failed");
+        stats.faults_denied += 1;
+        return -EACCESS;
     }
 
-    // flush tlb
-    sfence_vma();
+    // absent page that was swapped out: read it back
+    pa_pte = walk_pt(root_pt, va, 0);
+
+    if (pa_pte != NULL && pte_swapped(pa_pte))
+        result = swap_in(va);
+    else {
+        // absent page of a region: load it from the region's file or zero-fill it
+        result = region_populate(va);
+    }
 
-    console_printf("memory_handle_page_fault: successfully handled page fault at address 0x%lx\n", va);
+    switch (result) {
+    case 0:
+        pt_try_promote(root_pt, va);
+        return 0;
+    case -ENOENT:
+        stats.faults_denied += 1;
+        return -EACCESS;
+    default:
+        stats.faults_failed += 1;
+        return result;
+    }
 }
 
 
 
 /**
- * validates a virtual memory range and checks for required permission
+ * copies a block of memory from user space into the kernel
  * 
- * @param vp            pointer to the start of the virtual memory range
- * @param len           length of the range in bytes
- * @param rwxug_flags   flags for the given range
+ * user pages are accessed with sstatus.SUM set for the duration of the copy only. a page
+ * fault during the copy is handled like a fault from user mode (populating the page or
+ * breaking copy-on-write); an unrecoverable fault makes the copy fail instead of the
+ * kernel (see the fixup table in trapasm.s).
  * 
- * @return              returns 0 if the range is valid and has the required flags
- *                      else returns a negative value
+ * @param dst       kernel destination buffer
+ * @param usrc      user source pointer
+ * @param n         number of bytes to copy
+ * 
+ * @return          returns 0 on success, -EINVAL if the range is not user memory or not readable
  */
 
-int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_flags){
-    // Validate the ptr and len are well-formed
-    if (!wellformed_vma((uintptr_t)vp) || len == 0){
-        return -1;
-    }
+int copy_from_user(void * dst, const void * usrc, size_t n){
+    if (!user_range_ok((uintptr_t)usrc, n))
+        return -EINVAL;
+    
+    return (_user_memcpy(dst, usrc, n) == 0) ? 0 : -EINVAL;
+}
 
-    uintptr_t start_vma = (uintptr_t)vp;
-    uintptr_t end_vma = start_vma + len;
 
-    // make sure the start and end addresses are page aligned
-    round_down_addr(start_vma, PAGE_SIZE);
-    round_up_addr(end_vma, PAGE_SIZE);
-
-    // Traverse all pages within the range [start_vma, end_vma)
-    for(uintptr_t current_vma = start_vma; current_vma < end_vma; current_vma += PAGE_SIZE){
-        // Get the page table entry for the current virtual address
-        struct pte *pte = walk_pt(active_space_root(), current_vma, 0);
-        if (!pte || !(pte->flags & PTE_V)){
-            return -1; // Page is not mapped
-        }
 
-        // Check if the page has the required flags
-        if ((pte->flags & rwxug_flags) != rwxug_flags){
-            return -1; // Required flags are not present 
-        }
-    }
+/**
+ * copies a block of memory from the kernel into user space
+ * 
+ * see copy_from_user. a store to a copy-on-write page gives the process its private copy.
+ * 
+ * @param udst      user destination pointer
+ * @param src       kernel source buffer
+ * @param n         number of bytes to copy
+ * 
+ * @return          returns 0 on success, -EINVAL if the range is not user memory or not writable
+ */
+
+int copy_to_user(void * udst, const void * src, size_t n){
+    if (!user_range_ok((uintptr_t)udst, n))
+        return -EINVAL;
+    
+    return (_user_memcpy(udst, src, n) == 0) ? 0 : -EINVAL;
+}
+
+
+
+/**
+ * copies a null-terminated string from user space into the kernel
+ * 
+ * at most n bytes are copied, including the null byte. see copy_from_user.
+ * 
+ * @param dst       kernel destination buffer of at least n bytes
+ * @param usrc      user pointer to the string
+ * @param n         size of the destination buffer
+ * 
+ * @return          returns the length of the string, n if the string (with its null byte)
+ *                  does not fit in n bytes, or -EINVAL if the string is not in readable
+ *                  user memory
+ */
+
+long strncpy_from_user(char * dst, const char * usrc, size_t n){
+    const uintptr_t p = (uintptr_t)usrc;
+    size_t max;
+    long len;
+
+    if (p < USER_START_VMA || USER_END_VMA <= p)
+        return -EINVAL;
+    
+    // never read past the end of the user region
+    max = MIN(n, USER_END_VMA - p);
+    len = _user_strncpy(dst, usrc, max);
+
+    if (len < 0 || (len == max && max < n))
+        return -EINVAL;
+    
+    return len;
+}
+
+/**
+ * reports the page walk cache statistics
+ * 
+ * @param hits      set to the number of level 0 walks served by the cache (may be NULL)
+ * @param misses    set to the number of level 0 walks that started at the root (may be NULL)
+ */
+
+void memory_walk_cache_stats(unsigned long * hits, unsigned long * misses){
+    if (hits != NULL)
+        *hits = walk_cache_hits;
+    if (misses != NULL)
+        *misses = walk_cache_misses;
+}
+
+
+
+/**
+ * takes a snapshot of the memory statistics
+ * 
+ * @param st    receives the statistics; the free page count includes the pre-zeroed
+ *              page pool
+ */
 
-    return 0; // All pages in the range are valid and have the required flags
+void memory_get_stats(struct memory_stats * st){
+    *st = stats;
+    st->pages_free += zeroed_cnt;
+    st->pages_zeroed = zeroed_cnt;
+    swap_usage(&st->swap_total, &st->swap_used);
+    swap_pool_usage(&st->swap_pool_stored, &st->swap_pool_pages);
+    st->text_pages = text_pages();
 }
 
 
 
 /**
- * validates virtual memory string is well formed and accesible
+ * adds a lazily populated memory region to the current process
  * 
- * @param vs        pointer to the start of the new virtual memory string
- * @param ug_flags  flags specifying required permissions for the string
+ * @param rgn   region to add. If the region is file-backed, the file gains a reference
+ *              that is dropped by memory_clear_regions
  * 
- * @return          returns 0 if the string is valid, has the required flags
- *                  else returns a negative value
+ * @return      returns 0 on success, -1 if the region table of the process is full
  */
 
-int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
-    if (!wellformed_vma((uintptr_t)vs)){
+int memory_add_region(const struct vm_region * rgn){
+    struct vm_region * const slot = region_alloc(current_process());
+
+    if (slot == NULL)
         return -1;
+    
+    *slot = *rgn;
+
+    if (rgn->io != NULL)
+        ioref(rgn->io);
+
+    return 0;
+}
+
+
+
+/**
+ * removes all memory regions of the current process and closes their files
+ */
+
+void memory_clear_regions(void){
+    struct process * const proc = current_process();
+
+    for (int i = 0; i < PROCESS_VMMAX; i++) {
+        if (proc->vmtab[i].end != 0 && proc->vmtab[i].io != NULL)
+            ioclose(proc->vmtab[i].io);
+        
+        memset(&proc->vmtab[i], 0, sizeof(struct vm_region));
     }
+}
+
+
+
+/**
+ * maps an anonymous, lazily populated region into the current process
+ * 
+ * The region is placed at /hint/ if the range there is free, and otherwise at the
+ * lowest free range of the user region. A region of 2 MB or more is aligned to a
+ * megapage boundary, so that it can be populated with megapages. No page is mapped
+ * until it is first touched (see memory_handle_page_fault).
+ * 
+ * @param hint          preferred address of the region, or 0
+ * @param size          size of the region in bytes, rounded up to a whole page
+ * @param rwxug_flags   flags of the region's pages; must include PTE_R and PTE_U
+ * 
+ * @return      returns the address of the region, -EINVAL if the size or flags are
+ *              invalid, or -ENOMEM if there is no room in the user region or in the
+ *              region table of the process
+ */
 
-    uintptr_t current_vma = (uintptr_t)vs;
+long memory_mmap(uintptr_t hint, size_t size, uint_fast8_t rwxug_flags){
+    if (size == 0 || size > USER_END_VMA - USER_START_VMA)
+        return -EINVAL;
     
-    while (1) {
-        // Get PTE for the current virtual address
-        struct pte *pte = walk_pt(active_space_root(), current_vma, 0);
-        if(!pte || !(pte->flags & PTE_V)){
-            return -1; // Page is not mapped
-        }
+    if (!user_flags_ok(rwxug_flags))
+        return -EINVAL;
 
-        // Check if page has required user and readable flags 
-        if((pte->flags & ug_flags) != ug_flags){
-            return -1; // Required flags are not present
-        }
+    return region_map(hint, size, rwxug_flags, NULL);
+}
+
+
+
+/**
+ * maps a shared memory object into the current process
+ * 
+ * The whole object is mapped as one region, placed as by memory_mmap. Its pages are
+ * mapped on first access and are shared with every other mapping of the object.
+ * 
+ * @param shmio         shared memory object (see shm.h); the region takes a reference
+ * @param hint          preferred address of the region, or 0
+ * @param rwxug_flags   flags of the region's pages; must include PTE_R and PTE_U
+ * 
+ * @return      returns the address of the region, -EINVAL if /shmio/ is not a shared
+ *              memory object or the flags are invalid, or -ENOMEM if there is no room
+ *              in the user region or in the region table of the process
+ */
+
+long memory_mmap_shared (
+    struct io_intf * shmio, uintptr_t hint, uint_fast8_t rwxug_flags)
+{
+    const size_t size = shm_size(shmio);
+
+    if (size == 0 || !user_flags_ok(rwxug_flags))
+        return -EINVAL;
+    
+    return region_map(hint, size, rwxug_flags, shmio);
+}
+
+
+
+/**
+ * removes the pages in a range from the regions of the current process
+ * 
+ * Regions that lie partly in the range are trimmed or split, and regions that lie
+ * entirely in it are removed. The pages mapped in the range are unmapped and freed.
+ * Parts of the range that are not in any region are ignored.
+ * 
+ * @param vp    start of the range; must be page aligned
+ * @param size  size of the range in bytes, rounded up to a whole page
+ * 
+ * @return      returns 0 on success, -EINVAL if the range is not page aligned or not
+ *              in the user region, or -ENOMEM if a region would have to be split and
+ *              the region table of the process is full
+ */
+
+int memory_munmap(const void * vp, size_t size){
+    struct process * const proc = current_process();
+    const uintptr_t start = (uintptr_t)vp;
+    struct vm_region * rgn;
+    uintptr_t end;
+    int i;
+
+    if (!aligned_addr(start, PAGE_SIZE) || size == 0)
+        return -EINVAL;
+    
+    end = start + round_up_size(size, PAGE_SIZE);
 
-        // Access the current character
-        const char *current_char = (const char *)current_vma;
-        if (*current_char == '\0'){
-            return 0; // Found null terminator, string is valid
+    if (!user_range_ok(start, end - start))
+        return -EINVAL;
+    
+    if (region_split(proc, start) != 0 || region_split(proc, end) != 0)
+        return -ENOMEM;
+    
+    for (i = 0; i < PROCESS_VMMAX; i++) {
+        rgn = &proc->vmtab[i];
+        if (rgn->end != 0 && start <= rgn->start && rgn->end <= end) {
+            if (rgn->io != NULL)
+                ioclose(rgn->io);
+            memset(rgn, 0, sizeof(struct vm_region));
         }
+    }
 
-        current_vma++;
-        
-        if(current_vma % PAGE_SIZE == 0){
-            // Moving to next page, repeat checks for new page
+    memory_unmap_range(active_space_root(), start, end);
+    return 0;
+}
+
+
+
+/**
+ * changes the flags of the pages in a range of the current process
+ * 
+ * The range must be covered by regions of the process. Regions that lie partly in
+ * the range are split, and the regions in the range take the new flags, as do the
+ * pages of the range that are already mapped. A copy-on-write page made writable
+ * stays copy-on-write (so the first store still copies it), and a page shared with
+ * another space is made copy-on-write rather than writable, unless it belongs to a
+ * shared memory object.
+ * 
+ * @param vp            start of the range; must be page aligned
+ * @param size          size of the range in bytes, rounded up to a whole page
+ * @param rwxug_flags   new flags; must include PTE_R and PTE_U
+ * 
+ * @return      returns 0 on success, -EINVAL if the range or flags are invalid or the
+ *              range is not covered by regions, or -ENOMEM if the region table of the
+ *              process is full
+ */
+
+int memory_mprotect(const void * vp, size_t size, uint_fast8_t rwxug_flags){
+    struct process * const proc = current_process();
+    const uintptr_t start = (uintptr_t)vp;
+    struct vm_region * rgn;
+    struct pt_iter it;
+    struct pte * pte;
+    uintptr_t vma;
+    uintptr_t end;
+    int i;
+
+    if (!aligned_addr(start, PAGE_SIZE) || size == 0)
+        return -EINVAL;
+    
+    if (!user_flags_ok(rwxug_flags))
+        return -EINVAL;
+    
+    end = start + round_up_size(size, PAGE_SIZE);
+
+    if (!user_range_ok(start, end - start) || !region_covered(proc, start, end))
+        return -EINVAL;
+    
+    if (region_split(proc, start) != 0 || region_split(proc, end) != 0)
+        return -ENOMEM;
+    
+    for (i = 0; i < PROCESS_VMMAX; i++) {
+        rgn = &proc->vmtab[i];
+        if (rgn->end != 0 && start <= rgn->start && rgn->end <= end)
+            rgn->flags = rwxug_flags;
+    }
+
+    pt_split_range(active_space_root(), start, end);
+    pt_iter_init(&it, active_space_root(), start, end);
+    it.swap = 1;
+
+    while ((pte = pt_iter_next(&it, &vma)) != NULL) {
+        // a swapped-out page is private; it comes back with the new flags
+        if (pte_swapped(pte)) {
+            pte->flags = rwxug_flags & PTE_FLAGS_MASK;
             continue;
         }
-    }    
 
-    return -1; // Should never reach here.
+        pte->flags &= ~PTE_FLAGS_MASK;
+        pte->flags |= rwxug_flags & ~PTE_W;
+
+        if (!(rwxug_flags & PTE_W))
+            pte->rsw &= ~PTE_RSW_COW;
+        else if (pte->rsw & PTE_RSW_SHARED)
+            pte->flags |= PTE_W;
+        else if ((pte->rsw & PTE_RSW_COW) ||
+            *page_refcnt_ptr(pagenum_to_pageptr(pte->ppn)) > 1)
+            pte->rsw |= PTE_RSW_COW;
+        else
+            pte->flags |= PTE_W;
+    }
+
+    sfence_vma_asid(active_space_asid());
+    return 0;
 }
 
+
+
 /**
  * this function clones the memory space of the parent into the child
  * 
  * This function duplicates the current process's memory space, returning a new mtag
- * representing the child's address space. It performs a shallow copy of the kernel mappings, and a 
- * deep copy of user-space pages by allocating new pages and copying their contents
+ * representing the child's address space. It performs a shallow copy of the kernel mappings.
+ * User pages are not copied: parent and child share every physical page, and writable
+ * pages are downgraded to read-only copy-on-write mappings in both spaces. The first
+ * store to such a page faults and copies only that page (see cow_break). Megapages of
+ * the parent are split first, since megapage blocks are never shared.
  * 
- * @param asid      address space identifier for the child's address space unused for this MP
+ * @param asid      address space identifier for the child's address space. 0 (no ASID)
+ *                  lets memory_space_switch assign one when the space is first activated
  * 
- * @return          returns the mtag of the newly cloned memory space
+ * @return          returns the mtag of the newly cloned memory space, or 0 if memory and
+ *                  swap are exhausted
  */
 uintptr_t memory_space_clone(uint_fast16_t asid){
+    struct pte * parent_pte, * child_pte;
+    struct pt_iter it;
+    uintptr_t vma;
+
     // get parent mtag 
     uintptr_t parent_mtag = current_process()->mtag;
 
@@ -744,9 +1599,11 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
     struct pte* parent_root_pt = mtag_to_root(parent_mtag);
 
     // allocate new root page 
-    struct pte *new_root = memory_alloc_page();
+    struct pte *new_root = memory_try_alloc_page();
     if (!new_root) 
         return 0; // Allocation failure
+    
+    stats.pages_ptab += 1;
 
     struct pte *child_root = new_root;
 
@@ -757,31 +1614,59 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
             child_root[i] = main_pt2[i];
     }
 
-    // clone the page table entries
-    for (uintptr_t vma = USER_START_VMA; vma < USER_END_VMA; vma += PAGE_SIZE) {
-        struct pte *parent_pte = walk_pt(parent_root_pt, vma, 0);
-        if (!parent_pte || !(parent_pte->flags & PTE_V)) {
-            continue; // Skip unmapped pages
+    // share the user pages copy-on-write, visiting only mapped and swapped-out
+    // pages
+    pt_iter_init(&it, parent_root_pt, USER_START_VMA, USER_END_VMA);
+    it.swap = 1;
+
+    while ((parent_pte = pt_iter_next(&it, &vma)) != NULL) {
+        // split a megapage and revisit its range as individual pages
+        if (it.order != 0) {
+            if (pt_split(parent_pte) != 0)
+                break;
+
+            it.vma = vma;
+            continue;
         }
 
-        void *parent_phys_page = pagenum_to_pageptr(parent_pte->ppn);
+        // walk to the same vma in the child root. This may swap out the
+        // parent's page, so the parent's PTE is looked at only afterwards.
+        child_pte = walk_pt(child_root, vma, 1);
 
-        // walk to the same vma in the child root
-        struct pte *child_pte = walk_pt(child_root, vma, 1);
+        if (child_pte == NULL)
+            break;
 
-        // allocate the page that the child pte points to 
-        void* child_pt = memory_alloc_page();
+        // the child shares the swap entry; each side reads its own copy back
+        if (pte_swapped(parent_pte)) {
+            swap_dup(parent_pte->ppn);
+            *child_pte = *parent_pte;
+            continue;
+        }
 
-        // set the ppn of the child pte to the newly allocated page
-        child_pte->ppn = pageptr_to_pagenum(child_pt);
+        // writable pages become read-only in the parent until one side writes,
+        // except for pages of shared memory objects, which stay shared
+        if ((parent_pte->flags & PTE_W) && !(parent_pte->rsw & PTE_RSW_SHARED)) {
+            parent_pte->flags &= ~PTE_W;
+            parent_pte->rsw |= PTE_RSW_COW;
+        }
 
-        // copy the flags over from paren pte
-        child_pte->flags |= parent_pte->flags;
+        // child maps the same physical page with the same permissions
+        *child_pte = *parent_pte;
+        memory_page_ref(pagenum_to_pageptr(parent_pte->ppn));
+        page_mapped(pagenum_to_pageptr(parent_pte->ppn));
+        stats.clone_pages += 1;
+    }
 
-        void *child_phys_page = pagenum_to_pageptr(child_pte->ppn);
+    // parent may still have writable translations cached
+    sfence_vma_asid(active_space_asid());
 
-        // clone the contents of the parent vma to child vma
-        memcpy(child_phys_page, parent_phys_page, PAGE_SIZE);
+    // out of memory: take the child's space apart again. The parent's pages
+    // that became copy-on-write are made writable on their next store.
+    if (parent_pte != NULL) {
+        space_free_user(child_root);
+        memory_free_page(child_root);
+        stats.pages_ptab -= 1;
+        return 0;
     }
 
     // construct new mtag with given asid 
@@ -801,7 +1686,7 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
  * this function traverses the page table hierarchy starting from the root and locates
  * the pte that maps the 4kb page containing the given vma. If create is non-zero the 
  * function will allocate a new page table(s) as needed to complete the walk down to the 
- * leaf level (level 0). This function does not map mega or giga pages. 
+ * leaf level (level 0). A user megapage in the way is split when create is non-zero.
  * 
  * @param root      pointer to the root page table
  * @param vma       virtual memory address for which the PTE is sought
@@ -812,8 +1697,37 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
  */
 
 struct pte * walk_pt(struct pte* root, uintptr_t vma, int create) {
+    return walk_pt_level(root, vma, 0, create);
+}
+
+
+
+/**
+ * walks the page table down to the given level
+ * 
+ * like walk_pt, but stops at /level/ (0 to 2) and returns the pte of that level that
+ * covers vma: a level 1 pte maps (or points to the table for) a 2 MB range. A non-global
+ * megapage leaf above the requested level is split if create is non-zero; any other leaf
+ * ends the walk. Level 0 walks go through the page walk cache.
+ * 
+ * @param root      pointer to the root page table
+ * @param vma       virtual memory address for which the PTE is sought
+ * @param level     page table level of the PTE to return
+ * @param create    if non-zero, indicates that missing pts should be created
+ * 
+ * @return          returns a pointer to the pte at the given level for vma
+ *                  if the pte can't be found or created returns NULL
+ */
+
+struct pte * walk_pt_level(struct pte* root, uintptr_t vma, int level, int create) {
     struct pte* pt = root;
 
+    // a level 0 walk usually finds its table in the page walk cache
+    if (level == 0 && (pt = walk_cache_lookup(root, vma)) != NULL)
+        return &pt[VPN0(vma)];
+    
+    pt = root;
+
     // virtual page number bits
     uint64_t vpn[3];
     vpn[0] = VPN0(vma);
@@ -821,32 +1735,37 @@ struct pte * walk_pt(struct pte* root, uintptr_t vma, int create) {
     vpn[2] = VPN2(vma);
 
     // walk down the page table starting from the highest level (ie level 2)
-    for (int level = 2; level > 0; level--) {
-        // check if the entry is valid
-        if (pt != NULL && pt[vpn[level]].flags & PTE_V) {
-            // grab the page table entry of the next level
-            struct pte* pte = (struct pte*)((uint64_t)pt[vpn[level]].ppn << PAGE_ORDER);
+    for (int lvl = 2; lvl > level; lvl--) {
+        struct pte* pte = &pt[vpn[lvl]];
 
+        // check if the entry is valid
+        if (pt != NULL && pte->flags & PTE_V) {
             // if pte has flags r=0, w=0, and x=0, pte refers to next level
-            if (pt[vpn[level]].flags & (PTE_R | PTE_W | PTE_X)) {
-                // leaf pte encountered at a non-leaf level, return
-                return NULL;
-            } else {
-                // pte is valid pointing to the next level
-                // make pt point to pte
-                pt = pte;
+            if (pte->flags & (PTE_R | PTE_W | PTE_X)) {
+                // leaf pte encountered at a non-leaf level. only a user
+                // megapage can be split to continue the walk
+                if (!create || lvl != 1 || (pte->flags & PTE_G))
+                    return NULL;
+                
+                if (pt_split(pte) != 0)
+                    return NULL;
             }
+
+            // pte is valid pointing to the next level
+            // make pt point to the next level table
+            pt = (struct pte*)pagenum_to_pageptr(pte->ppn);
         } else if (create) {
             // entry isn't valid create the entry
             // allocate a new page table
-            struct pte* new_pt = (struct pte*)memory_alloc_page(); // should panic if no pages available
+            struct pte* new_pt = (struct pte*)page_alloc_reclaim(1);
+
+            if (new_pt == NULL)
+                return NULL;
 
-            console_printf("new pt address: 0x%x\n", new_pt);
+            stats.pages_ptab += 1;
 
-            pt[vpn[level]].ppn = (uint64_t)new_pt >> PAGE_ORDER;
-            pt[vpn[level]].flags = PTE_V;
-            
             // set up the pte to point to the new page table
+            *pte = ptab_pte(new_pt, 0);
             pt = new_pt;
         } else {
             // entry isn't valid return NULL
@@ -854,8 +1773,11 @@ struct pte * walk_pt(struct pte* root, uintptr_t vma, int create) {
         }
     }
 
-    // at level 0, return the pte corresponding to vpn[0]
-    return &pt[vpn[0]];
+    if (level == 0)
+        walk_cache_insert(root, vma, pt);
+
+    // return the pte corresponding to vpn[level]
+    return &pt[vpn[level]];
 }
 
 
@@ -893,9 +1815,20 @@ uintptr_t active_memory_space(void) {
 }
 
 uintptr_t memory_space_switch(uintptr_t mtag) {
-    uintptr_t old_mtag = csrrw_satp(mtag);
+    const uintptr_t old_mtag = active_space_mtag();
 
-    sfence_vma();
+    // nothing to do if the space is already active
+    if (mtag == old_mtag)
+        return old_mtag;
+    
+    mtag = asid_assign(mtag);
+
+    if (mtag != old_mtag)
+        csrw_satp(mtag);
+
+    // without ASIDs, all user spaces share ASID 0 and the TLB must go
+    if (asid_cnt <= 1 && mtag_to_root(mtag) != mtag_to_root(old_mtag))
+        sfence_vma();
 
     return old_mtag;
 }
@@ -904,6 +1837,21 @@ static inline struct pte * mtag_to_root(uintptr_t mtag) {
     return (struct pte *)((mtag << 20) >> 8);
 }
 
+static inline uint_fast16_t mtag_to_asid(uintptr_t mtag) {
+    return (mtag >> RISCV_SATP_ASID_shift) & ((1UL << RISCV_SATP_ASID_nbits) - 1);
+}
+
+static inline uintptr_t mtag_with_asid(uintptr_t mtag, uint_fast16_t asid) {
+    const uintptr_t mask =
+        ((1UL << RISCV_SATP_ASID_nbits) - 1) << RISCV_SATP_ASID_shift;
+    
+    return (mtag & ~mask) | ((uintptr_t)asid << RISCV_SATP_ASID_shift);
+}
+
+static inline uint_fast16_t active_space_asid(void) {
+    return mtag_to_asid(active_space_mtag());
+}
+
 
 struct pte * active_space_root(void) {
     return mtag_to_root(active_space_mtag());
@@ -959,6 +1907,35 @@ static inline struct pte ptab_pte (
     };
 }
 
+static inline struct pte swap_pte(unsigned long entry, uint_fast8_t rwxug_flags) {
+    struct pte pte = null_pte();
+
+    pte.flags = rwxug_flags & PTE_FLAGS_MASK;
+    pte.rsw = PTE_RSW_SWAP;
+    pte.ppn = entry;
+    return pte;
+}
+
+static inline int pte_swapped(const struct pte * pte) {
+    return !(pte->flags & PTE_V) && pte->rsw == PTE_RSW_SWAP;
+}
+
+// Returns 1 if the flags of the leaf /pte/ allow the access that caused a page
+// fault with scause exception code /cause/.
+
+static inline int access_ok(const struct pte * pte, unsigned int cause) {
+    switch (cause) {
+    case RISCV_SCAUSE_INSTR_PAGE_FAULT:
+        return (pte->flags & PTE_X) != 0;
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+        return (pte->flags & PTE_R) != 0;
+    case RISCV_SCAUSE_STORE_PAGE_FAULT:
+        return (pte->flags & PTE_W) != 0;
+    default:
+        return 0;
+    }
+}
+
 static inline struct pte null_pte(void) {
     return (struct pte) { };
 }
@@ -966,3 +1943,1440 @@ static inline struct pte null_pte(void) {
 static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
+
+// Flushes the translations of one page in every address space, including
+// global and megapage mappings of the page.
+
+static inline void sfence_vma_addr(uintptr_t vma) {
+    asm inline ("sfence.vma %0, zero" :: "r" (vma) : "memory");
+}
+
+// Flushes all non-global translations tagged with /asid/ (the register form of
+// the rs2 operand, so ASID 0 means just ASID 0, not all of them).
+
+static inline void sfence_vma_asid(uintptr_t asid) {
+    asm inline ("sfence.vma zero, %0" :: "r" (asid) : "memory");
+}
+
+void pt_iter_init (
+    struct pt_iter * it, struct pte * root, uintptr_t start, uintptr_t end)
+{
+    it->root = root;
+    it->vma = round_down_addr(start, PAGE_SIZE);
+    it->end = end;
+    it->order = 0;
+    it->swap = 0;
+}
+
+// Returns the next present leaf PTE in the iterator's range and stores its
+// virtual address in *vmaptr, or returns NULL when the range is exhausted. A
+// level 1 leaf (megapage) is returned once, with the address of its first
+// page, and it->order set to MEGA_ORDER; it->order is 0 for a level 0 leaf.
+// Absent entries and level 2 leaves are skipped, and so are swap entries
+// unless it->swap is set.
+
+struct pte * pt_iter_next(struct pt_iter * it, uintptr_t * vmaptr) {
+    const struct pte * pte2;
+    struct pte * pte1;
+    struct pte * pt0;
+    uintptr_t vma;
+
+    while (it->vma < it->end) {
+        vma = it->vma;
+        pte2 = &it->root[VPN2(vma)];
+
+        if (!(pte2->flags & PTE_V) || (pte2->flags & (PTE_R | PTE_W | PTE_X))) {
+            it->vma = round_down_addr(vma, GIGA_SIZE) + GIGA_SIZE;
+            continue;
+        }
+
+        pte1 = (struct pte *)pagenum_to_pageptr(pte2->ppn) + VPN1(vma);
+
+        if (!(pte1->flags & PTE_V)) {
+            it->vma = round_down_addr(vma, MEGA_SIZE) + MEGA_SIZE;
+            continue;
+        }
+
+        if (pte1->flags & (PTE_R | PTE_W | PTE_X)) {
+            it->vma = round_down_addr(vma, MEGA_SIZE) + MEGA_SIZE;
+            it->order = MEGA_ORDER;
+            *vmaptr = round_down_addr(vma, MEGA_SIZE);
+            return pte1;
+        }
+
+        pt0 = pagenum_to_pageptr(pte1->ppn);
+        it->vma = vma + PAGE_SIZE;
+
+        if ((pt0[VPN0(vma)].flags & PTE_V) ||
+            (it->swap && pte_swapped(&pt0[VPN0(vma)])))
+        {
+            it->order = 0;
+            *vmaptr = vma;
+            return &pt0[VPN0(vma)];
+        }
+    }
+
+    return NULL;
+}
+
+// Unmaps and frees the pages mapped in [start,end) of the page table /root/,
+// and the swap slots of the pages swapped out. Megapages that extend past the
+// range are split and only partly unmapped.
+
+static void memory_unmap_range(struct pte * root, uintptr_t start, uintptr_t end) {
+    struct pt_iter it;
+    struct pte * pte;
+    uintptr_t vma;
+
+    pt_split_range(root, start, end);
+    pt_iter_init(&it, root, start, end);
+    it.swap = 1;
+
+    while ((pte = pt_iter_next(&it, &vma)) != NULL) {
+        if (pte_swapped(pte)) {
+            swap_free(pte->ppn);
+            *pte = null_pte();
+            continue;
+        }
+
+        page_unmapped(pagenum_to_pageptr(pte->ppn));
+        memory_free_pages(pagenum_to_pageptr(pte->ppn), it.order);
+        rss_add(-(1L << it.order));
+        *pte = null_pte();
+    }
+
+    sfence_vma_asid(active_space_asid());
+}
+
+// Frees the user pages and swap slots of the space with root table /root/, and
+// its user page tables. The global (kernel) entries of a root are shared and
+// never freed. The root itself is left to the caller. Returns the number of
+// pages that were mapped.
+
+static long space_free_user(struct pte * root) {
+    struct pt_iter it;
+    struct pte * pte;
+    uintptr_t vma;
+    long pages = 0;
+
+    pt_iter_init(&it, root, USER_START_VMA, USER_END_VMA);
+    it.swap = 1;
+
+    while ((pte = pt_iter_next(&it, &vma)) != NULL) {
+        if (pte_swapped(pte)) {
+            swap_free(pte->ppn);
+            *pte = null_pte();
+            continue;
+        }
+
+        // skip global mappings
+        if (pte->flags & PTE_G) continue;
+
+        // free the physical page (or megapage block)
+        page_unmapped(pagenum_to_pageptr(pte->ppn));
+        memory_free_pages(pagenum_to_pageptr(pte->ppn), it.order);
+        pages += 1L << it.order;
+
+        // invalidate the pte
+        *pte = null_pte();
+    }
+
+    free_user_ptabs(root);
+    return pages;
+}
+
+// Frees the level 1 and level 0 page tables reachable from the non-global
+// entries of /root/ that cover the user region, and clears those entries. The
+// page tables are tracked by the tree itself: every table below a non-global
+// root entry was created by walk_pt() for this space. Leaf pages and megapages
+// must already have been unmapped.
+
+static void free_user_ptabs(struct pte * root) {
+    struct pte * pt1, * pt0;
+    int i2, i1;
+
+    walk_cache_flush(root);
+
+    for (i2 = VPN2(USER_START_VMA); i2 <= VPN2(USER_END_VMA - 1); i2++) {
+        if (!(root[i2].flags & PTE_V) || (root[i2].flags & PTE_G))
+            continue;
+        
+        if (root[i2].flags & (PTE_R | PTE_W | PTE_X))
+            continue;
+
+        pt1 = pagenum_to_pageptr(root[i2].ppn);
+
+        for (i1 = 0; i1 < PTE_CNT; i1++) {
+            if (!(pt1[i1].flags & PTE_V) ||
+                (pt1[i1].flags & (PTE_R | PTE_W | PTE_X)))
+                continue;
+
+            pt0 = pagenum_to_pageptr(pt1[i1].ppn);
+            memory_free_page(pt0);
+            stats.pages_ptab -= 1;
+        }
+
+        memory_free_page(pt1);
+        stats.pages_ptab -= 1;
+        root[i2] = null_pte();
+    }
+}
+
+// Populates the absent user page at /vma/ from the regions of the current
+// process that cover it: the file-backed bytes are read from the region's file
+// and the rest of the page is zero. The page is mapped with the union of the
+// covering regions' flags (segments of an executable may share a page).
+// A page of a read-only file-backed region comes from the text cache, so
+// processes running the same executable share it. A page of file data is read
+// together with the pages after it (see region_populate_cluster).
+// Returns 0 on success, -ENOENT if no region covers the page, -EIO if the
+// file could not be read, or -ENOMEM if memory and swap are exhausted.
+
+int region_populate(uintptr_t vma) {
+    struct process * const proc = current_process();
+    const struct vm_region * rgn;
+    const struct vm_region * covering[PROCESS_VMMAX];
+    uint_fast8_t flags = 0;
+    uintptr_t lo, hi;
+    struct pte * pte;
+    void * page;
+    int cnt = 0;
+    int result;
+    int i;
+
+    vma = round_down_addr(vma, PAGE_SIZE);
+
+    if (proc == NULL)
+        return -ENOENT;
+
+    for (i = 0; i < PROCESS_VMMAX; i++) {
+        rgn = &proc->vmtab[i];
+        if (rgn->start <= vma && vma < rgn->end) {
+            covering[cnt++] = rgn;
+            flags |= rgn->flags;
+        }
+    }
+
+    if (cnt == 0)
+        return -ENOENT;
+
+    // Pages of a shared memory object are mapped, not copied. Shared regions
+    // never overlap other regions.
+    rgn = covering[0];
+    if (rgn->shared) {
+        page = shm_page(rgn->io, (rgn->offset + (vma - rgn->start)) / PAGE_SIZE);
+        pte = walk_pt(active_space_root(), vma, 1);
+
+        if (page == NULL || pte == NULL)
+            return -ENOMEM;
+
+        memory_page_ref(page);
+        *pte = leaf_pte(page, rgn->flags);
+        pte->rsw = PTE_RSW_SHARED;
+        page_mapped(page);
+        rss_add(1);
+        sfence_vma_addr(vma);
+        stats.faults_shared += 1;
+        return 0;
+    }
+
+    // A region that covers the whole 2 MB range around the page may get a
+    // megapage instead
+    if (cnt == 1) {
+        result = region_populate_mega(proc, covering[0], vma);
+        if (result != -ENOENT)
+            return result;
+    }
+
+    if (cnt == 1 && covering[0]->io != NULL && !(covering[0]->flags & PTE_W)) {
+        result = region_populate_text(covering[0], vma);
+        if (result != -ENOENT)
+            return result;
+    }
+
+    // A page of file data is read along with the pages after it
+    if (cnt == 1 && covering[0]->io != NULL) {
+        result = region_populate_cluster(covering[0], vma);
+        if (result != -ENOENT)
+            return result;
+    }
+
+    // A page filled entirely from one file need not be zeroed first
+    rgn = covering[0];
+    page = page_alloc_reclaim(!(cnt == 1 && rgn->io != NULL &&
+        rgn->data_start <= vma && vma + PAGE_SIZE <= rgn->data_end));
+    
+    if (page == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < cnt; i++) {
+        rgn = covering[i];
+        lo = MAX(vma, rgn->data_start);
+        hi = MIN(vma + PAGE_SIZE, rgn->data_end);
+
+        // anonymous regions and pages past the file data stay zero
+        if (rgn->io == NULL || hi <= lo)
+            continue;
+
+        if (region_read(rgn, page + (lo - vma), lo, hi) != 0) {
+            memory_free_page(page);
+            return -EIO;
+        }
+    }
+
+    pte = walk_pt(active_space_root(), vma, 1);
+
+    if (pte == NULL) {
+        memory_free_page(page);
+        return -ENOMEM;
+    }
+
+    *pte = leaf_pte(page, flags);
+    page_mapped(page);
+    rss_add(1);
+
+    if (covering[0]->io != NULL)
+        stats.faults_file += 1;
+    else
+        stats.faults_zero += 1;
+
+    // Neighbours of a page of an anonymous region are mapped along with it.
+    // One flush covers the whole batch.
+    if (cnt == 1 && covering[0]->io == NULL &&
+        fault_around(proc, covering[0], vma, pte) != 0)
+        sfence_vma_asid(active_space_asid());
+    else
+        sfence_vma_addr(vma);
+
+    return 0;
+}
+
+// Maps zero-filled pages next to the just populated page /vma/ of the
+// anonymous region /rgn/, whose PTE is /pte/. The number of pages (including
+// /vma/) is the fault-around window of /proc/, which adapts to the fault
+// pattern: a fault right after the previous batch, or right before it, is
+// sequential and doubles the window (and the batch extends in the direction
+// of the faults); any other fault halves it. The batch stays within the
+// region and the level 0 table of /vma/, and skips pages already mapped or
+// swapped out.
+// Stops early if memory runs out, and then remembers only the pages it got
+// to as the batch. Returns the number of pages mapped; the caller flushes the
+// TLB.
+
+unsigned int fault_around (
+    struct process * proc, const struct vm_region * rgn,
+    uintptr_t vma, struct pte * pte)
+{
+    const uintptr_t mva = round_down_addr(vma, MEGA_SIZE);
+    const int down = (vma + PAGE_SIZE == proc->fault_prev);
+    const long step = down ? -(long)PAGE_SIZE : (long)PAGE_SIZE;
+    uintptr_t lo, hi, va;
+    unsigned int cnt = 0;
+    struct pte * npte;
+    void * page;
+
+    if (vma == proc->fault_next || down)
+        proc->fault_window = MIN(2 * proc->fault_window, MEMORY_FAULT_AROUND_MAX);
+    else
+        proc->fault_window = MAX(proc->fault_window / 2, 1);
+    
+    if (down) {
+        lo = vma - (proc->fault_window - 1) * PAGE_SIZE;
+        lo = MAX(lo, MAX(rgn->start, mva));
+        hi = vma + PAGE_SIZE;
+    } else {
+        lo = vma;
+        hi = vma + proc->fault_window * PAGE_SIZE;
+        hi = MIN(hi, MIN(rgn->end, mva + MEGA_SIZE));
+    }
+
+    // the batch grows away from /vma/, so that the pages mapped before
+    // memory runs out adjoin it
+    for (va = vma + step; lo <= va && va < hi; va += step) {
+        npte = pte + ((long)(va - vma) / (long)PAGE_SIZE);
+
+        if ((npte->flags & PTE_V) || pte_swapped(npte))
+            continue;
+        
+        // pages zeroed by the idle thread first; zeroing here delays the
+        // faulting process
+        if ((page = zeroed_take()) == NULL &&
+            (page = memory_alloc_pages(0)) == NULL)
+            break;
+        
+        *npte = leaf_pte(page, rgn->flags);
+        page_mapped(page);
+        cnt += 1;
+    }
+
+    // the next sequential fault is the one just past the pages reached
+    if (down)
+        lo = va + PAGE_SIZE;
+    else
+        hi = va;
+
+    proc->fault_prev = lo;
+    proc->fault_next = hi;
+
+    rss_add(cnt);
+    stats.faultaround_pages += cnt;
+
+    return cnt;
+}
+
+// Maps the aligned 2 MB range containing /vma/ with one megapage populated
+// from /rgn/, if the range lies entirely within /rgn/, overlaps no other
+// region of /proc/, and has no page table yet. Returns 0 on success, -EIO if
+// the file could not be read, or -ENOENT if a megapage cannot be used.
+
+int region_populate_mega (
+    const struct process * proc, const struct vm_region * rgn, uintptr_t vma)
+{
+    const uintptr_t mva = round_down_addr(vma, MEGA_SIZE);
+    const struct vm_region * other;
+    struct pte * pte1;
+    uintptr_t lo, hi;
+    void * blk;
+    int i;
+
+    if (mva < rgn->start || rgn->end - mva < MEGA_SIZE)
+        return -ENOENT;
+    
+    for (i = 0; i < PROCESS_VMMAX; i++) {
+        other = &proc->vmtab[i];
+        if (other != rgn && other->start < mva + MEGA_SIZE && mva < other->end)
+            return -ENOENT;
+    }
+
+    pte1 = walk_pt_level(active_space_root(), mva, 1, 1);
+
+    if (pte1 == NULL || (pte1->flags & PTE_V))
+        return -ENOENT;
+    
+    blk = memory_alloc_pages(MEGA_ORDER);
+
+    if (blk == NULL)
+        return -ENOENT;
+    
+    lo = MAX(mva, rgn->data_start);
+    hi = MIN(mva + MEGA_SIZE, rgn->data_end);
+
+    if (rgn->io != NULL && lo < hi &&
+        region_read(rgn, blk + (lo - mva), lo, hi) != 0)
+    {
+        memory_free_pages(blk, MEGA_ORDER);
+        return -EIO;
+    }
+
+    *pte1 = leaf_pte(blk, rgn->flags);
+    page_mapped(blk);
+    rss_add(PTE_CNT);
+    sfence_vma_addr(mva);
+
+    if (rgn->io != NULL)
+        stats.faults_file += 1;
+    else
+        stats.faults_zero += 1;
+
+    return 0;
+}
+
+// Maps the page /vma/ of the read-only file-backed region /rgn/, the only
+// region covering it, from the text cache. A page that is not cached yet is
+// read from the file and cached. Returns 0 on success, -EIO if the file could
+// not be read, -ENOMEM if memory and swap are exhausted, or -ENOENT if the
+// page holds no file data or the file has no inode.
+
+int region_populate_text(const struct vm_region * rgn, uintptr_t vma) {
+    const uintptr_t lo = MAX(vma, rgn->data_start);
+    const uintptr_t hi = MIN(vma + PAGE_SIZE, rgn->data_end);
+    uint64_t ino, off;
+    struct pte * pte;
+    void * page;
+    int result;
+
+    if (hi <= lo || ioctl(rgn->io, IOCTL_GETINO, &ino) != 0)
+        return -ENOENT;
+
+    // file offset of the page; offset and address are congruent modulo the
+    // page size
+    off = rgn->offset + (lo - rgn->data_start) - (lo - vma);
+    page = text_lookup(ino, off, lo - vma, hi - vma);
+
+    if (page != NULL)
+        stats.faults_text += 1;
+    else {
+        // a whole page of file data is read and cached along with the pages
+        // after it
+        result = region_populate_cluster(rgn, vma);
+        if (result != -ENOENT)
+            return result;
+
+        page = page_alloc_reclaim(lo != vma || hi != vma + PAGE_SIZE);
+
+        if (page == NULL)
+            return -ENOMEM;
+        
+        if (region_read(rgn, page + (lo - vma), lo, hi) != 0) {
+            memory_free_page(page);
+            return -EIO;
+        }
+
+        text_insert(ino, off, lo - vma, hi - vma, page);
+        stats.faults_file += 1;
+    }
+
+    // the page is never writable here: mprotect makes it copy-on-write, since
+    // the cache holds a reference
+    pte = walk_pt(active_space_root(), vma, 1);
+
+    if (pte == NULL) {
+        memory_free_page(page);
+        return -ENOMEM;
+    }
+
+    *pte = leaf_pte(page, rgn->flags);
+    page_mapped(page);
+    rss_add(1);
+    sfence_vma_addr(vma);
+
+    return 0;
+}
+
+// Maps the page /vma/ of the file-backed region /rgn/, the only region
+// covering it, along with the pages after it, reading them all from the file
+// with one request. The cluster grows while the pages hold only file data, lie
+// in the level 0 table of /vma/ and are neither mapped nor swapped out (nor
+// cached, for a read-only region), up to MEMORY_FILE_CLUSTER pages; it shrinks
+// to the largest free block of pages. Pages of a read-only region are added to
+// the text cache. Returns 0 on success, -EIO if the file could not be read,
+// -ENOMEM if memory and swap are exhausted, or -ENOENT if there is nothing to
+// cluster (the page is not all file data, the next page cannot join, or no
+// block of two pages is free); the caller then populates the page alone.
+
+int region_populate_cluster(const struct vm_region * rgn, uintptr_t vma) {
+    const uintptr_t mva = round_down_addr(vma, MEGA_SIZE);
+    const int text = !(rgn->flags & PTE_W);
+    unsigned int cnt, order, i;
+    uintptr_t end, va;
+    struct pte * pte;
+    void * blk = NULL;
+    void * page;
+    uint64_t ino;
+
+    if (vma < rgn->data_start || rgn->data_end < vma + PAGE_SIZE)
+        return -ENOENT;
+    
+    if (text && ioctl(rgn->io, IOCTL_GETINO, &ino) != 0)
+        return -ENOENT;
+    
+    end = MIN(vma + MEMORY_FILE_CLUSTER * PAGE_SIZE, mva + MEGA_SIZE);
+    end = MIN(end, round_down_addr(rgn->data_end, PAGE_SIZE));
+
+    pte = walk_pt(active_space_root(), vma, 1);
+
+    if (pte == NULL)
+        return -ENOMEM;
+
+    for (va = vma + PAGE_SIZE; va < end; va += PAGE_SIZE) {
+        if ((pte[(va - vma) / PAGE_SIZE].flags & PTE_V) ||
+            pte_swapped(&pte[(va - vma) / PAGE_SIZE]))
+            break;
+        
+        if (text && (page = text_lookup(ino,
+            rgn->offset + (va - rgn->data_start), 0, PAGE_SIZE)) != NULL)
+        {
+            memory_free_page(page);
+            break;
+        }
+    }
+
+    cnt = (va - vma) / PAGE_SIZE;
+
+    // the smallest block that holds the cluster, or the largest free one
+    // below it; the allocation does not sleep, so the PTEs stay as checked
+    order = 0;
+    while ((1U << order) < cnt)
+        order += 1;
+    
+    while (0 < order && (blk = memory_alloc_pages_nozero(order)) == NULL)
+        order -= 1;
+    
+    if (order == 0)
+        return -ENOENT;
+    
+    cnt = MIN(cnt, 1U << order);
+
+    // every page of the block is a page of its own from here on; the pages
+    // past the cluster are given back
+    for (i = 1; i < (1U << order); i++) {
+        *page_refcnt_ptr(blk + i * PAGE_SIZE) = 1;
+
+        if (cnt <= i)
+            memory_free_page(blk + i * PAGE_SIZE);
+    }
+
+    if (region_read(rgn, blk, vma, vma + cnt * PAGE_SIZE) != 0) {
+        for (i = 0; i < cnt; i++)
+            memory_free_page(blk + i * PAGE_SIZE);
+        return -EIO;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        va = vma + i * PAGE_SIZE;
+        page = blk + i * PAGE_SIZE;
+
+        if (text)
+            text_insert(ino, rgn->offset + (va - rgn->data_start), 0, PAGE_SIZE, page);
+        
+        pte[i] = leaf_pte(page, rgn->flags);
+        page_mapped(page);
+    }
+
+    rss_add(cnt);
+    stats.faults_file += 1;
+    stats.faultaround_pages += cnt - 1;
+    sfence_vma_asid(active_space_asid());
+
+    return 0;
+}
+
+// Reads the file-backed bytes of /rgn/ at addresses [lo,hi) into /buf/.
+// Returns 0 on success or -EIO.
+
+int region_read (
+    const struct vm_region * rgn, void * buf, uintptr_t lo, uintptr_t hi)
+{
+    long len;
+
+    lock_acquire(&pager_lock);
+
+    if (ioseek(rgn->io, rgn->offset + (lo - rgn->data_start)) != 0)
+        len = -EIO;
+    else
+        len = ioread_full(rgn->io, buf, hi - lo);
+
+    lock_release(&pager_lock);
+
+    return (len == hi - lo) ? 0 : -EIO;
+}
+
+// Returns an unused entry of the region table of /proc/, or NULL if the table
+// is full.
+
+struct vm_region * region_alloc(struct process * proc) {
+    int i;
+
+    for (i = 0; i < PROCESS_VMMAX; i++) {
+        if (proc->vmtab[i].end == 0)
+            return &proc->vmtab[i];
+    }
+
+    return NULL;
+}
+
+// Splits every region of /proc/ that contains /vma/ (other than at its start)
+// into a region ending at /vma/ and one starting there. The second half keeps
+// the file-backed part beyond /vma/ and takes a reference to the file. Returns
+// 0 on success or -ENOMEM if the region table is full.
+
+int region_split(struct process * proc, uintptr_t vma) {
+    struct vm_region * rgn;
+    struct vm_region * tail;
+    int i;
+
+    for (i = 0; i < PROCESS_VMMAX; i++) {
+        rgn = &proc->vmtab[i];
+
+        if (rgn->end == 0 || vma <= rgn->start || rgn->end <= vma)
+            continue;
+        
+        tail = region_alloc(proc);
+
+        if (tail == NULL)
+            return -ENOMEM;
+        
+        *tail = *rgn;
+        tail->start = vma;
+        rgn->end = vma;
+
+        if (tail->shared)
+            tail->offset += vma - rgn->start;
+
+        if (tail->io != NULL)
+            ioref(tail->io);
+    }
+
+    return 0;
+}
+
+// Returns 1 if every page in [start,end) is in some region of /proc/, and 0
+// otherwise.
+
+int region_covered (
+    const struct process * proc, uintptr_t start, uintptr_t end)
+{
+    const struct vm_region * rgn;
+    uintptr_t next;
+    int i;
+
+    while (start < end) {
+        next = start;
+
+        for (i = 0; i < PROCESS_VMMAX; i++) {
+            rgn = &proc->vmtab[i];
+            if (rgn->start <= start && start < rgn->end)
+                next = MAX(next, rgn->end);
+        }
+
+        if (next == start)
+            return 0;
+        
+        start = next;
+    }
+
+    return 1;
+}
+
+// Returns a region of /proc/ that overlaps [start,end), or NULL if there is
+// none.
+
+const struct vm_region * region_overlap (
+    const struct process * proc, uintptr_t start, uintptr_t end)
+{
+    int i;
+
+    for (i = 0; i < PROCESS_VMMAX; i++) {
+        if (proc->vmtab[i].end != 0 &&
+            proc->vmtab[i].start < end && start < proc->vmtab[i].end)
+            return &proc->vmtab[i];
+    }
+
+    return NULL;
+}
+
+// Returns the address of a free range of /size/ bytes (a multiple of the page
+// size) in the user region, i.e., one that overlaps no region of /proc/, or 0
+// if there is none. The range at /hint/ is used if it is free; otherwise the
+// lowest free range is used, aligned to a megapage if /size/ is at least one.
+
+uintptr_t region_find_free (
+    const struct process * proc, uintptr_t hint, size_t size)
+{
+    const size_t align = (size < MEGA_SIZE) ? PAGE_SIZE : MEGA_SIZE;
+    const struct vm_region * rgn;
+    uintptr_t start;
+
+    if (hint != 0 && user_range_ok(hint, size) &&
+        region_overlap(proc, hint, hint + size) == NULL)
+        return hint;
+    
+    start = USER_START_VMA;
+
+    while (user_range_ok(start, size)) {
+        rgn = region_overlap(proc, start, start + size);
+
+        if (rgn == NULL)
+            return start;
+        
+        start = round_up_addr(rgn->end, align);
+    }
+
+    return 0;
+}
+
+// Adds a region of /size/ bytes (rounded up to a page) to the current process
+// at a free range chosen by region_find_free. The region is anonymous if
+// /shmio/ is NULL and maps the shared memory object /shmio/ otherwise. Returns
+// the address of the region or -ENOMEM.
+
+long region_map (
+    uintptr_t hint, size_t size, uint_fast8_t rwxug_flags, struct io_intf * shmio)
+{
+    struct process * const proc = current_process();
+    struct vm_region * rgn;
+    uintptr_t start;
+
+    size = round_up_size(size, PAGE_SIZE);
+    start = region_find_free(proc, round_down_addr(hint, PAGE_SIZE), size);
+
+    if (start == 0)
+        return -ENOMEM;
+    
+    rgn = region_alloc(proc);
+
+    if (rgn == NULL)
+        return -ENOMEM;
+    
+    rgn->start = start;
+    rgn->end = start + size;
+    rgn->io = shmio;
+    rgn->offset = 0;
+    rgn->data_start = start;
+    rgn->data_end = start;
+    rgn->flags = rwxug_flags;
+    rgn->shared = (shmio != NULL);
+
+    if (shmio != NULL)
+        ioref(shmio);
+
+    return start;
+}
+
+// Returns 1 if /rwxug_flags/ are valid flags for a user region: R and U set,
+// and nothing but W and X besides.
+
+static inline int user_flags_ok(uint_fast8_t rwxug_flags) {
+    return ((rwxug_flags & (PTE_R | PTE_U)) == (PTE_R | PTE_U) &&
+        (rwxug_flags & ~(PTE_R | PTE_W | PTE_X | PTE_U)) == 0);
+}
+
+// Returns the leaf PTE mapping /vma/ in /root/, whether a page or a megapage,
+// or NULL if /vma/ is not mapped. Unlike walk_pt, never splits or creates.
+
+struct pte * walk_leaf(struct pte * root, uintptr_t vma) {
+    struct pte * pte = walk_cache_lookup(root, vma);
+
+    if (pte != NULL) {
+        pte += VPN0(vma);
+        return (pte->flags & PTE_V) ? pte : NULL;
+    }
+
+    pte = &root[VPN2(vma)];
+
+    if (!(pte->flags & PTE_V))
+        return NULL;
+    if (pte->flags & (PTE_R | PTE_W | PTE_X))
+        return pte;
+    
+    pte = (struct pte *)pagenum_to_pageptr(pte->ppn) + VPN1(vma);
+
+    if (!(pte->flags & PTE_V))
+        return NULL;
+    if (pte->flags & (PTE_R | PTE_W | PTE_X))
+        return pte;
+    
+    pte = (struct pte *)pagenum_to_pageptr(pte->ppn) + VPN0(vma);
+
+    return (pte->flags & PTE_V) ? pte : NULL;
+}
+
+// Replaces the megapage leaf /pte1/ with a level 0 table that maps the same
+// pages with the same flags. Every page of the block takes the reference and
+// mapping counts of the block, so that the pages can be unmapped and freed one
+// by one, and joins the LRU list. Returns 0 on success or -ENOMEM if no page
+// is left for the table, in which case the megapage stays.
+
+int pt_split(struct pte * pte1) {
+    struct pte * const pt0 = page_alloc_reclaim(0);
+    void * const blk = pagenum_to_pageptr(pte1->ppn);
+    const struct page * const head = memory_page(blk);
+    struct page * pg;
+    int i;
+
+    if (pt0 == NULL)
+        return -ENOMEM;
+
+    stats.pages_ptab += 1;
+
+    for (i = 0; i < PTE_CNT; i++) {
+        pt0[i] = *pte1;
+        pt0[i].ppn = pte1->ppn + i;
+
+        if (i != 0) {
+            pg = memory_page(blk + i * PAGE_SIZE);
+            pg->refcnt = head->refcnt;
+            pg->mapcnt = head->mapcnt;
+            lru_insert(pg);
+        }
+    }
+
+    *pte1 = ptab_pte(pt0, 0);
+    sfence_vma_asid(active_space_asid());
+    return 0;
+}
+
+// Splits the user megapages that straddle /start/ or /end/, so that the pages
+// in [start,end) can be changed without affecting the pages outside it. Panics
+// if memory is exhausted.
+
+void pt_split_range(struct pte * root, uintptr_t start, uintptr_t end) {
+    const uintptr_t edges[2] = { start, end };
+    struct pte * pte1;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (aligned_addr(edges[i], MEGA_SIZE))
+            continue;
+        
+        pte1 = walk_pt_level(root, edges[i], 1, 0);
+
+        if (pte1 != NULL && (pte1->flags & PTE_V) &&
+            (pte1->flags & (PTE_R | PTE_W | PTE_X)) && !(pte1->flags & PTE_G) &&
+            pt_split(pte1) != 0)
+            panic("pt_split_range: out of memory");
+    }
+}
+
+// Promotes the aligned 2 MB range containing /vma/ to a megapage if its level
+// 0 table maps all of its pages with the same flags and none of the pages is
+// shared or copy-on-write. The pages are copied into a new megapage block and
+// freed along with the table. Nothing happens if no block is free.
+
+void pt_try_promote(struct pte * root, uintptr_t vma) {
+    struct pte * const pte1 = walk_pt_level(root, vma, 1, 0);
+    const uint_fast8_t mask = PTE_FLAGS_MASK | PTE_V;
+    struct pte * pt0;
+    void * blk;
+    void * pp;
+    int i;
+
+    if (pte1 == NULL || !(pte1->flags & PTE_V) ||
+        (pte1->flags & (PTE_R | PTE_W | PTE_X | PTE_G)))
+        return;
+    
+    pt0 = pagenum_to_pageptr(pte1->ppn);
+
+    for (i = 0; i < PTE_CNT; i++) {
+        if (!(pt0[i].flags & PTE_V) || (pt0[i].flags & PTE_G) ||
+            (pt0[i].flags & mask) != (pt0[0].flags & mask) ||
+            pt0[i].rsw != 0 ||
+            *page_refcnt_ptr(pagenum_to_pageptr(pt0[i].ppn)) != 1)
+            return;
+    }
+
+    // every page gets overwritten, so the block is not zeroed
+    blk = buddy_alloc(MEGA_ORDER);
+
+    if (blk == NULL)
+        return;
+    
+    *page_refcnt_ptr(blk) = 1;
+
+    for (i = 0; i < PTE_CNT; i++) {
+        pp = pagenum_to_pageptr(pt0[i].ppn);
+        memcpy(blk + i * PAGE_SIZE, pp, PAGE_SIZE);
+        page_unmapped(pp);
+        memory_free_page(pp);
+    }
+
+    *pte1 = leaf_pte(blk, pt0[0].flags & PTE_FLAGS_MASK);
+    page_mapped(blk);
+    sfence_vma_asid(active_space_asid());
+
+    walk_cache_invalidate(root, vma);
+    memory_free_page(pt0);
+    stats.pages_ptab -= 1;
+}
+
+// Returns 1 if [vma,vma+n) lies within the user region, 0 otherwise.
+
+static inline int user_range_ok(uintptr_t vma, size_t n) {
+    return (USER_START_VMA <= vma && vma <= USER_END_VMA &&
+        n <= USER_END_VMA - vma);
+}
+
+static inline uint16_t * page_refcnt_ptr(const void * pp) {
+    return &memory_page(pp)->refcnt;
+}
+
+// Pushes a free block onto the free list of its order and marks its head page.
+
+void buddy_push(union linked_page * blk, unsigned int order) {
+    blk->prev = NULL;
+    blk->next = free_lists[order];
+
+    if (blk->next != NULL)
+        blk->next->prev = blk;
+    
+    free_lists[order] = blk;
+    memory_page(blk)->flags |= PAGE_FREE;
+    memory_page(blk)->order = order;
+    stats.pages_free += 1UL << order;
+}
+
+// Unlinks a free block from the free list of its order.
+
+void buddy_remove(union linked_page * blk, unsigned int order) {
+    if (blk->prev != NULL)
+        blk->prev->next = blk->next;
+    else
+        free_lists[order] = blk->next;
+    
+    if (blk->next != NULL)
+        blk->next->prev = blk->prev;
+    
+    memory_page(blk)->flags &= ~PAGE_FREE;
+    stats.pages_free -= 1UL << order;
+}
+
+// Takes a block of the given order from the buddy free lists, splitting a
+// larger block if needed. Returns NULL if no block is large enough. The block
+// contents and reference count are left to the caller.
+
+void * buddy_alloc(unsigned int order) {
+    union linked_page * blk;
+    unsigned int k;
+
+    if (MEMORY_MAX_ORDER < order)
+        return NULL;
+
+    // Find the smallest non-empty free list that can satisfy the request
+    k = order;
+    while (k <= MEMORY_MAX_ORDER && free_lists[k] == NULL)
+        k += 1;
+
+    if (MEMORY_MAX_ORDER < k)
+        return NULL;
+
+    blk = free_lists[k];
+    buddy_remove(blk, k);
+
+    // Split the block, returning upper halves to the free lists
+    while (order < k) {
+        k -= 1;
+        buddy_push((void *)blk + (PAGE_SIZE << k), k);
+    }
+
+    return blk;
+}
+
+// Returns a block to the buddy free lists, merging it with its buddy for as
+// long as the buddy is a free block of the same order.
+
+void buddy_free(void * pp, unsigned int order) {
+    union linked_page * blk = pp;
+    union linked_page * buddy;
+
+    while (order < MEMORY_MAX_ORDER) {
+        buddy = buddy_of(blk, order);
+
+        if (buddy == NULL || !(memory_page(buddy)->flags & PAGE_FREE) ||
+            memory_page(buddy)->order != order)
+            break;
+        
+        buddy_remove(buddy, order);
+
+        if (buddy < blk)
+            blk = buddy;
+        
+        order += 1;
+    }
+
+    buddy_push(blk, order);
+}
+
+// Gives every page of the pre-zeroed pool back to the buddy allocator. Used
+// when a block cannot be allocated otherwise.
+
+void zeroed_drain(void) {
+    union linked_page * page;
+
+    while (zeroed_list != NULL) {
+        page = zeroed_list;
+        zeroed_list = page->next;
+        memory_page(page)->flags &= ~PAGE_ZEROED;
+        buddy_free(page, 0);
+    }
+
+    zeroed_cnt = 0;
+}
+
+// Takes a page from the pre-zeroed pool. Returns NULL if the pool is empty.
+
+void * zeroed_take(void) {
+    union linked_page * page = zeroed_list;
+
+    if (page == NULL)
+        return NULL;
+
+    zeroed_list = page->next;
+    zeroed_cnt -= 1;
+
+    // the link is the only part of the page that is not zero
+    page->next = NULL;
+    memory_page(page)->flags &= ~PAGE_ZEROED;
+    *page_refcnt_ptr(page) = 1;
+    return page;
+}
+
+// Allocates a page, zeroed if /zero/ is non-zero, swapping out user pages to
+// make room if no page is free. A zeroed page comes from the pre-zeroed pool
+// if possible; any other page from the buddy allocator first, so that the pool
+// is kept for callers that need zeroed pages. Returns NULL if memory is
+// exhausted and no page can be swapped out.
+
+void * page_alloc_reclaim(int zero) {
+    union linked_page * page;
+
+    do {
+        if (!zero && (page = buddy_alloc(0)) != NULL) {
+            *page_refcnt_ptr(page) = 1;
+            return page;
+        }
+
+        if ((page = zeroed_take()) != NULL)
+            return page;
+
+        page = memory_alloc_pages(0);
+
+        if (page != NULL)
+            return page;
+    } while (memory_reclaim(MEMORY_RECLAIM_BATCH) != 0);
+
+    return NULL;
+}
+
+// Returns the buddy of the block of the given order at /blk/, or NULL if the
+// buddy lies outside the memory managed by the allocator.
+
+union linked_page * buddy_of(const void * blk, unsigned int order) {
+    void * const buddy =
+        RAM_START + ((blk - RAM_START) ^ (PAGE_SIZE << order));
+
+    if (buddy < pool_start || RAM_END <= buddy)
+        return NULL;
+    
+    return buddy;
+}
+
+// Accounts for a new user mapping of the page (or block) /pp/. The page joins
+// the tail of the LRU list with its first mapping.
+
+void page_mapped(void * pp) {
+    struct page * const pg = memory_page(pp);
+
+    if (pg->mapcnt++ == 0)
+        lru_insert(pg);
+}
+
+// Accounts for the removal of a user mapping of the page (or block) /pp/. The
+// caller drops the mapping's reference afterwards.
+
+void page_unmapped(void * pp) {
+    struct page * const pg = memory_page(pp);
+
+    if (pg->mapcnt == 0)
+        panic("page_unmapped: page is not mapped");
+    
+    if (--pg->mapcnt != 0)
+        return;
+    
+    lru_remove(pg);
+
+    // a cached executable page leaves the cache with its last mapping
+    if (pg->flags & PAGE_TEXT)
+        text_release(pp);
+}
+
+void lru_insert(struct page * pg) {
+    const uint32_t n = pg - memory_pages;
+
+    pg->lru_prev = lru_tail;
+    pg->lru_next = LRU_NONE;
+
+    if (lru_tail != LRU_NONE)
+        memory_pages[lru_tail].lru_next = n;
+    else
+        lru_head = n;
+    
+    lru_tail = n;
+    pg->flags |= PAGE_LRU;
+}
+
+// Adds /pages/ (which may be negative) to the resident page count of the
+// current process, whose memory space is the active one.
+
+void rss_add(long pages) {
+    struct process * const proc = current_process();
+
+    if (proc != NULL)
+        proc->rss += pages;
+}
+
+void lru_remove(struct page * pg) {
+    if (pg->lru_prev != LRU_NONE)
+        memory_pages[pg->lru_prev].lru_next = pg->lru_next;
+    else
+        lru_head = pg->lru_next;
+    
+    if (pg->lru_next != LRU_NONE)
+        memory_pages[pg->lru_next].lru_prev = pg->lru_prev;
+    else
+        lru_tail = pg->lru_prev;
+    
+    pg->flags &= ~PAGE_LRU;
+}
+
+// Resolves a write to the copy-on-write page at /vma/ mapped by /pte/. If this space
+// holds the last reference, the page is simply made writable again. Otherwise
+// the page is copied and the PTE is pointed at the private copy. Returns 0 on
+// success or -ENOMEM if memory and swap are exhausted; the page then stays
+// copy-on-write.
+
+static int cow_break(struct pte * pte, uintptr_t vma) {
+    void * const old_pp = pagenum_to_pageptr(pte->ppn);
+    void * new_pp;
+
+    if (1 < *page_refcnt_ptr(old_pp)) {
+        new_pp = page_alloc_reclaim(0);
+
+        if (new_pp == NULL)
+            return -ENOMEM;
+
+        memcpy(new_pp, old_pp, PAGE_SIZE);
+        page_unmapped(old_pp);
+        memory_free_page(old_pp); // drops our reference only
+        pte->ppn = pageptr_to_pagenum(new_pp);
+        page_mapped(new_pp);
+        stats.cow_copies += 1;
+    }
+
+    pte->rsw &= ~PTE_RSW_COW;
+    pte->flags |= PTE_W;
+    sfence_vma_addr(vma);
+    return 0;
+}
+
+// Returns 1 if the leaf PTE /pte/ of block order /order/ maps a page that may
+// be swapped out: a private 4 kB user page. Pages shared copy-on-write or with
+// a shared memory object, megapages and global pages stay in memory.
+
+static inline int pte_swappable(const struct pte * pte, unsigned int order) {
+    const void * const pp = pagenum_to_pageptr(pte->ppn);
+
+    return order == 0 && (pte->flags & PTE_U) && !(pte->flags & PTE_G) &&
+        pte->rsw == 0 && *page_refcnt_ptr(pp) == 1 &&
+        memory_page(pp)->mapcnt == 1;
+}
+
+// Moves the clock hand through the user pages of /proc/, starting at
+// clock_vma, and swaps out the first page found with a clear accessed bit. The
+// accessed bits of the pages passed over are cleared, so that they are swapped
+// out when the hand comes back unless they are used in the meantime. The page
+// is compressed into the compressed pool if it compresses well, and written to
+// the swap device otherwise. It is unmapped before it is written, and the
+// write sleeps: the caller holds the swap lock. Returns 1 if a page was
+// swapped out, 0 if the hand reached the end of the space, -ENOMEM if swap is
+// full, or -EIO if the page could not be written (it is then mapped again).
+
+int swap_out_next(struct process * proc) {
+    struct pte * const root = mtag_to_root(proc->mtag);
+    const int pid = proc->id;
+    struct pt_iter it;
+    struct pte * pte;
+    struct pte old;
+    uintptr_t vma;
+    int cleared = 0;
+    void * page;
+    long stored;
+    long entry;
+
+    pt_iter_init(&it, root, clock_vma, USER_END_VMA);
+
+    while ((pte = pt_iter_next(&it, &vma)) != NULL) {
+        if (!pte_swappable(pte, it.order))
+            continue;
+        
+        if (pte->flags & PTE_A) {
+            pte->flags &= ~PTE_A;
+            cleared = 1;
+            continue;
+        }
+
+        page = pagenum_to_pageptr(pte->ppn);
+        old = *pte;
+        page_unmapped(page);
+
+        // A page that compresses well goes to the compressed pool, which
+        // consumes it and takes no I/O. Any other page goes to the device.
+        stored = swap_store(page);
+        entry = (stored < 0) ? swap_alloc() : stored;
+
+        if (entry < 0) {
+            page_mapped(page);
+
+            // other pages may still compress
+            if (stored == -EINVAL)
+                continue;
+
+            break;
+        }
+
+        *pte = swap_pte(entry, old.flags);
+        sfence_vma_addr(vma);
+        proc->rss -= 1;
+        clock_vma = vma + PAGE_SIZE;
+
+        if (0 <= stored) {
+            stats.swap_stores += 1;
+            return 1;
+        }
+
+        if (swap_write(entry, page) == 0) {
+            memory_free_page(page);
+            stats.swap_outs += 1;
+            return 1;
+        }
+
+        // The process may have exited during the write, freeing the entry.
+        // Otherwise the page goes back where it was.
+
+        pte = NULL;
+        if (proctab[pid] == proc && mtag_to_root(proc->mtag) == root)
+            pte = walk_pt(root, vma, 0);
+        
+        if (pte != NULL && pte_swapped(pte) && pte->ppn == entry) {
+            *pte = old;
+            page_mapped(page);
+            proc->rss += 1;
+            swap_free(entry);
+        } else
+            memory_free_page(page);
+        
+        return -EIO;
+    }
+
+    // pages passed over may still have their accessed bit set in the TLB
+    if (cleared)
+        sfence_vma_asid(mtag_to_asid(proc->mtag));
+
+    return (pte == NULL) ? 0 : -ENOMEM;
+}
+
+// Reads the swapped-out page at /vma/ of the current process back from swap
+// and maps it with the flags kept in its swap entry. Returns 0 on success (or
+// if the page is no longer swapped out), -ENOMEM if no page could be
+// allocated, or -EIO if the page could not be read.
+
+int swap_in(uintptr_t vma) {
+    unsigned long entry;
+    struct pte * pte;
+    void * page;
+    int result = 0;
+
+    // allocate before taking the swap lock, which reclaiming takes too
+    page = page_alloc_reclaim(0);
+
+    if (page == NULL)
+        return -ENOMEM;
+    
+    lock_acquire(&swap_lock);
+
+    pte = walk_pt(active_space_root(), vma, 0);
+
+    if (pte != NULL && pte_swapped(pte)) {
+        entry = pte->ppn;
+        result = swap_read(entry, page);
+
+        if (result == 0) {
+            swap_free(entry);
+            *pte = leaf_pte(page, pte->flags & PTE_FLAGS_MASK);
+            page_mapped(page);
+            rss_add(1);
+            sfence_vma_addr(vma);
+            stats.swap_ins += 1;
+            page = NULL;
+        }
+    }
+
+    lock_release(&swap_lock);
+
+    if (page != NULL)
+        memory_free_page(page);
+
+    return result;
+}
+
+// Returns /mtag/ with a valid ASID of the current generation for its space,
+// assigning a new ASID if the space has none. The TLB entries left over from
+// the previous owner of a newly assigned ASID are flushed; running out of
+// ASIDs starts a new generation and flushes the whole TLB.
+
+uintptr_t asid_assign(uintptr_t mtag) {
+    const struct pte * const root = mtag_to_root(mtag);
+    uint_fast16_t asid = mtag_to_asid(mtag);
+
+    if (root == main_pt2)
+        return main_mtag;
+    
+    if (asid_cnt <= 1)
+        return mtag_with_asid(mtag, 0);
+    
+    if (asid != 0 && asid < asid_cnt && asid_root[asid] == root)
+        return mtag;
+    
+    if (asid_next == asid_cnt) {
+        asid_generation += 1;
+        memset(asid_root, 0, sizeof(asid_root));
+        asid_next = 1;
+        sfence_vma();
+
+        debug("ASID generation %lu", asid_generation);
+    }
+
+    asid = asid_next++;
+    asid_root[asid] = root;
+    sfence_vma_asid(asid);
+
+    return mtag_with_asid(mtag, asid);
+}
+
+// Gives up the ASID of the space /mtag/, if it still owns one, before the
+// space is destroyed (its root page table may be reused by another space).
+
+void asid_release(uintptr_t mtag) {
+    const uint_fast16_t asid = mtag_to_asid(mtag);
+
+    if (asid != 0 && asid < asid_cnt && asid_root[asid] == mtag_to_root(mtag))
+        asid_root[asid] = NULL;
+}
+
+// Returns the cached level 0 table that maps the 2 MB range containing /vma/
+// in the space /root/, or NULL on a miss.
+
+struct pte * walk_cache_lookup(const struct pte * root, uintptr_t vma) {
+    const uintptr_t mega = vma >> (9+12);
+    const struct walk_cache_entry * const ent =
+        &walk_cache[mega & (MEMORY_WALK_CACHE_SIZE - 1)];
+    
+    if (ent->root == root && ent->mega == mega) {
+        walk_cache_hits += 1;
+        return ent->pt0;
+    }
+
+    walk_cache_misses += 1;
+    return NULL;
+}
+
+void walk_cache_insert(const struct pte * root, uintptr_t vma, struct pte * pt0) {
+    const uintptr_t mega = vma >> (9+12);
+    struct walk_cache_entry * const ent =
+        &walk_cache[mega & (MEMORY_WALK_CACHE_SIZE - 1)];
+    
+    ent->root = root;
+    ent->mega = mega;
+    ent->pt0 = pt0;
+}
+
+// Drops the entry for the 2 MB range containing /vma/ in the space /root/.
+
+void walk_cache_invalidate(const struct pte * root, uintptr_t vma) {
+    const uintptr_t mega = vma >> (9+12);
+    struct walk_cache_entry * const ent =
+        &walk_cache[mega & (MEMORY_WALK_CACHE_SIZE - 1)];
+    
+    if (ent->root == root && ent->mega == mega)
+        ent->root = NULL;
+}
+
+// Drops every entry of the space /root/.
+
+void walk_cache_flush(const struct pte * root) {
+    int i;
+
+    for (i = 0; i < MEMORY_WALK_CACHE_SIZE; i++) {
+        if (walk_cache[i].root == root)
+            walk_cache[i].root = NULL;
+    }
+}
@@ -4,6 +4,7 @@
 #ifndef _MEMORY_H_
 #define _MEMORY_H_
 
+#include "config.h"
 #include "csr.h"
 
 #include <stddef.h> // size_t
@@ -27,10 +28,11 @@
 // COMPILE-TIME CONFIGURATION
 //
 
-// Minimum amount of memory in the initial heap block.
+// Minimum amount of memory in the initial heap block. The heap allocator gets
+// its memory from the page allocator, so none is needed.
 
 #ifndef HEAP_INIT_MIN
-#define HEAP_INIT_MIN 256
+#define HEAP_INIT_MIN 0
 #endif
 
 // CONSTANT DEFINITIONS
@@ -51,19 +53,106 @@ struct pte {
 
 #define PTE_CNT (PAGE_SIZE/8) // number of PTEs per page table
 
+#define MEMORY_MAX_ORDER 9 // largest physical block: 2^9 pages (one megapage)
+
 // EXPORTED TYPE DEFINITIONS
 //
 
+struct io_intf; // forward decl.
+
+// A virtual memory region of a user process. Pages of a region are populated
+// lazily, on the first fault (or kernel access) to them. The bytes of the
+// region in [data_start,data_end) are read from the backing file /io/,
+// starting at file offset /offset/; everything else in the region is
+// zero-filled. A region with a NULL /io/ is anonymous memory. A shared region
+// maps the pages of the shared memory object /io/ (see shm.h) instead,
+// starting at byte /offset/ of the object; its pages are shared with every
+// other mapping of the object, including across fork. A region with end == 0
+// is unused.
+
+struct vm_region {
+    uintptr_t start; // first address of the region (page aligned)
+    uintptr_t end; // end of the region (page aligned)
+    struct io_intf * io; // backing file, shared memory object, or NULL
+    uint64_t offset; // file offset of data_start (object offset of start if shared)
+    uintptr_t data_start; // file-backed part of the region
+    uintptr_t data_end;
+    uint_fast8_t flags; // rwxug flags of the region's pages
+    uint_fast8_t shared; // io is a shared memory object
+};
+
+// Descriptor of a physical page in RAM. memory_init allocates one for every
+// page, in the array memory_pages. /refcnt/ counts the references to an
+// allocated page (the allocation itself and each additional user mapping
+// created by memory_space_clone); /mapcnt/ counts the user mappings alone.
+// For a block of pages, such as a megapage, the first page's descriptor
+// describes the whole block. Pages with at least one user mapping are kept on
+// an LRU list, linked by page number (see memory_lru_oldest).
+
+struct page {
+    uint16_t refcnt; // references (allocation + shared mappings)
+    uint16_t mapcnt; // user mappings
+    uint8_t flags; // PAGE_* flags
+    uint8_t order; // block order, if PAGE_FREE or PAGE_KMALLOC is set
+    uint16_t text; // text cache entry, if PAGE_TEXT is set (see text.c)
+    union {
+        struct {
+            uint32_t lru_prev; // LRU links (page numbers)
+            uint32_t lru_next;
+        };
+        void * slab; // slab header, if PAGE_SLAB is set (see slab.c)
+    };
+};
+
+// Memory statistics, see memory_get_stats. Page counts are in 4 kB pages; the
+// counters count events since boot.
+
+struct memory_stats {
+    unsigned long pages_total; // pages managed by the page allocator
+    unsigned long pages_free; // free pages, including the pre-zeroed pool
+    unsigned long pages_zeroed; // pages in the pre-zeroed pool
+    unsigned long pages_ptab; // page tables of user spaces (incl. root tables)
+    unsigned long faults_cow; // store faults that copied a shared page
+    unsigned long faults_file; // faults that read a page from a file
+    unsigned long faults_zero; // faults that mapped a zero-filled page
+    unsigned long faults_shared; // faults that mapped a shared memory page
+    unsigned long faults_text; // faults that mapped a cached executable page
+    unsigned long faults_denied; // faults rejected as access violations
+    unsigned long faults_failed; // faults on pages that could not be read
+    unsigned long faultaround_pages; // neighbours mapped (or read from a file) along with a fault
+    unsigned long clone_pages; // pages shared copy-on-write by fork
+    unsigned long cow_copies; // pages copied on a store to a shared page
+    unsigned long swap_total; // slots of the swap device (see swap.h)
+    unsigned long swap_used; // slots holding a swapped-out page
+    unsigned long swap_outs; // pages written to the swap device
+    unsigned long swap_stores; // pages compressed into the compressed pool
+    unsigned long swap_ins; // pages read back from either
+    unsigned long swap_pool_stored; // pages held in the compressed pool
+    unsigned long swap_pool_pages; // pages taken up by the compressed pool
+    unsigned long text_pages; // executable pages in the text cache (see text.h)
+};
+
+#define PAGE_FREE (1 << 0) // head of a free block
+#define PAGE_RESERVED (1 << 1) // kernel image, heap or page frame array
+#define PAGE_ZEROED (1 << 2) // in the pre-zeroed page pool
+#define PAGE_LRU (1 << 3) // on the LRU list
+#define PAGE_SLAB (1 << 4) // part of a slab of the heap allocator
+#define PAGE_KMALLOC (1 << 5) // head of a block allocated by kmalloc
+#define PAGE_TEXT (1 << 6) // in the text cache
+
 // EXPORTED VARIABLE DECLARATIONS
 //
 
 extern uintptr_t main_mtag;
+extern struct page * memory_pages;
 
 // EXPORTED FUNCTION DECLARATIONS
 //
 
 // should clone memory space  for current process and return the mtag of the new memory space. 
 // Should be used in thread fork to user to setup the memory space for the child process.
+// User pages are shared copy-on-write between the parent and the child, and
+// swapped-out pages share their swap slot.
 
 extern uintptr_t memory_space_clone(uint_fast16_t asid);
 
@@ -88,7 +177,8 @@ extern uintptr_t memory_space_create(uint_fast16_t asid);
 // void memory_space_reclaim(uintptr_t mtag)
 // Switches the active memory space to the main memory space and reclaims the
 // memory space that was active on entry. All physical pages mapped by a user
-// mapping are reclaimed.
+// mapping are reclaimed, along with the page tables of the user region and the
+// root page table (unless the space was the main memory space).
 
 extern void memory_space_reclaim(void);
 
@@ -99,22 +189,98 @@ extern uintptr_t active_memory_space(void);
 
 // uintptr_t memory_space_switch(uintptr_t mtag)
 // Switches to another memory space and returns the memory space tag of the
-// previously active memory space.
+// previously active memory space. Each memory space other than the main one
+// is tagged with an ASID, assigned here if the space has none (or lost it to
+// a generation rollover), so switching does not flush the TLB. The tag of the
+// now active space, which carries its ASID, is returned by
+// active_memory_space(); callers keep it in place of the old tag. Switching to
+// the already active space does nothing.
 
 extern uintptr_t memory_space_switch(uintptr_t mtag);
 
 // void * memory_alloc_page(void)
-// Allocates a physical page of memory. Returns a pointer to the direct-mapped
-// address of the page. Does not fail; panics if there are no free pages available.
+// Allocates a zeroed physical page of memory. Returns a pointer to the
+// direct-mapped address of the page. Does not fail; panics if there are no free
+// pages available.
 
 extern void * memory_alloc_page(void);
 
+// void * memory_try_alloc_page(void)
+// Like memory_alloc_page, but returns NULL instead of panicking if there are no
+// free pages and no page can be swapped out. Meant for paths that can report
+// running out of memory, such as page faults.
+
+extern void * memory_try_alloc_page(void);
+
+// void * memory_alloc_page_nozero(void)
+// Like memory_alloc_page, but the contents of the page are undefined. Meant for
+// callers that overwrite the whole page, such as copy-on-write copies.
+
+extern void * memory_alloc_page_nozero(void);
+
+// int memory_prezero_page(void)
+// Zeroes a free page ahead of time and adds it to the pool that
+// memory_alloc_page takes pages from. Returns 1 if a page was zeroed and 0 if
+// the pool is full or there are no free pages. Called by the idle thread.
+
+extern int memory_prezero_page(void);
+
+// void * memory_alloc_pages(unsigned int order)
+// Allocates a block of 2^order physically contiguous pages, aligned to the
+// block size, with /order/ between 0 and MEMORY_MAX_ORDER. Returns a pointer
+// to the direct-mapped address of the first page, or NULL if no block of that
+// size is available.
+
+extern void * memory_alloc_pages(unsigned int order);
+
+// void * memory_alloc_pages_nozero(unsigned int order)
+// Like memory_alloc_pages, but the contents of the block are undefined and the
+// pre-zeroed pool is not drained to make room. Meant for I/O buffers.
+
+extern void * memory_alloc_pages_nozero(unsigned int order);
+
+// void memory_free_pages(void * pp, unsigned int order)
+// Drops a reference to a block allocated by memory_alloc_pages with the same
+// /order/. The block is returned to the allocator, and merged with its free
+// neighbours, when its last reference is dropped.
+
+extern void memory_free_pages(void * pp, unsigned int order);
+
 // void memory_free_page(void * ptr)
-// Returns a physical memory page to the physical page allocator. The page must
-// have been previously allocated by memory_alloc_page.
+// Drops a reference to a physical memory page. The page must have been
+// previously allocated by memory_alloc_page. The page is returned to the
+// physical page allocator when its last reference (see memory_space_clone) is
+// dropped.
 
 extern void memory_free_page(void * pp);
 
+// void memory_page_ref(void * pp)
+// Adds a reference to an allocated page (or the first page of a block), to be
+// dropped with memory_free_page (or memory_free_pages). Panics if the
+// reference count overflows.
+
+extern void memory_page_ref(void * pp);
+
+// struct page * memory_lru_oldest(void)
+// struct page * memory_lru_next(const struct page * pg)
+// void memory_lru_touch(struct page * pg)
+// Walk the LRU list of user-mapped pages from the least recently mapped page
+// to the most recent one. memory_lru_oldest returns NULL if no page is mapped
+// and memory_lru_next returns NULL at the end of the list. memory_lru_touch
+// moves a page on the list to the most recent end.
+
+extern struct page * memory_lru_oldest(void);
+extern struct page * memory_lru_next(const struct page * pg);
+extern void memory_lru_touch(struct page * pg);
+
+// unsigned long memory_reclaim(unsigned long cnt)
+// Tries to free /cnt/ pages by swapping out private user pages that were not
+// accessed recently, to the compressed pool or the swap device. Returns the
+// number of pages freed, which is 0 if swap is full. memory_alloc_page calls
+// it when no page is free; memory_alloc_pages does not.
+
+extern unsigned long memory_reclaim(unsigned long cnt);
+
 // void * memory_alloc_and_map_page (
 //        uintptr_t vma, uint_fast8_t rwxug_flags)
 // Allocates and maps a physical page.
@@ -133,7 +299,8 @@ extern void * memory_alloc_and_map_page (
 //        uintptr_t vma, size_t size, uint_fast8_t rwxug_flags)
 
 // Allocates and maps multiple physical pages in an address range. Equivalent to
-// calling memory_alloc_and_map_page for every page in the range.
+// calling memory_alloc_and_map_page for every page in the range, except that
+// 2 MB aligned parts of the range are mapped with megapages when possible.
 
 extern void * memory_alloc_and_map_range (
     uintptr_t vma, size_t size, uint_fast8_t rwxug_flags);
@@ -141,47 +308,121 @@ extern void * memory_alloc_and_map_range (
 // void memory_unmap_and_free_range(void * vp, size_t size)
 
 // void memory_unmap_and_free_user(void)
-// Unmaps and frees all pages with the U bit set in the PTE flags.
+// Unmaps and frees all pages with the U bit set in the PTE flags, and the swap
+// slots of swapped-out pages. The page tables themselves are kept, so that a
+// following exec reuses them.
 
 extern void memory_unmap_and_free_user(void);
 
 // extern void memory_set_page_flags(const void * vp, uint8_t rwxug_flags);
-// Sets the flags of the PTE associated with vp. Only works with 4 kB pages.
+// Sets the flags of the PTE associated with vp. If vp is part of a megapage,
+// the megapage is split into 4 kB pages first.
 
 extern void memory_set_page_flags(
     const void * vp, uint8_t rwxug_flags);
 
 // void memory_set_range_flags (
 //      const void * vp, size_t size, uint_fast8_t rwxug_flags)
-// Chnages the PTE flags for all pages in a mapped range.
+// Chnages the PTE flags for all pages in a mapped range. Megapages that lie
+// only partly in the range are split.
 
 extern void memory_set_range_flags (
     const void * vp, size_t size, uint_fast8_t rwxug_flags);
 
-// int memory_validate_vptr_len (
-//     const void * vp, size_t len, uint_fast8_t rwxug_flags);
-// Checks if a virtual address range is mapped with specified flags. Returns 1
-// if and only if every virtual page containing the specified virtual address
-// range is mapped with the at least the specified flags.
-
-extern int memory_validate_vptr_len (
-    const void * vp, size_t len, uint_fast8_t rwxug_flags);
-
-// int memory_validate_vstr (
-//     const char * vs, uint_fast8_t ug_flags)
-// Checks if the virtual pointer points to a mapped range containing a
-// null-terminated string. Returns 1 if and only if the virtual pointer points
-// to a mapped readable page with the specified flags, and every byte starting
-// at /vs/ up until the terminating null byte is also mapped with the same
-// permissions.
-
-extern int memory_validate_vstr (
-    const char * vs, uint_fast8_t ug_flags);
-
-// Called from excp.c to handle a page fault at the specified address. Either
-// maps a page containing the faulting address, or calls process_exit().
-
-extern void memory_handle_page_fault(const void * vptr);
+// int copy_from_user(void * dst, const void * usrc, size_t n)
+// int copy_to_user(void * udst, const void * src, size_t n)
+// Copy /n/ bytes between a kernel buffer and user memory of the current
+// process. User pages are only accessible to the kernel inside these
+// functions. Faults are handled as if the process had made the access
+// (populating pages and breaking copy-on-write); if a fault cannot be resolved,
+// the copy stops. Return 0 on success or -EINVAL if the user range is outside
+// the user region or not readable (copy_from_user) or writable (copy_to_user).
+
+extern int copy_from_user(void * dst, const void * usrc, size_t n);
+extern int copy_to_user(void * udst, const void * src, size_t n);
+
+// long strncpy_from_user(char * dst, const char * usrc, size_t n)
+// Copies a null-terminated string from user memory into /dst/, at most /n/
+// bytes including the null byte. Returns the length of the string, /n/ if the
+// string does not fit (dst is then not null-terminated), or -EINVAL if the
+// string is not in readable user memory.
+
+extern long strncpy_from_user(char * dst, const char * usrc, size_t n);
+
+// void memory_walk_cache_stats(unsigned long * hits, unsigned long * misses)
+// Reports the number of level 0 page table walks served by the page walk cache
+// and the number that had to start at the root table. Either pointer may be
+// NULL.
+
+extern void memory_walk_cache_stats(unsigned long * hits, unsigned long * misses);
+
+// void memory_get_stats(struct memory_stats * st)
+// Stores a snapshot of the memory statistics in *st. The resident page count of
+// each process is kept in its struct process (rss).
+
+extern void memory_get_stats(struct memory_stats * st);
+
+// int memory_add_region(const struct vm_region * rgn)
+// Adds a region to the current process. The region's file, if any, gains a
+// reference (see ioref) that is dropped by memory_clear_regions. The file must
+// not be used for anything else, since reading a page moves its position.
+// Returns 0 on success or -1 if the process's region table is full.
+
+extern int memory_add_region(const struct vm_region * rgn);
+
+// void memory_clear_regions(void)
+// Removes all regions of the current process and drops their file references.
+// Pages already mapped are not affected.
+
+extern void memory_clear_regions(void);
+
+// long memory_mmap(uintptr_t hint, size_t size, uint_fast8_t rwxug_flags)
+// Adds an anonymous region of /size/ bytes (rounded up to a page) with the
+// given flags to the current process, at /hint/ if that range is free and
+// otherwise at the lowest free range of the user region. The flags must
+// include R and U. Pages are zero-filled on first access. Returns the address
+// of the region or a negative error code.
+
+extern long memory_mmap(uintptr_t hint, size_t size, uint_fast8_t rwxug_flags);
+
+// long memory_mmap_shared (
+//      struct io_intf * shmio, uintptr_t hint, uint_fast8_t rwxug_flags)
+// Like memory_mmap, but maps the whole shared memory object /shmio/ (see
+// shm.h). The region takes a reference to the object. Stores to the pages are
+// seen by every process that maps the object; they are never copy-on-write.
+
+extern long memory_mmap_shared (
+    struct io_intf * shmio, uintptr_t hint, uint_fast8_t rwxug_flags);
+
+// int memory_munmap(const void * vp, size_t size)
+// Removes the page-aligned range [vp,vp+size) from the regions of the current
+// process, splitting regions as needed, and unmaps and frees its pages.
+// Returns 0 or a negative error code.
+
+extern int memory_munmap(const void * vp, size_t size);
+
+// int memory_mprotect(const void * vp, size_t size, uint_fast8_t rwxug_flags)
+// Changes the flags of the page-aligned range [vp,vp+size), which must be
+// covered by regions of the current process, and of its mapped pages.
+// Copy-on-write sharing is preserved. Returns 0 or a negative error code.
+
+extern int memory_mprotect(const void * vp, size_t size, uint_fast8_t rwxug_flags);
+
+// Called from excp.c to handle a page fault at the specified address. The
+// /cause/ argument is the scause exception code of the fault. Either maps a
+// page containing the faulting address (reading it back from swap if it was
+// swapped out) or gives the process a private copy of a copy-on-write page on
+// a store fault, and returns 0, or returns a negative error code if the access
+// is not allowed or the page could not be loaded (the caller then terminates
+// the process or fails the user copy). Only pages
+// inside one of the process's regions are mapped: such a page is populated
+// from the region (read from its file or zero-filled) and mapped with the
+// region's flags; if the region covers the whole aligned 2 MB range, the range
+// is mapped as a megapage. A fault on an anonymous region also maps some of
+// the neighbouring pages, more of them while the faults are sequential. A
+// fully populated 2 MB range of 4 kB pages is promoted to a megapage.
+
+extern int memory_handle_page_fault(const void * vptr, unsigned int cause);
 
 // helper functions needed for testing
 
@@ -190,4 +431,19 @@ struct pte * walk_pt(struct pte* root, uintptr_t vma, int create);
 // INLINE FUNCTION DEFINITIONS
 //
 
+// struct page * memory_page(const void * pp)
+// Returns the descriptor of the physical page containing /pp/, which must be
+// a direct-mapped RAM address.
+
+static inline struct page * memory_page(const void * pp) {
+    return &memory_pages[((uintptr_t)pp - RAM_START_PMA) >> PAGE_ORDER];
+}
+
+// void * memory_page_ptr(const struct page * pg)
+// Returns the direct-mapped address of the page described by /pg/.
+
+static inline void * memory_page_ptr(const struct page * pg) {
+    return (void*)(RAM_START_PMA + ((uintptr_t)(pg - memory_pages) << PAGE_ORDER));
+}
+
 #endif // _MEMORY_H_
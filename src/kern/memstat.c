@@ -0,0 +1,173 @@
+// memstat.c - Memory statistics device
+//
+
+#include "memstat.h"
+#include "memory.h"
+#include "process.h"
+#include "device.h"
+#include "heap.h"
+#include "halt.h"
+#include "error.h"
+#include "string.h"
+
+#include <stdint.h>
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct memstat_file {
+    struct io_intf io_intf;
+    char * text; // snapshot, one page
+    size_t len;
+    size_t pos;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int memstat_open(struct io_intf ** ioptr, void * aux);
+static void memstat_close(struct io_intf * io);
+static long memstat_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static int memstat_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static size_t memstat_format(char * buf, size_t bufsz);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void memstat_attach(void) {
+    device_register("memstat", &memstat_open, NULL);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int memstat_open(struct io_intf ** ioptr, void * aux) {
+    static const struct io_ops memstat_ops = {
+        .close = memstat_close,
+        .read = memstat_read,
+        .ctl = memstat_ioctl
+    };
+
+    struct memstat_file * file;
+
+    assert (ioptr != NULL);
+
+    file = kcalloc(1, sizeof(struct memstat_file));
+    file->io_intf.ops = &memstat_ops;
+    file->io_intf.refcnt = 1;
+    file->text = memory_alloc_page_nozero();
+    file->len = memstat_format(file->text, PAGE_SIZE);
+
+    *ioptr = &file->io_intf;
+    return 0;
+}
+
+void memstat_close(struct io_intf * io) {
+    struct memstat_file * const file =
+        (void*)io - offsetof(struct memstat_file, io_intf);
+
+    memory_free_page(file->text);
+    kfree(file);
+}
+
+long memstat_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct memstat_file * const file =
+        (void*)io - offsetof(struct memstat_file, io_intf);
+    size_t n;
+
+    if (file->len <= file->pos)
+        return 0;
+    
+    n = file->len - file->pos;
+    if (bufsz < n)
+        n = bufsz;
+    
+    memcpy(buf, file->text + file->pos, n);
+    file->pos += n;
+    return n;
+}
+
+int memstat_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct memstat_file * const file =
+        (void*)io - offsetof(struct memstat_file, io_intf);
+
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t *)arg = file->len;
+        return 0;
+    case IOCTL_GETPOS:
+        *(uint64_t *)arg = file->pos;
+        return 0;
+    case IOCTL_SETPOS:
+        if (file->len < *(uint64_t *)arg)
+            return -EINVAL;
+        file->pos = *(uint64_t *)arg;
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+// Writes the statistics into /buf/ as text and returns the length of the text
+// (without the null byte). Output that does not fit is dropped.
+
+size_t memstat_format(char * buf, size_t bufsz) {
+    struct memory_stats st;
+    struct heap_stats hst;
+    unsigned long hits, misses;
+    size_t len;
+    int i;
+
+    memory_get_stats(&st);
+    memory_walk_cache_stats(&hits, &misses);
+
+    len = snprintf(buf, bufsz,
+        "pages_total %lu\n"
+        "pages_free %lu\n"
+        "pages_alloc %lu\n"
+        "pages_zeroed %lu\n"
+        "pages_ptab %lu\n"
+        "faults_cow %lu\n"
+        "faults_file %lu\n"
+        "faults_zero %lu\n"
+        "faults_shared %lu\n"
+        "faults_text %lu\n"
+        "faults_denied %lu\n"
+        "faults_failed %lu\n"
+        "faultaround_pages %lu\n"
+        "clone_pages %lu\n"
+        "cow_copies %lu\n"
+        "walk_cache_hits %lu\n"
+        "walk_cache_misses %lu\n"
+        "swap_total %lu\n"
+        "swap_used %lu\n"
+        "swap_outs %lu\n"
+        "swap_stores %lu\n"
+        "swap_ins %lu\n"
+        "swap_pool_stored %lu\n"
+        "swap_pool_pages %lu\n"
+        "text_pages %lu\n",
+        st.pages_total, st.pages_free, st.pages_total - st.pages_free,
+        st.pages_zeroed, st.pages_ptab,
+        st.faults_cow, st.faults_file, st.faults_zero, st.faults_shared,
+        st.faults_text, st.faults_denied, st.faults_failed, st.faultaround_pages,
+        st.clone_pages, st.cow_copies, hits, misses,
+        st.swap_total, st.swap_used, st.swap_outs, st.swap_stores,
+        st.swap_ins, st.swap_pool_stored, st.swap_pool_pages, st.text_pages);
+
+    for (i = 0; i < NPROC && len < bufsz; i++) {
+        if (proctab[i] != NULL)
+            len += snprintf(buf + len, bufsz - len,
+                "pid %d rss %lu\n", proctab[i]->id, proctab[i]->rss);
+    }
+
+    for (i = 0; len < bufsz && heap_get_stats(i, &hst) == 0; i++) {
+        len += snprintf(buf + len, bufsz - len,
+            "cache %s size %lu inuse %lu allocs %lu frees %lu pages %lu\n",
+            hst.name, (unsigned long)hst.objsize, hst.inuse,
+            hst.allocs, hst.frees, hst.pages);
+    }
+
+    return (len < bufsz) ? len : bufsz - 1;
+}
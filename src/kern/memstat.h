@@ -0,0 +1,16 @@
+// memstat.h - Memory statistics device
+//
+
+#ifndef _MEMSTAT_H_
+#define _MEMSTAT_H_
+
+// void memstat_attach(void)
+// Registers the "memstat" device. Opening it takes a snapshot of the memory
+// statistics (see memory_get_stats) and of the resident page count of every
+// process, which reads back as text: one "name value" pair per line, followed
+// by one "pid <id> rss <pages>" line per process. The snapshot supports
+// IOCTL_GETLEN, IOCTL_GETPOS and IOCTL_SETPOS.
+
+extern void memstat_attach(void);
+
+#endif // _MEMSTAT_H_
@@ -2,6 +2,7 @@
 //
 
 #include "process.h"
+#include "heap.h"
 
 #ifdef PROCESS_TRACE
 #define TRACE
@@ -12,15 +13,6 @@
 #endif
 
 
-// COMPILE-TIME PARAMETERS
-//
-
-// NPROC is the maximum number of processes
-
-#ifndef NPROC
-#define NPROC 16
-#endif
-
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -39,6 +31,10 @@ struct process * proctab[NPROC] = {
     [MAIN_PID] = &main_proc
 };
 
+// Object cache for the struct process of forked processes
+
+static struct kmem_cache * process_cache;
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -55,6 +51,8 @@ char procmgr_initialized = 0;
  */
 
 void procmgr_init(void) {
+    process_cache = kmem_cache_create("process", sizeof(struct process));
+
     // initialize the main user process struct
     // init proc id
     main_proc.id = MAIN_PID;
@@ -76,6 +74,47 @@ void procmgr_init(void) {
 
 
 
+/**
+ * allocates a process struct and enters it in the process table
+ * 
+ * @return          returns the zeroed process struct, with its id set to its index in
+ *                  proctab, or NULL if the process table is full
+ */
+
+struct process * process_alloc(void) {
+    struct process * proc;
+
+    for (int i = 0; i < NPROC; i++) {
+        if (proctab[i] == NULL) {
+            proc = kmem_cache_alloc(process_cache);
+            memset(proc, 0, sizeof(struct process));
+            proc->id = i;
+            proctab[i] = proc;
+            return proc;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/**
+ * removes a process struct from the process table and frees it
+ * 
+ * @param proc      process allocated by process_alloc. The main process is left alone
+ */
+
+void process_free(struct process * proc) {
+    if (proc == &main_proc)
+        return;
+    
+    proctab[proc->id] = NULL;
+    kmem_cache_free(process_cache, proc);
+}
+
+
+
 /**
  * executes a program referred to by the I/O interface passed in as an argument
  * 
@@ -96,16 +135,38 @@ int process_exec(struct io_intf * exeio) {
     int result;
     void (*entry_point)(void);
     struct thread_stack_anchor* stack_anchor;
+    struct vm_region stack_rgn;
     uintptr_t usp;
 
-    // (a) unmap any virtual memory mappings begongin to other user processes
+    // (a) unmap any virtual memory mappings begongin to other user processes.
+    // the page tables stay in place and are reused by elf_load below
     memory_unmap_and_free_user();
 
     // (b) no need to implement for cp2
     // memory_space_clone(0);
 
-    // (c) load the executable from io interface into memory
+    // the regions of the old image go with it. The stack region is added
+    // first, so that it always gets a slot in the region table
+    memory_clear_regions();
+
+    stack_rgn.start = USER_STACK_VMA - USER_STACK_SIZE;
+    stack_rgn.end = USER_STACK_VMA;
+    stack_rgn.io = NULL;
+    stack_rgn.offset = 0;
+    stack_rgn.data_start = stack_rgn.start;
+    stack_rgn.data_end = stack_rgn.start;
+    stack_rgn.flags = PTE_R | PTE_W | PTE_U;
+    stack_rgn.shared = 0;
+    memory_add_region(&stack_rgn);
+
+    current_process()->fault_prev = 0;
+    current_process()->fault_next = 0;
+    current_process()->fault_window = 0;
+
+    // (c) load the executable from io interface into memory. The segments
+    // are demand-paged, and their regions keep their own references to exeio
     result = elf_load(exeio, &entry_point);
+    ioclose(exeio);
 
     if (result < 0) {
         kprintf("process_exec: elf load failed\n");
@@ -147,8 +208,11 @@ void __attribute__ ((noreturn)) process_exit(void) {
 
     if (!current_proc) panic("prcess_exit: current process doesn't exist, ::confused_face_emoji\n");
 
-    // reclaim the memory space
+    // reclaim the memory space; its root table is gone, so the process now
+    // refers to the main memory space
     memory_space_reclaim();
+    current_proc->mtag = main_mtag;
+    memory_clear_regions();
 
     // close open io device
     for (int i = 0; i < PROCESS_IOMAX; i++) {
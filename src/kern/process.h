@@ -8,6 +8,16 @@
 #define PROCESS_IOMAX 16
 #endif
 
+#ifndef PROCESS_VMMAX
+#define PROCESS_VMMAX 16
+#endif
+
+// NPROC is the maximum number of processes
+
+#ifndef NPROC
+#define NPROC 16
+#endif
+
 #include "config.h"
 #include "io.h"
 #include "thread.h"
@@ -26,6 +36,10 @@ struct process {
     int tid; // thread id of associated thread
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct vm_region vmtab[PROCESS_VMMAX]; // lazily populated memory regions
+    unsigned long rss; // resident user pages (shared pages count in each process)
+    uintptr_t fault_prev, fault_next; // range mapped by the last fault-around
+    unsigned int fault_window; // pages mapped by the next fault-around
 };
 
 // EXPORTED VARIABLES DECLARATIONS
@@ -44,6 +58,16 @@ extern void __attribute__ ((noreturn)) process_exit(void);
 
 extern void process_terminate(int pid);
 
+// struct process * process_alloc(void)
+// Allocates a zeroed struct process and enters it in proctab, with its id set
+// to its proctab index. Returns NULL if proctab is full.
+// void process_free(struct process * proc)
+// Removes a process allocated by process_alloc from proctab and frees it. The
+// main process is never freed.
+
+extern struct process * process_alloc(void);
+extern void process_free(struct process * proc);
+
 static inline struct process * current_process(void);
 static inline int current_pid(void);
 
@@ -0,0 +1,136 @@
+// shm.c - Shared memory objects
+//
+
+#include "shm.h"
+#include "memory.h"
+#include "heap.h"
+#include "halt.h"
+#include "error.h"
+#include "string.h"
+
+#include <stdint.h>
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct shm_object {
+    struct io_intf io_intf;
+    size_t page_cnt;
+    void * pages[]; // page_cnt pages, NULL until first accessed
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void shm_close(struct io_intf * io);
+static int shm_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static inline struct shm_object * io_to_shm(struct io_intf * io);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct io_ops shm_ops = {
+    .close = shm_close,
+    .ctl = shm_ioctl
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * creates a shared memory object
+ * 
+ * @param size      size of the object in bytes, rounded up to a whole page
+ * @param ioptr     receives the I/O interface of the object, with one reference
+ * 
+ * @return          returns 0 on success, -EINVAL if the size is 0 or larger than
+ *                  SHM_MAX_PAGES pages
+ */
+
+int shm_create(size_t size, struct io_intf ** ioptr) {
+    struct shm_object * shm;
+    size_t page_cnt;
+
+    if (size == 0 || size > SHM_MAX_PAGES * PAGE_SIZE)
+        return -EINVAL;
+    
+    page_cnt = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    shm = kmalloc(sizeof(struct shm_object) + page_cnt * sizeof(void *));
+    
+    shm->io_intf.ops = &shm_ops;
+    shm->io_intf.refcnt = 1;
+    shm->page_cnt = page_cnt;
+    memset(shm->pages, 0, page_cnt * sizeof(void *));
+
+    *ioptr = &shm->io_intf;
+    return 0;
+}
+
+/**
+ * returns the size of a shared memory object in bytes, or 0 if the I/O object is
+ * not a shared memory object
+ */
+
+size_t shm_size(struct io_intf * io) {
+    if (io->ops != &shm_ops)
+        return 0;
+    
+    return io_to_shm(io)->page_cnt * PAGE_SIZE;
+}
+
+/**
+ * returns a page of a shared memory object, allocating a zeroed page if the page
+ * has not been accessed before
+ * 
+ * @param io    shared memory object
+ * @param idx   page number within the object; must be less than the page count
+ * 
+ * @return      returns the direct-mapped address of the page, or NULL if memory and
+ *              swap are exhausted
+ */
+
+void * shm_page(struct io_intf * io, size_t idx) {
+    struct shm_object * const shm = io_to_shm(io);
+
+    if (idx >= shm->page_cnt)
+        panic("shm_page: page out of range");
+    
+    if (shm->pages[idx] == NULL)
+        shm->pages[idx] = memory_try_alloc_page();
+    
+    return shm->pages[idx];
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Called when the last reference to the object is dropped. Mappings hold
+// references of their own, so the object is no longer mapped anywhere and
+// dropping the object's page references frees the pages.
+
+void shm_close(struct io_intf * io) {
+    struct shm_object * const shm = io_to_shm(io);
+    size_t i;
+
+    for (i = 0; i < shm->page_cnt; i++) {
+        if (shm->pages[i] != NULL)
+            memory_free_page(shm->pages[i]);
+    }
+
+    kfree(shm);
+}
+
+int shm_ioctl(struct io_intf * io, int cmd, void * arg) {
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t *)arg = shm_size(io);
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+static inline struct shm_object * io_to_shm(struct io_intf * io) {
+    return (void*)io - offsetof(struct shm_object, io_intf);
+}
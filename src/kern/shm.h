@@ -0,0 +1,49 @@
+// shm.h - Shared memory objects
+//
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include "io.h"
+
+#include <stddef.h>
+
+// COMPILE-TIME CONFIGURATION
+//
+
+// Largest shared memory object, in pages. The page table of an object must
+// fit in one small heap allocation.
+
+#ifndef SHM_MAX_PAGES
+#define SHM_MAX_PAGES 256
+#endif
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// int shm_create(size_t size, struct io_intf ** ioptr)
+// Creates a shared memory object of /size/ bytes (rounded up to a whole page)
+// and stores an I/O interface for it in *ioptr, with one reference. The object
+// lives in the open-file table of a process like any other I/O object, and is
+// mapped with memory_mmap_shared; every mapping of the object takes its own
+// reference. The object and its pages are freed when the last reference is
+// dropped. Pages are allocated, zero-filled, on first access. Supports
+// IOCTL_GETLEN. Returns 0 or -EINVAL if /size/ is 0 or too large.
+
+extern int shm_create(size_t size, struct io_intf ** ioptr);
+
+// size_t shm_size(struct io_intf * io)
+// Returns the size in bytes of the shared memory object /io/, or 0 if /io/ is
+// not a shared memory object.
+
+extern size_t shm_size(struct io_intf * io);
+
+// void * shm_page(struct io_intf * io, size_t idx)
+// Returns page /idx/ of the shared memory object /io/, allocating it if it was
+// never accessed, or NULL if memory and swap are exhausted. The object keeps
+// its own reference to the page; a caller that maps the page adds one with
+// memory_page_ref.
+
+extern void * shm_page(struct io_intf * io, size_t idx);
+
+#endif // _SHM_H_
@@ -0,0 +1,464 @@
+// slab.c - Slab allocator for small allocations
+//
+// Small requests are served from size classes (16 to 2048 bytes), each an
+// object cache. A cache keeps its objects in slabs: blocks of 2^order pages
+// from the page allocator, starting with a struct slab header and followed by
+// equal-sized objects. Free objects of a slab are linked through their first
+// word. Requests larger than the largest size class get a block of pages of
+// their own. kfree finds the slab (or block) of a pointer through the page's
+// struct page descriptor.
+//
+
+#ifndef TRACE
+#ifdef HEAP_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef HEAP_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "heap.h"
+
+#include "console.h"
+#include "string.h"
+#include "halt.h"
+#include "memory.h"
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Maximum number of object caches, including the size classes.
+
+#ifndef HEAP_CACHE_MAX
+#define HEAP_CACHE_MAX 16
+#endif
+
+// Minimum number of objects per slab, and largest slab order used to reach it.
+
+#define SLAB_MIN_OBJS 4
+#define SLAB_MAX_ORDER 3
+
+#define SLAB_ALIGN 16 // alignment of objects
+
+#define SIZE_CLASS_MIN 16
+#define SIZE_CLASS_MAX 2048
+#define SIZE_CLASS_CNT 8 // 16, 32, ..., 2048
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct slab {
+    struct kmem_cache * cache;
+    struct slab * next; // in the cache's partial or full list
+    struct slab * prev;
+    void * free; // free objects, linked through their first word
+    unsigned int inuse; // objects handed out
+};
+
+// Size of the slab header, rounded up so that the objects are aligned
+
+#define SLAB_HDR_SIZE \
+    ((sizeof(struct slab) + SLAB_ALIGN-1) / SLAB_ALIGN * SLAB_ALIGN)
+
+struct kmem_cache {
+    const char * name;
+    size_t objsize; // object size, rounded up to SLAB_ALIGN
+    unsigned int order; // slab order
+    unsigned int objcnt; // objects per slab
+    struct slab * partial; // slabs with free objects
+    struct slab * full; // slabs without
+    unsigned long inuse; // objects handed out
+    unsigned long allocs; // objects allocated since boot
+    unsigned long frees; // objects freed since boot
+    unsigned long slabs; // slabs currently allocated
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char heap_initialized = 0;
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct kmem_cache caches[HEAP_CACHE_MAX];
+static int cache_cnt;
+
+// The first SIZE_CLASS_CNT caches are the size classes
+
+static struct kmem_cache * const size_classes = caches;
+
+static const char * const size_class_names[SIZE_CLASS_CNT] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+// Requests served by the page allocator directly
+
+static unsigned long large_pages; // pages currently allocated
+static unsigned long large_allocs;
+static unsigned long large_frees;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline void * slab_objs(const struct slab * slab);
+static struct slab * slab_create(struct kmem_cache * cache);
+static void slab_destroy(struct slab * slab);
+static void slab_list_insert(struct slab ** list, struct slab * slab);
+static void slab_list_remove(struct slab ** list, struct slab * slab);
+static struct kmem_cache * size_class(size_t size);
+static size_t alloc_size(void * ptr);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// The slab allocator takes all of its memory from the page allocator, so the
+// initial heap block is not used.
+
+void heap_init(void * start, void * end) {
+    size_t size;
+    int i;
+
+    trace("%s(%p,%p)", __func__, start, end);
+    assert (start <= end);
+
+    size = SIZE_CLASS_MIN;
+
+    for (i = 0; i < SIZE_CLASS_CNT; i++) {
+        kmem_cache_create(size_class_names[i], size);
+        size *= 2;
+    }
+
+    heap_initialized = 1;
+}
+
+struct kmem_cache * kmem_cache_create(const char * name, size_t size) {
+    struct kmem_cache * cache;
+    unsigned int order;
+
+    trace("%s(%s,%zu)", __func__, name, size);
+
+    if (cache_cnt == HEAP_CACHE_MAX)
+        panic("Too many object caches (increase HEAP_CACHE_MAX)");
+    
+    if (size == 0 || SIZE_CLASS_MAX < size)
+        panic("kmem_cache_create: bad object size");
+    
+    cache = &caches[cache_cnt++];
+    cache->name = name;
+    cache->objsize = (size + SLAB_ALIGN-1) / SLAB_ALIGN * SLAB_ALIGN;
+
+    // Use the smallest slab that holds SLAB_MIN_OBJS objects
+    for (order = 0; order < SLAB_MAX_ORDER; order++) {
+        if (SLAB_MIN_OBJS * cache->objsize <= (PAGE_SIZE << order) - SLAB_HDR_SIZE)
+            break;
+    }
+
+    cache->order = order;
+    cache->objcnt = ((PAGE_SIZE << order) - SLAB_HDR_SIZE) / cache->objsize;
+    
+    debug("cache %s: %zu bytes, %u per slab of order %u",
+        name, cache->objsize, cache->objcnt, order);
+
+    return cache;
+}
+
+void * kmem_cache_alloc(struct kmem_cache * cache) {
+    struct slab * slab;
+    void * obj;
+
+    slab = cache->partial;
+
+    if (slab == NULL) {
+        slab = slab_create(cache);
+        slab_list_insert(&cache->partial, slab);
+    }
+    
+    obj = slab->free;
+    slab->free = *(void **)obj;
+    slab->inuse += 1;
+
+    if (slab->free == NULL) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_insert(&cache->full, slab);
+    }
+
+    cache->inuse += 1;
+    cache->allocs += 1;
+
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache * cache, void * obj) {
+    struct slab * slab;
+    struct page * pg;
+
+    if (obj == NULL)
+        return;
+    
+    pg = memory_page(obj);
+
+    if (!(pg->flags & PAGE_SLAB) || ((struct slab *)pg->slab)->cache != cache)
+        panic("kmem_cache_free: object not from this cache");
+    
+    slab = pg->slab;
+
+    if (obj < slab_objs(slab) || (obj - slab_objs(slab)) % cache->objsize != 0)
+        panic("kmem_cache_free: misaligned object");
+    
+    if (slab->free == NULL) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_insert(&cache->partial, slab);
+    }
+
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->inuse -= 1;
+
+    cache->inuse -= 1;
+    cache->frees += 1;
+
+    // Keep one partial slab around, give the rest of the empty ones back
+    if (slab->inuse == 0 && (cache->partial != slab || slab->next != NULL)) {
+        slab_list_remove(&cache->partial, slab);
+        slab_destroy(slab);
+    }
+}
+
+void * kmalloc(size_t size) {
+    unsigned int order;
+    void * blk;
+
+    trace("%s(%zu)", __func__, size);
+
+    if (size <= SIZE_CLASS_MAX)
+        return kmem_cache_alloc(size_class(size));
+
+    // Larger requests get a block of pages of their own
+
+    order = 0;
+    while (order <= MEMORY_MAX_ORDER && (PAGE_SIZE << order) < size)
+        order += 1;
+    
+    if (MEMORY_MAX_ORDER < order)
+        panic("heap alloc request too large");
+    
+    blk = memory_alloc_pages(order);
+
+    while (blk == NULL && memory_reclaim(1UL << order) != 0)
+        blk = memory_alloc_pages(order);
+
+    if (blk == NULL)
+        panic("kmalloc: out of memory");
+    
+    memory_page(blk)->flags |= PAGE_KMALLOC;
+    memory_page(blk)->order = order;
+
+    large_pages += 1UL << order;
+    large_allocs += 1;
+
+    return blk;
+}
+
+void * kcalloc(size_t n, size_t size) {
+    void * ptr;
+
+    trace("%s(%zu,%zu)", __func__, n, size);
+
+    if (size != 0 && SIZE_MAX / size < n)
+        panic("heap alloc request too large");
+
+    ptr = kmalloc(n * size);
+    memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void * krealloc(void * ptr, size_t size) {
+    size_t old_size;
+    void * new_ptr;
+
+    trace("%s(%p,%zu)", __func__, ptr, size);
+
+    if (ptr == NULL)
+        return kmalloc(size);
+    
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    old_size = alloc_size(ptr);
+
+    if (size <= old_size)
+        return ptr;
+    
+    new_ptr = kmalloc(size);
+    memcpy(new_ptr, ptr, old_size);
+    kfree(ptr);
+    return new_ptr;
+}
+
+void kfree(void * ptr) {
+    struct page * pg;
+    unsigned int order;
+
+    trace("%s(%p)", __func__, ptr);
+
+    if (ptr == NULL)
+        return;
+    
+    pg = memory_page(ptr);
+
+    if (pg->flags & PAGE_SLAB) {
+        kmem_cache_free(((struct slab *)pg->slab)->cache, ptr);
+        return;
+    }
+
+    if (!(pg->flags & PAGE_KMALLOC) || ((uintptr_t)ptr & (PAGE_SIZE-1)) != 0)
+        panic("kfree: pointer not from kmalloc");
+    
+    order = pg->order;
+    pg->flags &= ~PAGE_KMALLOC;
+
+    large_pages -= 1UL << order;
+    large_frees += 1;
+
+    memory_free_pages(ptr, order);
+}
+
+int heap_get_stats(int i, struct heap_stats * st) {
+    const struct kmem_cache * cache;
+
+    if (i < 0 || cache_cnt < i)
+        return -1;
+    
+    if (i == cache_cnt) {
+        // requests served by the page allocator
+        st->name = "kmalloc-pages";
+        st->objsize = PAGE_SIZE;
+        st->inuse = large_pages;
+        st->allocs = large_allocs;
+        st->frees = large_frees;
+        st->pages = large_pages;
+        return 0;
+    }
+
+    cache = &caches[i];
+    st->name = cache->name;
+    st->objsize = cache->objsize;
+    st->inuse = cache->inuse;
+    st->allocs = cache->allocs;
+    st->frees = cache->frees;
+    st->pages = cache->slabs << cache->order;
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Returns the address of the first object of /slab/.
+
+static inline void * slab_objs(const struct slab * slab) {
+    return (void*)slab + SLAB_HDR_SIZE;
+}
+
+// Allocates a slab for /cache/ and threads its objects onto its free list.
+// Every page of the slab points back at the slab header.
+
+struct slab * slab_create(struct kmem_cache * cache) {
+    struct slab * slab;
+    void * obj;
+    unsigned int i;
+
+    slab = memory_alloc_pages(cache->order);
+
+    while (slab == NULL && memory_reclaim(1UL << cache->order) != 0)
+        slab = memory_alloc_pages(cache->order);
+
+    if (slab == NULL)
+        panic("kmalloc: out of memory");
+    
+    for (i = 0; i < (1U << cache->order); i++) {
+        memory_page((void*)slab + i * PAGE_SIZE)->flags |= PAGE_SLAB;
+        memory_page((void*)slab + i * PAGE_SIZE)->slab = slab;
+    }
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    obj = slab_objs(slab) + (cache->objcnt - 1) * cache->objsize;
+
+    for (i = 0; i < cache->objcnt; i++) {
+        *(void **)obj = slab->free;
+        slab->free = obj;
+        obj -= cache->objsize;
+    }
+
+    cache->slabs += 1;
+    return slab;
+}
+
+// Gives the pages of an empty slab back to the page allocator.
+
+void slab_destroy(struct slab * slab) {
+    struct kmem_cache * const cache = slab->cache;
+    unsigned int i;
+
+    for (i = 0; i < (1U << cache->order); i++) {
+        memory_page((void*)slab + i * PAGE_SIZE)->flags &= ~PAGE_SLAB;
+        memory_page((void*)slab + i * PAGE_SIZE)->slab = NULL;
+    }
+
+    cache->slabs -= 1;
+    memory_free_pages(slab, cache->order);
+}
+
+void slab_list_insert(struct slab ** list, struct slab * slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+
+    if (*list != NULL)
+        (*list)->prev = slab;
+    
+    *list = slab;
+}
+
+void slab_list_remove(struct slab ** list, struct slab * slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+// Returns the smallest size class that fits /size/ bytes.
+
+struct kmem_cache * size_class(size_t size) {
+    int i = 0;
+
+    while (size_classes[i].objsize < size)
+        i += 1;
+    
+    return &size_classes[i];
+}
+
+// Returns the usable size of the allocation at /ptr/.
+
+size_t alloc_size(void * ptr) {
+    const struct page * const pg = memory_page(ptr);
+
+    if (pg->flags & PAGE_SLAB)
+        return ((struct slab *)pg->slab)->cache->objsize;
+    
+    return PAGE_SIZE << pg->order;
+}
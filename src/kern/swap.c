@@ -0,0 +1,525 @@
+// swap.c - Swap space for user pages
+//
+// The swap device is divided into page-sized slots. Free slots are tracked in
+// a bitmap; allocated slots have a reference count, since fork copies the page
+// table entries of swapped-out pages along with the others.
+//
+// The compressed pool sits in front of the device. A page is compressed with a
+// small LZ77 coder and stored in pool pages, which are divided into 64-byte
+// units; the units of each pool page are tracked in a one-word bitmap. A
+// stored object starts with a header that holds its length and reference
+// count. The swap entry of an object is POOL_ENTRY_BIT with the pool page
+// index and the first unit of the object.
+//
+
+#ifndef TRACE
+#ifdef SWAP_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef SWAP_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "swap.h"
+#include "memory.h"
+#include "heap.h"
+#include "halt.h"
+#include "console.h"
+#include "error.h"
+#include "lock.h"
+#include "string.h"
+
+#include <stdint.h>
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+#define MAP_BITS 64 // slots per bitmap word
+
+#define POOL_UNIT 64 // allocation unit of the compressed pool
+#define POOL_UNITS (PAGE_SIZE / POOL_UNIT) // units per pool page (one map word)
+#define POOL_ENTRY_BIT (1UL << 40) // tags swap entries of the compressed pool
+
+// A page is only kept in the pool if it compresses to 3/4 of a page or less,
+// header included.
+
+#define POOL_MAX_LEN (PAGE_SIZE * 3 / 4 - sizeof(struct pool_obj))
+
+// LZ77 coder: a match is coded in two bytes, a 12-bit offset and a 4-bit
+// length code; the code LZ_LEN_EXT is followed by a byte that extends the
+// length. A control byte before every eight items tells matches from
+// literal bytes.
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_OFFSET 4095
+#define LZ_LEN_EXT 15
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + LZ_LEN_EXT + 255)
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Object in the compressed pool, starting at a unit boundary
+
+struct pool_obj {
+    uint16_t len; // compressed length
+    uint8_t refcnt;
+    uint8_t units; // units taken up, header included
+    uint8_t data[];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct pool_obj * pool_obj(unsigned long entry);
+static long pool_alloc(unsigned int units, void ** pageptr);
+static int pool_fit(uint64_t map, unsigned int units);
+
+static size_t lz_compress(const uint8_t * src, uint8_t * dst, size_t dstmax);
+static int lz_decompress(const uint8_t * src, size_t len, uint8_t * dst);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct io_intf * swap_io;
+
+// A seek and the transfer that follows it must not be separated.
+
+static struct lock swap_io_lock;
+
+static uint64_t * slot_map; // bit set for each allocated slot
+static uint8_t * slot_refs; // references to each allocated slot
+static unsigned long slot_cnt;
+static unsigned long slot_used;
+static unsigned long slot_hint; // bitmap word to search first
+
+static void * pool_pages[SWAP_POOL_MAX_PAGES]; // NULL if unused
+static uint64_t pool_maps[SWAP_POOL_MAX_PAGES]; // bit set for each used unit
+static unsigned long pool_page_cnt;
+static unsigned long pool_stored; // pages stored in the pool
+
+// Compression output and the LZ77 match table. Compressing never sleeps, so
+// one of each is enough.
+
+static uint8_t lz_buf[PAGE_SIZE];
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * attaches a block device as swap space
+ *
+ * @param io        block device, whose reference passes to the swap code
+ *
+ * @return          returns 0 on success or a negative error code if the device
+ *                  length cannot be read or is smaller than a page
+ */
+
+int swap_attach(struct io_intf * io) {
+    uint64_t len;
+    int result;
+
+    trace("%s(%p)", __func__, io);
+
+    result = ioctl(io, IOCTL_GETLEN, &len);
+
+    if (result != 0)
+        return result;
+
+    if (len < PAGE_SIZE)
+        return -EINVAL;
+
+    slot_cnt = len / PAGE_SIZE;
+
+    if (SWAP_MAX_SLOTS < slot_cnt)
+        slot_cnt = SWAP_MAX_SLOTS;
+
+    slot_map = kcalloc((slot_cnt + MAP_BITS-1) / MAP_BITS, sizeof(uint64_t));
+    slot_refs = kcalloc(slot_cnt, sizeof(uint8_t));
+    lock_init(&swap_io_lock, "swap_io_lock");
+    swap_io = io;
+
+    kprintf("Swap: %lu KB\n", slot_cnt * (PAGE_SIZE / 1024));
+    return 0;
+}
+
+/**
+ * compresses a page into the compressed pool
+ *
+ * @param page      allocated, unmapped page, consumed on success
+ *
+ * @return          returns the swap entry of the stored page, -EINVAL if the page
+ *                  does not compress to POOL_MAX_LEN bytes, or -ENOMEM if the pool
+ *                  has no room for it
+ */
+
+long swap_store(void * page) {
+    struct pool_obj * obj;
+    unsigned int units;
+    void * pool_page;
+    size_t len;
+    long entry;
+
+    len = lz_compress(page, lz_buf, POOL_MAX_LEN);
+
+    if (len == 0)
+        return -EINVAL;
+
+    units = (sizeof(struct pool_obj) + len + POOL_UNIT-1) / POOL_UNIT;
+
+    // The pool may take the page itself, whose contents are in lz_buf now
+    pool_page = page;
+    entry = pool_alloc(units, &pool_page);
+
+    if (entry < 0)
+        return entry;
+
+    obj = pool_obj(entry);
+    obj->len = len;
+    obj->refcnt = 1;
+    obj->units = units;
+    memcpy(obj->data, lz_buf, len);
+
+    if (pool_page != NULL)
+        memory_free_page(pool_page);
+
+    pool_stored += 1;
+    return entry;
+}
+
+/**
+ * allocates a swap slot, searching the bitmap from the word of the last
+ * allocation
+ *
+ * @return          returns the slot number or -ENOMEM if no slot is free
+ */
+
+long swap_alloc(void) {
+    const unsigned long words = (slot_cnt + MAP_BITS-1) / MAP_BITS;
+    unsigned long w, i, slot;
+    uint64_t free_bits;
+
+    for (i = 0; i < words; i++) {
+        w = (slot_hint + i) % words;
+        free_bits = ~slot_map[w];
+
+        // bits past the last slot are never free
+        if (w == words-1 && slot_cnt % MAP_BITS != 0)
+            free_bits &= (1UL << (slot_cnt % MAP_BITS)) - 1;
+
+        if (free_bits == 0)
+            continue;
+
+        slot = w * MAP_BITS + __builtin_ctzl(free_bits);
+        slot_map[w] |= 1UL << (slot % MAP_BITS);
+        slot_refs[slot] = 1;
+        slot_used += 1;
+        slot_hint = w;
+        return slot;
+    }
+
+    return -ENOMEM;
+}
+
+void swap_dup(unsigned long entry) {
+    uint8_t * refcnt;
+
+    if (entry & POOL_ENTRY_BIT)
+        refcnt = &pool_obj(entry)->refcnt;
+    else if (entry < slot_cnt)
+        refcnt = &slot_refs[entry];
+    else
+        refcnt = NULL;
+
+    if (refcnt == NULL || *refcnt == 0)
+        panic("swap_dup: entry not allocated");
+
+    if (*refcnt == UINT8_MAX)
+        panic("swap_dup: too many references");
+
+    *refcnt += 1;
+}
+
+void swap_free(unsigned long entry) {
+    struct pool_obj * obj;
+    unsigned long idx;
+    unsigned int unit;
+
+    if (entry & POOL_ENTRY_BIT) {
+        obj = pool_obj(entry);
+
+        if (obj->refcnt == 0)
+            panic("swap_free: entry not allocated");
+
+        if (--obj->refcnt != 0)
+            return;
+
+        // give the units back, and the page once it is empty
+        idx = (entry & ~POOL_ENTRY_BIT) / POOL_UNITS;
+        unit = entry % POOL_UNITS;
+        pool_maps[idx] &= ~(((1UL << obj->units) - 1) << unit);
+        pool_stored -= 1;
+
+        if (pool_maps[idx] == 0) {
+            memory_free_page(pool_pages[idx]);
+            pool_pages[idx] = NULL;
+            pool_page_cnt -= 1;
+        }
+
+        return;
+    }
+
+    if (slot_cnt <= entry || slot_refs[entry] == 0)
+        panic("swap_free: entry not allocated");
+
+    slot_refs[entry] -= 1;
+
+    if (slot_refs[entry] == 0) {
+        slot_map[entry / MAP_BITS] &= ~(1UL << (entry % MAP_BITS));
+        slot_used -= 1;
+    }
+}
+
+/**
+ * writes a page to a swap slot
+ *
+ * @param slot      allocated slot
+ * @param page      page to write
+ *
+ * @return          returns 0 on success or -EIO
+ */
+
+int swap_write(unsigned long slot, const void * page) {
+    long len;
+
+    lock_acquire(&swap_io_lock);
+
+    if (ioseek(swap_io, (uint64_t)slot * PAGE_SIZE) != 0)
+        len = -EIO;
+    else
+        len = iowrite(swap_io, page, PAGE_SIZE);
+
+    lock_release(&swap_io_lock);
+
+    return (len == PAGE_SIZE) ? 0 : -EIO;
+}
+
+/**
+ * reads a page back from a swap slot or the compressed pool
+ *
+ * @param entry     allocated swap entry
+ * @param page      receives the page
+ *
+ * @return          returns 0 on success or -EIO
+ */
+
+int swap_read(unsigned long entry, void * page) {
+    const unsigned long slot = entry;
+    const struct pool_obj * obj;
+    long len;
+
+    if (entry & POOL_ENTRY_BIT) {
+        obj = pool_obj(entry);
+        return lz_decompress(obj->data, obj->len, page);
+    }
+
+    lock_acquire(&swap_io_lock);
+
+    if (ioseek(swap_io, (uint64_t)slot * PAGE_SIZE) != 0)
+        len = -EIO;
+    else
+        len = ioread_full(swap_io, page, PAGE_SIZE);
+
+    lock_release(&swap_io_lock);
+
+    return (len == PAGE_SIZE) ? 0 : -EIO;
+}
+
+void swap_usage(unsigned long * total, unsigned long * used) {
+    *total = slot_cnt;
+    *used = slot_used;
+}
+
+void swap_pool_usage(unsigned long * stored, unsigned long * pages) {
+    *stored = pool_stored;
+    *pages = pool_page_cnt;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Returns the object of the compressed pool entry /entry/.
+
+struct pool_obj * pool_obj(unsigned long entry) {
+    const unsigned long idx = (entry & ~POOL_ENTRY_BIT) / POOL_UNITS;
+
+    if (SWAP_POOL_MAX_PAGES <= idx || pool_pages[idx] == NULL)
+        panic("swap: bad pool entry");
+
+    return pool_pages[idx] + (entry % POOL_UNITS) * POOL_UNIT;
+}
+
+// Allocates /units/ consecutive units in a page of the compressed pool and
+// returns the swap entry of the first one, or -ENOMEM if the pool is full.
+// If no pool page has room, a new one is allocated; if no page is free, the
+// page *pageptr becomes the new pool page and *pageptr is set to NULL.
+
+long pool_alloc(unsigned int units, void ** pageptr) {
+    unsigned long idx, free_idx;
+    int unit;
+
+    free_idx = SWAP_POOL_MAX_PAGES;
+
+    for (idx = 0; idx < SWAP_POOL_MAX_PAGES; idx++) {
+        if (pool_pages[idx] == NULL) {
+            if (free_idx == SWAP_POOL_MAX_PAGES)
+                free_idx = idx;
+            continue;
+        }
+
+        unit = pool_fit(pool_maps[idx], units);
+
+        if (0 <= unit)
+            goto found;
+    }
+
+    if (free_idx == SWAP_POOL_MAX_PAGES)
+        return -ENOMEM;
+
+    idx = free_idx;
+    pool_pages[idx] = memory_alloc_pages(0);
+
+    if (pool_pages[idx] == NULL) {
+        pool_pages[idx] = *pageptr;
+        *pageptr = NULL;
+    }
+
+    pool_maps[idx] = 0;
+    pool_page_cnt += 1;
+    unit = 0;
+
+found:
+    pool_maps[idx] |= ((1UL << units) - 1) << unit;
+    return POOL_ENTRY_BIT | (idx * POOL_UNITS + unit);
+}
+
+// Returns the first unit of a run of /units/ free units in the pool page map
+// /map/, or -1 if there is none.
+
+int pool_fit(uint64_t map, unsigned int units) {
+    uint64_t starts = ~map;
+    unsigned int i;
+
+    // a bit survives if the i units above it are free as well
+    for (i = 1; i < units && starts != 0; i++)
+        starts &= ~map >> i;
+
+    return (starts != 0) ? __builtin_ctzl(starts) : -1;
+}
+
+// Compresses the page /src/ into /dst/. Returns the compressed length, or 0
+// if it would exceed /dstmax/ bytes.
+
+size_t lz_compress(const uint8_t * src, uint8_t * dst, size_t dstmax) {
+    size_t ip = 0, op = 0;
+    size_t ctrl, cand, len, off;
+    unsigned int h, i;
+
+    memset(lz_table, 0, sizeof(lz_table));
+
+    while (ip < PAGE_SIZE) {
+        // room for a control byte and eight items of at most three bytes
+        if (dstmax < op + 1 + 8 * 3)
+            return 0;
+
+        ctrl = op++;
+        dst[ctrl] = 0;
+
+        for (i = 0; i < 8 && ip < PAGE_SIZE; i++) {
+            len = 0;
+
+            if (ip + LZ_MIN_MATCH <= PAGE_SIZE) {
+                h = ((src[ip] << 16 | src[ip+1] << 8 | src[ip+2]) * 2654435761U)
+                    >> (32 - LZ_HASH_BITS);
+                cand = lz_table[h]; // position + 1, 0 if none
+                lz_table[h] = ip + 1;
+
+                if (cand != 0 && ip - (cand - 1) <= LZ_MAX_OFFSET) {
+                    cand -= 1;
+                    while (len < LZ_MAX_MATCH && ip + len < PAGE_SIZE &&
+                        src[cand + len] == src[ip + len])
+                        len += 1;
+                }
+            }
+
+            if (len < LZ_MIN_MATCH) {
+                dst[op++] = src[ip++];
+                continue;
+            }
+
+            off = ip - cand;
+            dst[ctrl] |= 1 << i;
+            dst[op++] = off >> 4;
+
+            if (len - LZ_MIN_MATCH < LZ_LEN_EXT)
+                dst[op++] = (off & 0xF) << 4 | (len - LZ_MIN_MATCH);
+            else {
+                dst[op++] = (off & 0xF) << 4 | LZ_LEN_EXT;
+                dst[op++] = len - LZ_MIN_MATCH - LZ_LEN_EXT;
+            }
+
+            ip += len;
+        }
+    }
+
+    return op;
+}
+
+// Decompresses /len/ bytes at /src/ into the page /dst/. Returns 0 on success
+// or -EIO if the data does not decode to exactly one page.
+
+int lz_decompress(const uint8_t * src, size_t len, uint8_t * dst) {
+    size_t ip = 0, op = 0;
+    size_t mlen, off;
+    unsigned int ctrl, i;
+
+    while (op < PAGE_SIZE && ip < len) {
+        ctrl = src[ip++];
+
+        for (i = 0; i < 8 && op < PAGE_SIZE && ip < len; i++) {
+            if (!(ctrl & (1 << i))) {
+                dst[op++] = src[ip++];
+                continue;
+            }
+
+            if (len < ip + 2)
+                return -EIO;
+
+            off = src[ip] << 4 | src[ip+1] >> 4;
+            mlen = (src[ip+1] & 0xF) + LZ_MIN_MATCH;
+            ip += 2;
+
+            if (mlen == LZ_MIN_MATCH + LZ_LEN_EXT) {
+                if (len <= ip)
+                    return -EIO;
+                mlen += src[ip++];
+            }
+
+            if (off == 0 || op < off || PAGE_SIZE < op + mlen)
+                return -EIO;
+
+            // byte by byte: the match may overlap its own output
+            while (mlen-- != 0) {
+                dst[op] = dst[op - off];
+                op += 1;
+            }
+        }
+    }
+
+    return (op == PAGE_SIZE && ip == len) ? 0 : -EIO;
+}
@@ -0,0 +1,86 @@
+// swap.h - Swap space for user pages
+//
+// A swapped-out page is identified by a swap entry. A page is either stored
+// compressed in a pool of RAM pages (see swap_store) or written to a slot of
+// the swap device, whose entry is the slot number (see swap_alloc).
+//
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include "config.h"
+#include "io.h"
+
+// COMPILE-TIME CONFIGURATION
+//
+
+// Largest number of swap slots (pages) used, whatever the size of the device.
+
+#ifndef SWAP_MAX_SLOTS
+#define SWAP_MAX_SLOTS 65536
+#endif
+
+// Largest number of pages in the compressed pool.
+
+#ifndef SWAP_POOL_MAX_PAGES
+#define SWAP_POOL_MAX_PAGES (RAM_SIZE / 4096 / 4)
+#endif
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// int swap_attach(struct io_intf * io)
+// Uses the block device /io/ as swap space, one page per slot. Takes over the
+// caller's reference to /io/. Returns 0 or a negative error code if the device
+// is too small to hold a page. Until a device is attached, swap_alloc fails.
+
+extern int swap_attach(struct io_intf * io);
+
+// long swap_store(void * page)
+// Compresses /page/ into the compressed pool and returns its swap entry with
+// one reference. On success the page, which must be allocated and unmapped,
+// is consumed: it is freed, or becomes a page of the pool if the pool needs
+// one and no free page is left. Returns -EINVAL if the page does not compress
+// well enough or -ENOMEM if the pool is full; the page is then left alone.
+// Never sleeps.
+
+extern long swap_store(void * page);
+
+// long swap_alloc(void)
+// Allocates a swap slot with one reference, to be filled with swap_write.
+// Returns the slot number, which is also its swap entry, or -ENOMEM if swap
+// is full (or there is no swap device).
+
+extern long swap_alloc(void);
+
+// void swap_dup(unsigned long entry)
+// void swap_free(unsigned long entry)
+// Add and drop a reference to a swap entry. An entry is shared by the copies
+// of a page table entry made by fork; its storage is freed, and may be used
+// again, when its last reference is dropped. Panic on an entry that is not
+// allocated or on reference count overflow.
+
+extern void swap_dup(unsigned long entry);
+extern void swap_free(unsigned long entry);
+
+// int swap_write(unsigned long slot, const void * page)
+// int swap_read(unsigned long entry, void * page)
+// Write a page to an allocated slot, and read any swap entry back into a
+// page. Transfers to and from the swap device sleep until done;
+// decompressing does not. Return 0 or -EIO.
+
+extern int swap_write(unsigned long slot, const void * page);
+extern int swap_read(unsigned long entry, void * page);
+
+// void swap_usage(unsigned long * total, unsigned long * used)
+// Stores the number of slots of the swap device and the number allocated.
+
+extern void swap_usage(unsigned long * total, unsigned long * used);
+
+// void swap_pool_usage(unsigned long * stored, unsigned long * pages)
+// Stores the number of pages held in the compressed pool and the number of
+// pages the pool takes up.
+
+extern void swap_pool_usage(unsigned long * stored, unsigned long * pages);
+
+#endif // _SWAP_H_
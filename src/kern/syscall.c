@@ -13,6 +13,21 @@
 #include "io.h"
 #include "timer.h"
 #include "heap.h"
+#include "shm.h"
+
+// Longest device or file name accepted by sysdevopen and sysfsopen, including
+// the null byte.
+
+#define SYSCALL_NAMEMAX 64
+
+// Largest kernel buffer of sysread and syswrite, as a page order. 32 pages
+// (128 kB) is the largest request the block device takes at once.
+
+#define SYSCALL_XFER_ORDER 5
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+static void * sysxfer_alloc(size_t len, unsigned int * order);
 
 /**
  * sysexit - Exits the current process
@@ -35,26 +50,34 @@ static int sysexit(void){
  * 
  * This msystem call outputs a string to a user-facing I/O interface.
  * The mesage must be a null terminated string, and the pointer must 
- * refer to a valid, user-accessible memory region
+ * refer to a valid, user-accessible memory region. The message is copied
+ * into a kernel page first; longer messages are truncated to a page.
  * 
  * @param msg       pointer to a null-terminated string to be printed
  * 
- * @return          returns 0 on success, or -1 if pointer is invalid
+ * @return          returns 0 on success, or -EINVAL if pointer is invalid
  */
 static int sysmsgout(const char *msg){
-    int result;
+    char * kmsg;
+    long len;
 
     trace("%s(msg=%p)", __func__, msg);
 
-    // Validate the pointer to ensure it's valid user memory and null-terminated
-    result = memory_validate_vstr(msg, PTE_U);
-    if (result != 0) {
-        return result;
-    } 
+    // Copy the message in, which also checks that it is valid user memory
+    kmsg = memory_alloc_page_nozero();
+    len = strncpy_from_user(kmsg, msg, PAGE_SIZE);
+
+    if (len < 0) {
+        memory_free_page(kmsg);
+        return len;
+    }
+
+    kmsg[MIN(len, PAGE_SIZE - 1)] = '\0';
     
     // Print message along w thread info
-    kprintf("Thread <%s:%d> says: %s\n", thread_name(running_thread()), running_thread(), msg);
+    kprintf("Thread <%s:%d> says: %s\n", thread_name(running_thread()), running_thread(), kmsg);
 
+    memory_free_page(kmsg);
     return 0;
 }
 
@@ -74,17 +97,21 @@ static int sysmsgout(const char *msg){
  *                  negative value from 'device_open' if device can't be opened
  */
 static int sysdevopen(int fd, const char *name, int instno){
+    char kname[SYSCALL_NAMEMAX];
+    long len;
+
     if (fd < 0 || fd >= PROCESS_IOMAX){
         return -EMFILE; //FD out of range
     }
-    // Attempt to open device name string 
-    if (memory_validate_vstr(name, PTE_U) != 0){
+    // Copy in the device name string
+    len = strncpy_from_user(kname, name, sizeof(kname));
+    if (len < 0 || len == sizeof(kname)){
         return -EINVAL; //invalid file name
     } 
 
     struct io_intf *dev_io = NULL;
     // Attempt to open the device 
-    int result = device_open(&dev_io, name, instno);
+    int result = device_open(&dev_io, kname, instno);
     if(result < 0){
         return result; // return error code from device open 
     }
@@ -108,15 +135,19 @@ static int sysdevopen(int fd, const char *name, int instno){
  *                  Negative value from fs_open if file cannot be opened
  */
 static int sysfsopen(int fd, const char *name){
+    char kname[SYSCALL_NAMEMAX];
+    long len;
+
     if (fd < 0 || fd >= PROCESS_IOMAX){
         return -EMFILE; // Invalid file name
     }
-    if(memory_validate_vstr(name, PTE_U | PTE_A) != 0){
+    len = strncpy_from_user(kname, name, sizeof(kname));
+    if(len < 0 || len == sizeof(kname)){
         return -EINVAL; // Invalid file name
     }
 
     struct io_intf *fs_io = NULL;
-    int result = fs_open(name, &fs_io);
+    int result = fs_open(kname, &fs_io);
     if(result < 0){
         return result;
     }
@@ -154,8 +185,10 @@ static int sysclose(int fd){
 /**
  * sysread - Reads data from a file descriptor.
  *
- * Validates the file descriptor and buffer, then reads up to `bufsz` bytes 
- * into `buf`.
+ * Validates the file descriptor, then reads up to `bufsz` bytes into `buf`.
+ * Data is read into a kernel buffer of up to 32 pages and copied out with
+ * copy_to_user one buffer at a time, which also checks the buffer. Reading
+ * stops after a short read.
  *
  * @param fd    File descriptor to read from.
  * @param buf   Buffer to store the data.
@@ -165,24 +198,50 @@ static int sysclose(int fd){
  */
 static long sysread(int fd, void *buf, size_t bufsz){
     struct process *proc = current_process();
+    unsigned int order;
+    size_t done = 0;
+    char * kbuf;
+    long result;
+    size_t n;
 
     if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
         return -EBADFD; // invalid file descriptor
     }
 
-    if (memory_validate_vptr_len(buf, bufsz, PTE_W | PTE_U) != 0){
-        return -EINVAL; // invalid buf pointers
+    kbuf = sysxfer_alloc(bufsz, &order);
+    result = 0;
+
+    while (done < bufsz) {
+        n = MIN(bufsz - done, PAGE_SIZE << order);
+        result = ioread(proc->iotab[fd], kbuf, n);
+
+        if (result <= 0)
+            break;
+        
+        if (copy_to_user(buf + done, kbuf, result) != 0) {
+            result = -EINVAL; // invalid buf pointer
+            break;
+        }
+
+        done += result;
+
+        if (result < n)
+            break;
     }
 
-    return proc->iotab[fd]->ops->read(proc->iotab[fd], buf, bufsz);
+    memory_free_pages(kbuf, order);
+
+    return (result < 0 && (done == 0 || result == -EINVAL)) ? result : done;
 }
 
 
 /**
  * syswrite - Writes data to a file descriptor.
  *
- * Validates the file descriptor and buffer, then writes up to `len` bytes 
- * from `buf`.
+ * Validates the file descriptor, then writes up to `len` bytes from `buf`.
+ * The data is copied into a kernel buffer of up to 32 pages with
+ * copy_from_user, which also checks the buffer, and written one buffer at a
+ * time. Writing stops after a short write.
  *
  * @param fd    File descriptor to write to.
  * @param buf   Buffer containing the data to write.
@@ -192,24 +251,84 @@ static long sysread(int fd, void *buf, size_t bufsz){
  */
 static long syswrite(int fd, const void *buf, size_t len){
     struct process *proc = current_process();
+    unsigned int order;
+    size_t done = 0;
+    char * kbuf;
+    long result;
+    size_t n;
 
     if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
         return -EBADFD; // invalid file descriptor
     }
 
-    if(memory_validate_vptr_len(buf, len, PTE_R | PTE_U) != 0){
-        return -EINVAL; // invalid buf pointer
+    kbuf = sysxfer_alloc(len, &order);
+    result = 0;
+
+    while (done < len) {
+        n = MIN(len - done, PAGE_SIZE << order);
+
+        if (copy_from_user(kbuf, buf + done, n) != 0) {
+            result = -EINVAL; // invalid buf pointer
+            break;
+        }
+
+        result = iowrite(proc->iotab[fd], kbuf, n);
+
+        if (result <= 0)
+            break;
+        
+        done += result;
+
+        if (result < n)
+            break;
+    }
+
+    memory_free_pages(kbuf, order);
+
+    return (result < 0 && (done == 0 || result == -EINVAL)) ? result : done;
+}
+
+
+/**
+ * sysxfer_alloc - Allocates the kernel buffer of a read or write.
+ *
+ * The buffer is the smallest block of pages that holds `len` bytes, up to
+ * 2^SYSCALL_XFER_ORDER pages, so that a large file transfer reaches the file
+ * system (and the device) in as few requests as possible. A smaller block is
+ * used if no such block is free, down to a single page.
+ *
+ * @param len   Number of bytes to transfer.
+ * @param order Receives the order of the block, for memory_free_pages.
+ *
+ * @return      Pointer to the buffer.
+ */
+static void * sysxfer_alloc(size_t len, unsigned int * order){
+    unsigned int ord = 0;
+    void * buf;
+
+    while (ord < SYSCALL_XFER_ORDER && (PAGE_SIZE << ord) < len)
+        ord++;
+
+    for (; 0 < ord; ord--) {
+        buf = memory_alloc_pages_nozero(ord);
+
+        if (buf != NULL) {
+            *order = ord;
+            return buf;
+        }
     }
 
-    return proc->iotab[fd]->ops->write(proc->iotab[fd], buf, len);
+    *order = 0;
+    return memory_alloc_page_nozero();
 }
 
 
 /**
  * sysioctl - Sends a control command to a device or file.
  *
- * Validates the file descriptor and argument, then performs the requested
- * control operation.
+ * Validates the file descriptor, then performs the requested control
+ * operation on a kernel copy of the argument, which is copied in from and
+ * out to user memory as the command requires.
  *
  * @param fd    File descriptor to operate on.
  * @param cmd   Command to execute.
@@ -219,6 +338,9 @@ static long syswrite(int fd, const void *buf, size_t len){
  */
 static int sysioctl(int fd, int cmd, void *arg){
     struct process *proc = current_process();
+    uint64_t karg = 0;
+    size_t argsz;
+    int result;
 
     if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
         return -EBADFD;
@@ -228,15 +350,20 @@ static int sysioctl(int fd, int cmd, void *arg){
         case IOCTL_GETLEN:
         case IOCTL_GETPOS:
         case IOCTL_GETBLKSZ:
-            // These commands only require read access to `arg`
-            if (arg && (memory_validate_vptr_len(arg, sizeof(uint64_t), PTE_W | PTE_U) != 0)) {
-                return -EINVAL; // Invalid or inaccessible `arg` pointer
-            }
+            // These commands only write `arg`
+            argsz = sizeof(uint64_t);
+            break;
+
+        case IOCTL_FLUSH:
+            // This command ignores `arg`
+            arg = NULL;
+            argsz = 0;
             break;
 
         case IOCTL_SETPOS:
-            // This command requires both read and write access to `arg`
-            if (arg && memory_validate_vptr_len(arg, sizeof(uint64_t), PTE_R | PTE_W | PTE_U) != 0) {
+            // This command reads `arg`
+            argsz = sizeof(uint64_t);
+            if (arg && copy_from_user(&karg, arg, argsz) != 0) {
                 return -EINVAL; // Invalid or inaccessible `arg` pointer
             }
             break;
@@ -245,8 +372,15 @@ static int sysioctl(int fd, int cmd, void *arg){
             return -ENOTSUP; // Unsupported command
     }
 
-    return proc->iotab[fd]->ops->ctl(proc->iotab[fd], cmd, arg);
+    result = ioctl(proc->iotab[fd], cmd, arg ? &karg : NULL);
 
+    if (result == 0 && arg && cmd != IOCTL_SETPOS &&
+        copy_to_user(arg, &karg, argsz) != 0)
+    {
+        return -EINVAL; // Invalid or inaccessible `arg` pointer
+    }
+
+    return result;
 }
 
 
@@ -328,29 +462,19 @@ static int sysusleep(unsigned long us){
  * @return The ID of the newly created child process to the parent, or -1 if the operation fails.
  */
 static int sysfork(const struct trap_frame *tfr){
-    //make a child process
-    struct process *child_proc;
-    for(int i = 0; i < 16; i++){ //16 is NPROC, the number of processes
-        if(proctab[i] == NULL){
-            child_proc = kmalloc(sizeof(struct process));
-            proctab[i] = child_proc;
-            break;
-        }
-    }
-    // ensure child proc is not null and is properly allocated
+    //make a child process; its id is its index in proctab
+    struct process *child_proc = process_alloc();
+    // fail if the process table is full
     if(!child_proc){
         return -1;
     }
-    // find the index into proctab array that child proc lives and set that as the tid for child
     struct process *current_proc = current_process();
-    for(int i = 0; i < 16; i++){
-        if(proctab[i] == child_proc){
-            child_proc->id = i;
-            break;
-        }
-    }
     child_proc->tid = -1; // Will be set by thread_fork_to_user
     child_proc->mtag = 0; // Will be set by memory_space_clone in thread_fork_to_user
+    child_proc->rss = current_proc->rss; // the child maps every page of the parent
+    child_proc->fault_prev = 0;
+    child_proc->fault_next = 0;
+    child_proc->fault_window = 0;
 
     // copy over iotab array to child, incrementing refcnt if io_intf exists
     for(int j = 0; j < PROCESS_IOMAX; j++){
@@ -360,19 +484,30 @@ static int sysfork(const struct trap_frame *tfr){
         child_proc->iotab[j] = current_proc->iotab[j];
     }
 
+    // the child shares the parent's regions, and with them the backing files
+    for(int j = 0; j < PROCESS_VMMAX; j++){
+        if (current_proc->vmtab[j].end != 0 && current_proc->vmtab[j].io)
+            ioref(current_proc->vmtab[j].io);
+
+        child_proc->vmtab[j] = current_proc->vmtab[j];
+    }
+
     // call thread fork to user to finish forking
     int result = thread_fork_to_user(child_proc, tfr);
 
-    // if it fails, set the memory assigned to child proc to 0 and decrement the refcnt
+    // if it fails, free the child proc and decrement the refcnt
     if(result<0){
-        memset(child_proc, 0, sizeof(struct process));
-        proctab[child_proc->id] = NULL;
+        process_free(child_proc);
 
         //decrement refcnt
         for(int j = 0; j < PROCESS_IOMAX; j++){
             if (current_proc->iotab[j]) 
                 ioclose(current_proc->iotab[j]);
         }
+        for(int j = 0; j < PROCESS_VMMAX; j++){
+            if (current_proc->vmtab[j].end != 0 && current_proc->vmtab[j].io)
+                ioclose(current_proc->vmtab[j].io);
+        }
         return result;
     }
     
@@ -382,6 +517,144 @@ static int sysfork(const struct trap_frame *tfr){
 }
 
 
+/**
+ * prot_to_pte_flags - Converts _mmap protection flags to PTE flags.
+ *
+ * @param prot  OR of PROT_READ, PROT_WRITE and PROT_EXEC.
+ *
+ * @return      The rwxug flags of a user page with that protection, or 0 if
+ *              `prot` has unknown bits or lacks PROT_READ.
+ */
+static uint_fast8_t prot_to_pte_flags(int prot){
+    uint_fast8_t flags = PTE_U;
+
+    if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) || !(prot & PROT_READ))
+        return 0;
+
+    flags |= PTE_R;
+    if (prot & PROT_WRITE) flags |= PTE_W;
+    if (prot & PROT_EXEC) flags |= PTE_X;
+
+    return flags;
+}
+
+
+/**
+ * sysmmap - Maps anonymous memory into the calling process.
+ *
+ * Adds a zero-filled region of at least `len` bytes to the process. Its pages
+ * are only allocated when first touched.
+ *
+ * @param addr  Preferred address of the region, or NULL.
+ * @param len   Size of the region in bytes.
+ * @param prot  Protection of the region (PROT_READ is required).
+ *
+ * @return      Address of the region, or a negative error code.
+ */
+static long sysmmap(void *addr, size_t len, int prot){
+    const uint_fast8_t flags = prot_to_pte_flags(prot);
+
+    if (flags == 0){
+        return -EINVAL;
+    }
+
+    return memory_mmap((uintptr_t)addr, len, flags);
+}
+
+
+/**
+ * sysmunmap - Unmaps a range of the calling process's memory.
+ *
+ * @param addr  Start of the range, page aligned.
+ * @param len   Size of the range in bytes.
+ *
+ * @return      0 on success, or a negative error code.
+ */
+static int sysmunmap(void *addr, size_t len){
+    return memory_munmap(addr, len);
+}
+
+
+/**
+ * sysmprotect - Changes the protection of a range of the calling process's memory.
+ *
+ * @param addr  Start of the range, page aligned. The range must be mapped.
+ * @param len   Size of the range in bytes.
+ * @param prot  New protection (PROT_READ is required).
+ *
+ * @return      0 on success, or a negative error code.
+ */
+static int sysmprotect(void *addr, size_t len, int prot){
+    const uint_fast8_t flags = prot_to_pte_flags(prot);
+
+    if (flags == 0){
+        return -EINVAL;
+    }
+
+    return memory_mprotect(addr, len, flags);
+}
+
+
+/**
+ * sysshmcreate - Creates a shared memory object and associates it with a fd.
+ *
+ * The object is an I/O object like an open file: it is inherited by forked
+ * children and freed when its last descriptor is closed and its last mapping
+ * is removed.
+ *
+ * @param fd    File descriptor to associate with the object.
+ * @param size  Size of the object in bytes.
+ *
+ * @return      0 on success, -EMFILE if fd is out of range, or -EINVAL if the
+ *              size is invalid.
+ */
+static int sysshmcreate(int fd, size_t size){
+    struct io_intf *shm_io = NULL;
+    int result;
+
+    if (fd < 0 || fd >= PROCESS_IOMAX){
+        return -EMFILE;
+    }
+
+    result = shm_create(size, &shm_io);
+    if(result < 0){
+        return result;
+    }
+
+    current_process()->iotab[fd] = shm_io;
+
+    return 0;
+}
+
+
+/**
+ * sysshmmap - Maps a shared memory object into the calling process.
+ *
+ * The whole object is mapped; stores through the mapping are seen by every
+ * process that maps the object. The mapping is removed with _munmap.
+ *
+ * @param fd    File descriptor of the shared memory object.
+ * @param addr  Preferred address of the mapping, or NULL.
+ * @param prot  Protection of the mapping (PROT_READ is required).
+ *
+ * @return      Address of the mapping, or a negative error code.
+ */
+static long sysshmmap(int fd, void *addr, int prot){
+    struct process *proc = current_process();
+    const uint_fast8_t flags = prot_to_pte_flags(prot);
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
+        return -EBADFD;
+    }
+
+    if (flags == 0){
+        return -EINVAL;
+    }
+
+    return memory_mmap_shared(proc->iotab[fd], (uintptr_t)addr, flags);
+}
+
+
 /**
  * syscall - Dispatches the appropriate system call.
  *
@@ -427,6 +700,21 @@ int64_t syscall(struct trap_frame * tfr){
         case SYSCALL_FORK:
             return sysfork((const struct trap_frame *)tfr);
             break;
+        case SYSCALL_MMAP:
+            return sysmmap((void *)a[0], (size_t)a[1], a[2]);
+            break;
+        case SYSCALL_MUNMAP:
+            return sysmunmap((void *)a[0], (size_t)a[1]);
+            break;
+        case SYSCALL_MPROTECT:
+            return sysmprotect((void *)a[0], (size_t)a[1], a[2]);
+            break;
+        case SYSCALL_SHMCREATE:
+            return sysshmcreate(a[0], (size_t)a[1]);
+            break;
+        case SYSCALL_SHMMAP:
+            return sysshmmap(a[0], (void *)a[1], a[2]);
+            break;
         default:
             return -EINVAL; // Invalid syscall
             break;
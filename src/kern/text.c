@@ -0,0 +1,199 @@
+// text.c - Cache of read-only pages of executables
+//
+// Entries live in a fixed table and are chained into hash buckets by index.
+// The descriptor of a cached page has PAGE_TEXT set and holds the index of
+// its entry, so that text_release finds the entry without a search.
+//
+
+#ifndef TRACE
+#ifdef TEXT_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef TEXT_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "text.h"
+#include "memory.h"
+#include "console.h"
+#include "halt.h"
+
+#include <stdint.h>
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+#define TEXT_BUCKETS 64
+#define TEXT_NONE UINT16_MAX // end of a chain
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct text_entry {
+    uint64_t ino;
+    uint64_t off; // file offset of the page
+    uint16_t lo, hi; // file data within the page
+    uint16_t next; // next entry in the bucket or the free list
+    void * page; // NULL if the entry is free
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline unsigned int text_hash(uint64_t ino, uint64_t off);
+static void text_remove(uint16_t idx);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct text_entry text_table[TEXT_CACHE_MAX];
+static uint16_t text_buckets[TEXT_BUCKETS];
+static uint16_t text_free;
+static unsigned long text_cnt;
+static char text_initialized;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * looks up a cached page of an executable
+ *
+ * @param ino       inode of the file
+ * @param off       file offset of the page
+ * @param lo        offset of the first byte of file data in the page
+ * @param hi        offset past the last byte of file data in the page
+ *
+ * @return          returns the page with a new reference, or NULL if it is not
+ *                  cached
+ */
+
+void * text_lookup(uint64_t ino, uint64_t off, unsigned int lo, unsigned int hi) {
+    struct text_entry * ent;
+    uint16_t idx;
+
+    if (!text_initialized)
+        return NULL;
+
+    for (idx = text_buckets[text_hash(ino, off)]; idx != TEXT_NONE; idx = ent->next) {
+        ent = &text_table[idx];
+
+        if (ent->ino == ino && ent->off == off && ent->lo == lo && ent->hi == hi) {
+            memory_page_ref(ent->page);
+            return ent->page;
+        }
+    }
+
+    return NULL;
+}
+
+void text_insert (
+    uint64_t ino, uint64_t off, unsigned int lo, unsigned int hi, void * page)
+{
+    struct page * const pg = memory_page(page);
+    const unsigned int h = text_hash(ino, off);
+    struct text_entry * ent;
+    uint16_t idx;
+
+    trace("%s(%lu,%lu,%p)", __func__, (unsigned long)ino, (unsigned long)off, page);
+
+    if (!text_initialized) {
+        for (idx = 0; idx < TEXT_BUCKETS; idx++)
+            text_buckets[idx] = TEXT_NONE;
+        for (idx = 0; idx < TEXT_CACHE_MAX; idx++)
+            text_table[idx].next = (idx+1 < TEXT_CACHE_MAX) ? idx+1 : TEXT_NONE;
+        text_free = 0;
+        text_initialized = 1;
+    }
+
+    // a racing fault may have cached the same page first; this copy stays
+    // private to its process
+    for (idx = text_buckets[h]; idx != TEXT_NONE; idx = ent->next) {
+        ent = &text_table[idx];
+        if (ent->ino == ino && ent->off == off && ent->lo == lo && ent->hi == hi)
+            return;
+    }
+
+    if (text_free == TEXT_NONE || (pg->flags & PAGE_TEXT))
+        return;
+
+    idx = text_free;
+    ent = &text_table[idx];
+    text_free = ent->next;
+
+    ent->ino = ino;
+    ent->off = off;
+    ent->lo = lo;
+    ent->hi = hi;
+    ent->page = page;
+    ent->next = text_buckets[h];
+    text_buckets[h] = idx;
+
+    memory_page_ref(page);
+    pg->flags |= PAGE_TEXT;
+    pg->text = idx;
+    text_cnt += 1;
+}
+
+void text_release(void * page) {
+    struct page * const pg = memory_page(page);
+
+    if (!(pg->flags & PAGE_TEXT))
+        panic("text_release: page not cached");
+
+    text_remove(pg->text);
+}
+
+void text_invalidate(uint64_t ino) {
+    uint16_t idx;
+
+    if (!text_initialized)
+        return;
+
+    for (idx = 0; idx < TEXT_CACHE_MAX; idx++) {
+        if (text_table[idx].page != NULL && text_table[idx].ino == ino)
+            text_remove(idx);
+    }
+}
+
+unsigned long text_pages(void) {
+    return text_cnt;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline unsigned int text_hash(uint64_t ino, uint64_t off) {
+    return (ino * 31 + off / PAGE_SIZE) % TEXT_BUCKETS;
+}
+
+// Unlinks entry /idx/ from its bucket, puts it on the free list, and drops
+// the cache's reference to its page.
+
+void text_remove(uint16_t idx) {
+    struct text_entry * const ent = &text_table[idx];
+    uint16_t * link;
+    void * page;
+
+    link = &text_buckets[text_hash(ent->ino, ent->off)];
+
+    while (*link != idx) {
+        if (*link == TEXT_NONE)
+            panic("text_remove: entry not in its bucket");
+        link = &text_table[*link].next;
+    }
+
+    *link = ent->next;
+
+    page = ent->page;
+    ent->page = NULL;
+    ent->next = text_free;
+    text_free = idx;
+    text_cnt -= 1;
+
+    memory_page(page)->flags &= ~PAGE_TEXT;
+    memory_free_page(page);
+}
@@ -0,0 +1,61 @@
+// text.h - Cache of read-only pages of executables
+//
+// A read-only page of a file-backed region (the text and read-only data of an
+// executable) is cached by the inode of the file and the file offset of the
+// page, so that every process mapping the same page of the same file maps the
+// same physical page. The cache only holds pages that are mapped somewhere:
+// an entry is dropped when the last mapping of its page goes away.
+//
+
+#ifndef _TEXT_H_
+#define _TEXT_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME CONFIGURATION
+//
+
+// Largest number of pages in the cache.
+
+#ifndef TEXT_CACHE_MAX
+#define TEXT_CACHE_MAX 512
+#endif
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void * text_lookup(uint64_t ino, uint64_t off, unsigned int lo, unsigned int hi)
+// Returns the cached page at file offset /off/ of inode /ino/, with a new
+// reference for the caller to map, or NULL if it is not cached. Bytes /lo/ to
+// /hi/ of the page hold file data and the rest is zero; a page cached with a
+// different range does not match.
+
+extern void * text_lookup (
+    uint64_t ino, uint64_t off, unsigned int lo, unsigned int hi);
+
+// void text_insert(uint64_t ino, uint64_t off, unsigned int lo, unsigned int hi, void * page)
+// Caches /page/, filled as described for text_lookup, which must be mapped
+// read-only right away. The cache takes its own reference to the page. Does
+// nothing if the page is already cached or the cache is full.
+
+extern void text_insert (
+    uint64_t ino, uint64_t off, unsigned int lo, unsigned int hi, void * page);
+
+// void text_release(void * page)
+// Drops the cache entry of /page/ and the cache's reference to it. Called by
+// the memory manager when the last user mapping of a cached page goes away.
+
+extern void text_release(void * page);
+
+// void text_invalidate(uint64_t ino)
+// Drops all cache entries of inode /ino/, whose file has been written. Pages
+// that are still mapped stay mapped, but are no longer handed out.
+
+extern void text_invalidate(uint64_t ino);
+
+// unsigned long text_pages(void)
+// Returns the number of pages in the cache.
+
+extern unsigned long text_pages(void);
+
+#endif // _TEXT_H_
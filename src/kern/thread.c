@@ -24,8 +24,6 @@
 #define NTHR 16
 #endif
 
-#define SATP_ASID_MASK 0xFFFF0000000000ULL
-
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -92,6 +90,10 @@ static struct thread * thrtab[NTHR] = {
 
 static struct thread_list ready_list;
 
+// Object cache for the struct thread of spawned and forked threads
+
+static struct kmem_cache * thread_cache;
+
 // INTERNAL MACRO DEFINITIONS
 // 
 
@@ -206,9 +208,9 @@ int thread_fork_to_user(struct process *child_proc, const struct trap_frame *par
         return -1; // arguments invalid
     }
 
-    // allocate new memory for the child process
-    uint_fast16_t child_proc_asid = (int_fast16_t) ((child_proc->mtag & SATP_ASID_MASK) >> 44);
-    uintptr_t child_mtag = memory_space_clone(child_proc_asid);
+    // allocate new memory for the child process. The child's ASID is
+    // assigned when its memory space is first switched to
+    uintptr_t child_mtag = memory_space_clone(0);
 
     if (!child_mtag) {
         return -2; // memory space clone failed 
@@ -227,9 +229,9 @@ int thread_fork_to_user(struct process *child_proc, const struct trap_frame *par
 
     // Allocate a struct thread and a stack
 
-    child = kmalloc(sizeof(struct thread));
+    child = kmem_cache_alloc(thread_cache);
 
-    stack_page = memory_alloc_page();
+    stack_page = memory_alloc_page_nozero();
     stack_anchor = stack_page + PAGE_SIZE;
     stack_anchor -= 1;
     stack_anchor->thread = child;
@@ -266,8 +268,9 @@ int thread_fork_to_user(struct process *child_proc, const struct trap_frame *par
     // set child_thread process
     thread_set_process(tid, child_proc);
     
-    // switch memory spaces
+    // switch memory spaces; the child's space gets its ASID here
     memory_space_switch(child_mtag);
+    child_proc->mtag = active_memory_space();
 
     _thread_finish_fork(child, parent_tfr);
 
@@ -289,6 +292,7 @@ int running_thread(void) {
 }
 
 void thread_init(void) {
+    thread_cache = kmem_cache_create("thread", sizeof(struct thread));
     init_main_thread();
     init_idle_thread();
     set_running_thread(&main_thread);
@@ -316,9 +320,9 @@ int thread_spawn(const char * name, void (*start)(void *), void * arg) {
     
     // Allocate a struct thread and a stack
 
-    child = kmalloc(sizeof(struct thread));
+    child = kmem_cache_alloc(thread_cache);
 
-    stack_page = memory_alloc_page();
+    stack_page = memory_alloc_page_nozero();
     stack_anchor = stack_page + PAGE_SIZE;
     stack_anchor -= 1;
     stack_anchor->thread = child;
@@ -582,8 +586,14 @@ void recycle_thread(int tid) {
             thrtab[ctid]->parent = thr->parent;
     }
 
+    // A forked thread's process goes with it (spawned threads share the
+    // process of their parent)
+
+    if (thr->proc != NULL && thr->proc->tid == tid)
+        process_free(thr->proc);
+
     thrtab[tid] = NULL;
-    kfree(thr);
+    kmem_cache_free(thread_cache, thr);
 }
 
 void suspend_self(void) {
@@ -621,8 +631,13 @@ void suspend_self(void) {
 
     intr_enable();
 
-    if (next_thread->proc != NULL)
+    // Switching is skipped if the next thread runs in the active space. The
+    // process may be given a new ASID by the switch, so keep its mtag current.
+
+    if (next_thread->proc != NULL) {
         memory_space_switch(next_thread->proc->mtag);
+        next_thread->proc->mtag = active_memory_space();
+    }
 
     trace("Thread <%s> calling _thread_swtch(<%s>)",
         CURTHR->name, next_thread->name);
@@ -707,7 +722,8 @@ void tlappend(struct thread_list * l0, struct thread_list * l1) {
 }
 
 void idle_thread_func(void * arg __attribute__ ((unused))) {
-    // The idle thread sleeps using wfi if the ready list is empty. Note that we
+    // The idle thread zeroes free pages ahead of time and then sleeps using
+    // wfi if the ready list is empty. Note that we
     // need to disable interrupts before checking if the thread list is empty to
     // avoid a race condition where an ISR marks a thread ready to run between
     // the call to tlempty() and the wfi instruction.
@@ -718,6 +734,13 @@ void idle_thread_func(void * arg __attribute__ ((unused))) {
         while (!tlempty(&ready_list))
             thread_yield();
         
+        // Use idle time to refill the memory manager's pool of pre-zeroed
+        // pages. One page at a time, so that a thread made ready by an ISR
+        // gets the CPU back quickly.
+
+        if (memory_prezero_page())
+            continue;
+        
         // No runnable threads. Sleep using the wfi instruction. Note that we
         // need to disable interrupts and check the runnable thread list one
         // more time (make sure it is empty) to avoid a race condition where an
@@ -245,6 +245,129 @@ trap_umode_cont:
 
         j intr_handler
 
+        # User memory access. The kernel runs with sstatus.SUM clear, so it
+        # cannot touch user pages by accident. The routines below set SUM for
+        # the duration of the copy only. Every instruction that accesses user
+        # memory is listed in _user_fixup_table with the address at which
+        # execution resumes if the access faults and the fault cannot be
+        # resolved (see smode_excp_handler in excp.c). A trap taken inside a
+        # copy restores the saved sstatus, so SUM is still set when the copy
+        # continues.
+
+        .text
+        .global _user_memcpy
+        .type   _user_memcpy, @function
+
+/**
+ * _user_memcpy - copies memory with user page access enabled.
+ *
+ * Copies 8 bytes at a time when both pointers are 8-byte aligned, and one
+ * byte at a time otherwise (and for the tail).
+ *
+ * @param a0    destination
+ * @param a1    source
+ * @param a2    number of bytes to copy
+ * @return      0 on success, or the number of bytes not copied if an access
+ *              faulted
+ */
+
+_user_memcpy:
+        li      t0, 0x40000     # sstatus.SUM
+        csrs    sstatus, t0
+
+        or      t2, a0, a1
+        andi    t2, t2, 7
+        bnez    t2, 2f          # not aligned, copy bytes
+
+        li      t2, 8
+1:      bltu    a2, t2, 2f
+_user_memcpy_ld:
+        ld      t1, 0(a1)
+_user_memcpy_sd:
+        sd      t1, 0(a0)
+        addi    a0, a0, 8
+        addi    a1, a1, 8
+        addi    a2, a2, -8
+        j       1b
+
+2:      beqz    a2, 3f
+_user_memcpy_lb:
+        lbu     t1, 0(a1)
+_user_memcpy_sb:
+        sb      t1, 0(a0)
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        j       2b
+
+3:      csrc    sstatus, t0
+        li      a0, 0
+        ret
+
+_user_memcpy_fault:
+        li      t0, 0x40000     # sstatus.SUM
+        csrc    sstatus, t0
+        mv      a0, a2          # bytes left
+        ret
+
+        .global _user_strncpy
+        .type   _user_strncpy, @function
+
+/**
+ * _user_strncpy - copies a string from user memory.
+ *
+ * Copies bytes from the source up to and including the first null byte, but
+ * at most a2 bytes. The destination must be kernel memory.
+ *
+ * @param a0    destination
+ * @param a1    source (user memory)
+ * @param a2    maximum number of bytes to copy
+ * @return      length of the string if a null byte was copied, a2 if none
+ *              was found, or -1 if an access faulted
+ */
+
+_user_strncpy:
+        li      t0, 0x40000     # sstatus.SUM
+        csrs    sstatus, t0
+        li      t2, 0           # bytes copied
+
+1:      beq     t2, a2, 2f
+_user_strncpy_lb:
+        lbu     t1, 0(a1)
+        sb      t1, 0(a0)
+        beqz    t1, 2f
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    t2, t2, 1
+        j       1b
+
+2:      csrc    sstatus, t0
+        mv      a0, t2
+        ret
+
+_user_strncpy_fault:
+        li      t0, 0x40000     # sstatus.SUM
+        csrc    sstatus, t0
+        li      a0, -1
+        ret
+
+        # struct excp_fixup { uintptr_t insn; uintptr_t fixup; };
+
+        .section        .rodata, "a", @progbits
+        .balign 8
+        .global _user_fixup_table
+        .global _user_fixup_table_end
+
+_user_fixup_table:
+        .dword  _user_memcpy_ld, _user_memcpy_fault
+        .dword  _user_memcpy_sd, _user_memcpy_fault
+        .dword  _user_memcpy_lb, _user_memcpy_fault
+        .dword  _user_memcpy_sb, _user_memcpy_fault
+        .dword  _user_strncpy_lb, _user_strncpy_fault
+_user_fixup_table_end:
+
+        .text
+
         .global _mmode_trap_entry
         .type   _mmode_trap_entry, @function
         .balign 4 # Trap entry must be 4-byte aligned for mtvec CSR
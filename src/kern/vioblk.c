@@ -17,6 +17,10 @@
 
 #define VIOBLK_IRQ_PRIO 1
 
+//           Largest transfer of whole sectors in one request, in bytes
+
+#define VIOBLK_MAX_XFER (128 * 1024)
+
 //           INTERNAL CONSTANT DEFINITIONS
 //          
 
@@ -118,6 +122,13 @@ struct vioblk_device {
 
 static int vioblk_open(struct io_intf ** ioptr, void * aux);
 
+static void vioblk_transfer (
+    struct vioblk_device * dev,
+    uint32_t type,
+    uint64_t sector,
+    void * data,
+    unsigned long len);
+
 static void vioblk_close(struct io_intf * io);
 
 static long vioblk_read (
@@ -385,38 +396,27 @@ long vioblk_read (
         unsigned long bytes_available_in_block = dev->blksz - sector_offset;
 
         unsigned long bytes_remaining = bufsz - total_read;
-        unsigned long bytes_this_read = (bytes_available_in_block < bytes_remaining) ? bytes_available_in_block :
-                                                                                       bytes_remaining;
-
-        // set up descriptors
-        // request header
-        dev->vq.desc[1].addr = (uint64_t)&dev->vq.req_header;
-        dev->vq.desc[1].len = sizeof(struct vioblk_request_header);
-        dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[1].next = 1;
-
-        // data header
-        dev->vq.desc[2].addr = (uint64_t)dev->blkbuf;
-        dev->vq.desc[2].len = dev->blksz;
-        dev->vq.desc[2].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
-        dev->vq.desc[2].next = 2;
-
-        // set up request header
-        dev->vq.req_header.sector = sector_index;
-        dev->vq.req_header.type = VIRTIO_BLK_T_IN;
-
-        // set up avail ring
-        dev->vq.avail.ring[dev->vq.avail.idx % 1] = 0;
-        __sync_synchronize(); // mem barrier
-        dev->vq.avail.idx += 1;
-        __sync_synchronize(); // mem barrier
-
-        // notify the avail ring
-        virtio_notify_avail(dev->regs, 0);
-
-        uint64_t intr_state = intr_disable();
-        condition_wait(&dev->vq.used_updated);
-        intr_restore(intr_state);
+        unsigned long bytes_this_read;
+
+        // whole sectors go straight into the caller's buffer, as many as one
+        // request may carry
+        if (sector_offset == 0 && bytes_remaining >= dev->blksz) {
+            bytes_this_read = bytes_remaining - bytes_remaining % dev->blksz;
+            if (bytes_this_read > VIOBLK_MAX_XFER) bytes_this_read = VIOBLK_MAX_XFER;
+            if (bytes_this_read > dev->size - dev->pos) bytes_this_read = dev->size - dev->pos;
+
+            vioblk_transfer(dev, VIRTIO_BLK_T_IN, sector_index, buf + total_read, bytes_this_read);
+
+            dev->pos += bytes_this_read;
+            total_read += bytes_this_read;
+            continue;
+        }
+
+        bytes_this_read = (bytes_available_in_block < bytes_remaining) ? bytes_available_in_block :
+                                                                         bytes_remaining;
+
+        // partial sector: read it into the block buffer
+        vioblk_transfer(dev, VIRTIO_BLK_T_IN, sector_index, dev->blkbuf, dev->blksz);
 
         // data cooked; copy it back
         memcpy(buf + total_read, dev->blkbuf + sector_offset, bytes_this_read);
@@ -459,7 +459,7 @@ long vioblk_write (
 
     // very similar to read
     while (total_written < n) {
-        if (dev->pos >= dev->size) return 0;
+        if (dev->pos >= dev->size) break;
 
         // check how many bytes we can write to this file
         // take into consideration partial writes
@@ -469,74 +469,31 @@ long vioblk_write (
         unsigned long bytes_available_in_block = dev->blksz - sector_offset;
 
         unsigned long bytes_remaining = n - total_written;
-        unsigned long bytes_this_write = (bytes_available_in_block < bytes_remaining) ? bytes_available_in_block :
-                                                                                        bytes_remaining;
-
-        // check if its a partial block write
-        // if so we need to read the block in first
-        if (bytes_this_write != dev->blksz) {
-            // set up descriptors
-            // request header
-            dev->vq.desc[1].addr = (uint64_t)&dev->vq.req_header;
-            dev->vq.desc[1].len = sizeof(struct vioblk_request_header);
-            dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
-            dev->vq.desc[1].next = 1;
-
-            // data header
-            dev->vq.desc[2].addr = (uint64_t)dev->blkbuf;
-            dev->vq.desc[2].len = dev->blksz;
-            dev->vq.desc[2].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
-            dev->vq.desc[2].next = 2;
-
-            // set up request header
-            dev->vq.req_header.sector = sector_index;
-            dev->vq.req_header.type = VIRTIO_BLK_T_IN;
-
-            // set up avail ring
-            dev->vq.avail.ring[dev->vq.avail.idx % 1] = 0;
-            __sync_synchronize(); // mem barrier
-            dev->vq.avail.idx += 1;
-            __sync_synchronize(); // mem barrier
-
-            // notify the avail ring
-            virtio_notify_avail(dev->regs, 0);
-
-            uint64_t intr_state = intr_disable();
-            condition_wait(&dev->vq.used_updated);
-            intr_restore(intr_state);
-        }
+        unsigned long bytes_this_write;
 
-        memcpy(dev->blkbuf + sector_offset, buf + total_written, bytes_this_write);
+        // whole sectors are written straight from the caller's buffer, as
+        // many as one request may carry
+        if (sector_offset == 0 && bytes_remaining >= dev->blksz) {
+            bytes_this_write = bytes_remaining - bytes_remaining % dev->blksz;
+            if (bytes_this_write > VIOBLK_MAX_XFER) bytes_this_write = VIOBLK_MAX_XFER;
+            if (bytes_this_write > dev->size - dev->pos) bytes_this_write = dev->size - dev->pos;
 
-        // set up descriptors
-        // request header
-        dev->vq.desc[1].addr = (uint64_t)&dev->vq.req_header;
-        dev->vq.desc[1].len = sizeof(struct vioblk_request_header);
-        dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[1].next = 1;
+            vioblk_transfer(dev, VIRTIO_BLK_T_OUT, sector_index, (void *)buf + total_written, bytes_this_write);
 
-        // data header
-        dev->vq.desc[2].addr = (uint64_t)dev->blkbuf;
-        dev->vq.desc[2].len = dev->blksz;
-        dev->vq.desc[2].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[2].next = 2;
+            dev->pos += bytes_this_write;
+            total_written += bytes_this_write;
+            continue;
+        }
 
-        // set up request header
-        dev->vq.req_header.sector = sector_index;
-        dev->vq.req_header.type = VIRTIO_BLK_T_OUT;
+        bytes_this_write = (bytes_available_in_block < bytes_remaining) ? bytes_available_in_block :
+                                                                          bytes_remaining;
 
-        // set up avail ring
-        dev->vq.avail.ring[dev->vq.avail.idx % 1] = 0;
-        __sync_synchronize(); // mem barrier
-        dev->vq.avail.idx += 1;
-        __sync_synchronize(); // mem barrier
+        // partial block write: read the block in first
+        vioblk_transfer(dev, VIRTIO_BLK_T_IN, sector_index, dev->blkbuf, dev->blksz);
 
-        // notify the avail ring
-        virtio_notify_avail(dev->regs, 0);
+        memcpy(dev->blkbuf + sector_offset, buf + total_written, bytes_this_write);
 
-        uint64_t intr_state = intr_disable();
-        condition_wait(&dev->vq.used_updated);
-        intr_restore(intr_state);
+        vioblk_transfer(dev, VIRTIO_BLK_T_OUT, sector_index, dev->blkbuf, dev->blksz);
 
         dev->pos += bytes_this_write; 
         total_written += bytes_this_write;
@@ -546,6 +503,57 @@ long vioblk_write (
     return total_written;
 }
 
+// void vioblk_transfer (
+//    struct vioblk_device * dev,
+//    uint32_t type,
+//    uint64_t sector,
+//    void * data,
+//    unsigned long len);
+//
+// Submits one request of type VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT for /len/ bytes (whole sectors)
+// starting at /sector/, with /data/ as the data buffer, which must be direct-mapped memory. Must be
+// called with dev->io_lock held. Thread sleeps until the device has serviced the request.
+
+void vioblk_transfer (
+    struct vioblk_device * dev,
+    uint32_t type,
+    uint64_t sector,
+    void * data,
+    unsigned long len)
+{
+    // set up descriptors
+    // request header
+    dev->vq.desc[1].addr = (uint64_t)&dev->vq.req_header;
+    dev->vq.desc[1].len = sizeof(struct vioblk_request_header);
+    dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
+    dev->vq.desc[1].next = 1;
+
+    // data header; the device writes the buffer of a read
+    dev->vq.desc[2].addr = (uint64_t)data;
+    dev->vq.desc[2].len = len;
+    dev->vq.desc[2].flags = VIRTQ_DESC_F_NEXT;
+    if (type == VIRTIO_BLK_T_IN)
+        dev->vq.desc[2].flags |= VIRTQ_DESC_F_WRITE;
+    dev->vq.desc[2].next = 2;
+
+    // set up request header
+    dev->vq.req_header.sector = sector;
+    dev->vq.req_header.type = type;
+
+    // set up avail ring
+    dev->vq.avail.ring[dev->vq.avail.idx % 1] = 0;
+    __sync_synchronize(); // mem barrier
+    dev->vq.avail.idx += 1;
+    __sync_synchronize(); // mem barrier
+
+    // notify the avail ring
+    virtio_notify_avail(dev->regs, 0);
+
+    uint64_t intr_state = intr_disable();
+    condition_wait(&dev->vq.used_updated);
+    intr_restore(intr_state);
+}
+
 int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
     struct vioblk_device * const dev = (void*)io -
         offsetof(struct vioblk_device, io_intf);
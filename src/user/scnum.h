@@ -21,5 +21,11 @@
 #define SYSCALL_USLEEP  40
 #define SYSCALL_WAIT    41
 
+#define SYSCALL_MMAP    50
+#define SYSCALL_MUNMAP  51
+#define SYSCALL_MPROTECT 52
+#define SYSCALL_SHMCREATE 53
+#define SYSCALL_SHMMAP  54
+
 
 #endif // _SCNUM_H_
@@ -6,6 +6,12 @@
 
 #include <stddef.h>
 
+// Protection flags for _mmap and _mprotect. Every mapping must be readable.
+
+#define PROT_READ   (1 << 0)
+#define PROT_WRITE  (1 << 1)
+#define PROT_EXEC   (1 << 2)
+
 extern void __attribute__ ((noreturn)) _exit(void);
 extern void _msgout(const char * msg);
 extern int _close(int fd);
@@ -18,5 +24,10 @@ extern int _exec(int fd);
 extern int _fork(void);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
+extern void * _mmap(void * addr, size_t len, int prot);
+extern int _munmap(void * addr, size_t len);
+extern int _mprotect(void * addr, size_t len, int prot);
+extern int _shmcreate(int fd, size_t size);
+extern void * _shmmap(int fd, void * addr, int prot);
 
 #endif // _SYSCALL_H_
@@ -0,0 +1,56 @@
+#include "syscall.h"
+#include "string.h"
+
+#define SHM_SIZE (16 * 4096)
+
+void main(void) {
+    unsigned int * buf;
+    unsigned int i;
+    int pid;
+
+    // Create a shared memory object and map it before forking, so that the
+    // child inherits the mapping
+    if (_shmcreate(0, SHM_SIZE) < 0) {
+        _msgout("Parent: _shmcreate failed");
+        _exit();
+    }
+
+    buf = _shmmap(0, NULL, PROT_READ | PROT_WRITE);
+    if ((long)buf < 0) {
+        _msgout("Parent: _shmmap failed");
+        _exit();
+    }
+
+    _msgout("Parent: shared memory mapped");
+
+    pid = _fork();
+    if (pid < 0) {
+        _msgout("Parent: _fork failed");
+        _exit();
+    }
+
+    if (pid == 0) {
+        // Child process: produce the data
+        for (i = 0; i < SHM_SIZE / sizeof(unsigned int); i++)
+            buf[i] = i * 7;
+
+        _msgout("Child: buffer filled");
+        _exit();
+    } else {
+        // Parent process: consume it once the child is done
+        _wait(pid);
+
+        for (i = 0; i < SHM_SIZE / sizeof(unsigned int); i++) {
+            if (buf[i] != i * 7) {
+                _msgout("Parent: shared buffer mismatch");
+                _exit();
+            }
+        }
+
+        _msgout("Parent: shared buffer verified");
+
+        _munmap(buf, SHM_SIZE);
+        _close(0);
+        _exit();
+    }
+}